@@ -26,4 +26,14 @@ old_ctx = find_context("", old_chan);
 if (!set_context(old_ctx))
     print("Failed to set context!");
 else
-    print("This is the old context");
\ No newline at end of file
+    print("This is the old context");
+// with_context restores the previous context once the function returns
+with_context(old_ctx, function () {
+    print("Printed in the old context");
+});
+
+// for_each_context visits every matching tab, type 2 is a channel
+var visited = for_each_context({type: 2}, function () {
+    print("Hello from " + get_info("channel"));
+});
+print("Visited " + visited + " channels");
@@ -0,0 +1,21 @@
+SCRIPT_NAME = "nicks";
+SCRIPT_VER = "1";
+SCRIPT_DESC = "example of NickSet and NickMap";
+
+// Both use the server's casemapping unless one is given
+var friends = new NickSet();
+var lines = new NickMap("rfc1459");
+
+friends.add("TingPing");
+
+function chan_cb (params)
+{
+	var nick = params[0];
+
+	lines.set(nick, (lines.get(nick) || 0) + 1);
+
+	if (friends.has(nick)) // matches "tingping" or "TINGPING" too
+		print(nick + " has said " + lines.get(nick) + " lines");
+}
+
+hook_print("Channel Message", chan_cb);
@@ -0,0 +1,19 @@
+SCRIPT_NAME = "reload";
+SCRIPT_VER = "1";
+SCRIPT_DESC = "example of keeping state across /js reload";
+
+// Whatever the unload hook returned before a reload, null otherwise
+var seen = get_reload_state() || {};
+
+function chan_cb (params)
+{
+	seen[params[0]] = new Date();
+}
+
+function unload_cb ()
+{
+	return seen;
+}
+
+hook_print("Channel Message", chan_cb);
+hook_unload(unload_cb);
@@ -0,0 +1,37 @@
+SCRIPT_NAME = "table";
+SCRIPT_VER = "1";
+SCRIPT_DESC = "example of Table";
+
+// Saved in the config dir, the same name opens the same rows again
+var messages = new Table("messages", {
+	columns: {id: "int", nick: "string", time: "number"},
+	key: "id",
+	indexes: ["nick", "time"]
+});
+var next_id = messages.size();
+
+function chan_cb (params)
+{
+	messages.put({id: next_id++, nick: params[0], time: Date.now()});
+}
+
+function stats_cb (word)
+{
+	var day_ago = Date.now() - 24 * 60 * 60 * 1000;
+
+	// Counted natively, no rows are created in JS
+	var hours = messages.aggregate({
+		where: ["time", day_ago, Date.now()],
+		group: ["nick", {column: "time", bucket: 60 * 60 * 1000}]
+	});
+
+	hours.forEach(function (hour) {
+		print(hour.nick + " " + new Date(hour.time).getHours() + ":00 " + hour.count);
+	});
+	print(messages.count("nick", word[1]) + " lines by " + word[1]);
+
+	return EAT_ALL;
+}
+
+hook_print("Channel Message", chan_cb);
+hook_command("msgstats", stats_cb, "USAGE: msgstats <nick>");
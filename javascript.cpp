@@ -6,22 +6,49 @@
 #include <string>
 #include <fstream>
 #include <list>
+#include <vector>
+#include <map>
+#include <set>
+#include <unordered_map>
+#include <chrono>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <algorithm>
+#include <cmath>
+#include <cerrno>
+#include <cstdio>
+#include <sys/stat.h>
 
 #ifdef _WIN32
 #include <Shlwapi.h> // For PathIsRelative
+#include <direct.h> // For _mkdir
+#include <io.h> // For _commit
 #include "win32/dirent-win32.h"
 #include "win32/hexchat-plugin.h"
 #else
 #include <dirent.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
 #include <hexchat-plugin.h>
 #endif
+#if defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#define HJS_HAVE_SSE2
+#endif
 #include <jsapi.h>
+#include <jstypedarray.h>
 
 
 #define HJS_VERSION_STR "0.3"
 #define HJS_VERSION_FLOAT 0.3
 
 #define JSSTRING_TO_CHAR(jsstr) JS_EncodeString(context, jsstr)
+// hexchat itself only uses the first 4 but never limit scripts to that
+#define HJS_MAX_EVENT_ARGS 8
+#define EVENT_ARGS(args) args[0], args[1], args[2], args[3], args[4], args[5], args[6], args[7], nullptr
 #define DEFINE_GLOBAL_PROP(name, value) JS_DefineProperty (*cx, *globals, name, value, nullptr, nullptr, \
 														JSPROP_READONLY|JSPROP_PERMANENT)
 
@@ -58,9 +85,12 @@ enum hook_type
 	HOOK_PRINT,
 	HOOK_SERVER,
 	HOOK_TIMER,
-	HOOK_UNLOAD
+	HOOK_UNLOAD,
+	HOOK_SHARED
 };
 
+class js_script;
+
 typedef struct
 {
 	JSContext* context;
@@ -70,6 +100,317 @@ typedef struct
 	hook_type type;
 } script_hook;
 
+typedef struct
+{
+	char type;
+	string str;
+	long long num;
+} list_value;
+
+typedef struct
+{
+	string field;
+	char type;
+	string str;
+	int num;
+	time_t time;
+} list_filter;
+
+typedef struct
+{
+	unsigned int token;
+	vector<string> fields;
+	unordered_map<string, vector<list_value>> rows;
+} list_snapshot;
+
+typedef struct
+{
+	int priority;
+	hexchat_context* ctx;
+	js_script* owner; // nullptr for the interpreter
+	string verb;
+	string target;
+	string rest;
+	string cmd;
+} queued_command;
+
+typedef struct
+{
+	list<queued_command> commands;
+	double tokens;
+	chrono::steady_clock::time_point last_refill;
+	unsigned long sent;
+	unsigned long merged;
+	unsigned long dropped;
+} command_queue;
+
+typedef struct
+{
+	vector<jschar> text; // literal when field is empty
+	string field;
+	char modifier;
+	int color;
+} format_op;
+
+typedef struct
+{
+	vector<format_op> ops;
+	vector<jschar> buffer;
+} format_template;
+
+typedef basic_string<jschar> nick_key;
+
+struct nick_key_hash
+{
+	size_t operator() (const nick_key& key) const
+	{
+		uint32 hash = 2166136261u;
+		for (jschar c : key)
+		{
+			hash ^= c;
+			hash *= 16777619u;
+		}
+		return hash;
+	}
+};
+
+typedef struct
+{
+	const unsigned char* fold;
+	unordered_map<nick_key, nick_key, nick_key_hash> nicks; // folded to original
+} nick_collection;
+
+typedef struct
+{
+	uint32 first_line;
+	int32 day; // days since 1970-01-01
+} log_bucket;
+
+typedef struct
+{
+	uint32 id; // stored as <index>.<id>.seg
+	uint32 first_line;
+	uint32 lines;
+} log_segment;
+
+typedef struct
+{
+	uint64_t size; // bytes of the log covered
+	uint32 lines;
+	int32 year;
+	int32 month;
+	uint32 next_segment;
+	vector<log_bucket> buckets;
+	vector<log_segment> segments; // oldest first, their line ranges follow each other
+} log_index;
+
+typedef struct
+{
+	string path;
+	string network;
+	string channel;
+	string index_path; // prefix of every index file
+} log_file;
+
+typedef struct
+{
+	int32 day;
+	uint32 file;
+	uint64_t pos; // line id when indexed, byte offset otherwise
+	bool indexed;
+} log_match;
+
+// append-only file of length-prefixed key/value records, read through a memory map
+class record_file
+{
+	private:
+		string path;
+		FILE* out;
+		const char* data;
+		size_t mapped;
+		uint64_t size;
+		uint64_t garbage; // bytes of overwritten and deleted records
+		map<string, pair<uint64_t, uint32>> index; // key to value offset and length
+
+		bool remap ();
+		void unmap ();
+		bool append (const string&, const char*, uint32);
+
+	public:
+		record_file () : out(nullptr), data(nullptr), mapped(0), size(0), garbage(0) {}
+		record_file (const record_file&) = delete;
+		bool load (const string&);
+		bool get (const string&, const char**, size_t*);
+		bool has (const string& key) const { return index.count (key) > 0; }
+		bool put (const string&, const char*, size_t);
+		bool remove (const string&);
+		bool sync ();
+		bool compact ();
+		bool wasteful () const { return garbage > 65536 && garbage > size / 2; }
+		const map<string, pair<uint64_t, uint32>>& keys () const { return index; }
+		void close ();
+		~record_file () { close (); }
+};
+
+typedef struct
+{
+	int refs; // scripts sharing it, scripts with the same name use the same file
+	string path;
+	record_file records;
+} kv_store;
+
+typedef struct
+{
+	char type; // 'n'umber, 'b'oolean or 's'tring
+	double num;
+	nick_key str; // kept as UTF-16 so reads are a single copy
+} shared_value;
+
+typedef struct
+{
+	string prefix;
+	script_hook* hook;
+} shared_watcher;
+
+enum journal_sync
+{
+	JOURNAL_SYNC_NEVER,
+	JOURNAL_SYNC_BATCH,
+	JOURNAL_SYNC_SECOND
+};
+
+typedef struct
+{
+	journal_sync sync;
+	uint64_t max_size; // rotated before it grows past this
+	int keep; // rotated files kept as name.log.1 .. name.log.<keep>
+} journal_policy;
+
+typedef struct
+{
+	string path;
+	string record;
+	journal_policy policy;
+} journal_entry;
+
+typedef struct
+{
+	FILE* file;
+	uint64_t size;
+	chrono::steady_clock::time_point synced;
+	bool unsynced; // written since the last sync of a sync:"second" journal
+} journal_file;
+
+typedef struct
+{
+	int refs; // scripts sharing it, scripts with the same name use the same files
+	int transactions; // writes wait until the outermost transaction ends
+	string path;
+	map<string, string> values;
+	map<string, string> pending; // large values not yet in the record file
+	set<string> dirty; // set or deleted since the last flush
+	record_file large;
+} pref_store;
+
+typedef struct
+{
+	char type; // 0 for null, 'n'umber, 's'tring or 'b'oolean
+	double num;
+	string str;
+} table_value;
+
+// null sorts first, then booleans and numbers, then strings
+inline bool
+operator< (const table_value& a, const table_value& b)
+{
+	int rank_a = a.type == 0 ? 0 : a.type == 's' ? 2 : 1;
+	int rank_b = b.type == 0 ? 0 : b.type == 's' ? 2 : 1;
+
+	if (rank_a != rank_b)
+		return rank_a < rank_b;
+
+	return rank_a == 2 ? a.str < b.str : a.num < b.num;
+}
+
+typedef struct
+{
+	string name;
+	char type; // 'i'nt, 'n'umber, 's'tring or 'b'ool
+} table_column;
+
+typedef struct
+{
+	int refs; // Table objects sharing it, one file is only ever opened once
+	string path;
+	vector<table_column> columns;
+	size_t key;
+	map<table_value, vector<table_value>> rows;
+	map<size_t, set<pair<table_value, table_value>>> indexes; // column to value and primary key
+	record_file records;
+} table_data;
+
+typedef struct cache_data cache_data;
+
+typedef struct
+{
+	cache_data* owner;
+	string key;
+	char type; // 'u'ndefined, 'z' for null, 'b'oolean, 'n'umber, 's'tring or structured 'c'lone
+	double num;
+	basic_string<jschar> str;
+	vector<uint64> clone;
+	size_t size; // what it counts against the budget
+	chrono::steady_clock::time_point expires;
+} cache_entry;
+
+struct cache_data
+{
+	double ttl; // ms, 0 for never
+	unordered_map<string, list<cache_entry>::iterator> entries;
+	unsigned long hits, misses, evictions, expirations;
+	size_t bytes;
+};
+
+class value_cache
+{
+	private:
+		unsigned int generation;
+		map<string, jsval> values;
+
+	public:
+		value_cache () : generation(0) {}
+		bool lookup (JSContext*, unsigned int, const string&, jsval*);
+		void store (JSContext*, const string&, jsval);
+		void clear (JSContext*);
+};
+
+class scratch_encoder
+{
+	private:
+		JSContext* context;
+		char scratch[1024];
+		size_t used;
+		vector<char*> allocated;
+
+	public:
+		scratch_encoder (JSContext* cx) : context(cx), used(0) {}
+		char* encode (JSString*);
+		~scratch_encoder ();
+};
+
+class string_cache
+{
+	private:
+		size_t capacity;
+		list<pair<string, JSString*>> strings; // most recently used first
+		unordered_map<string, list<pair<string, JSString*>>::iterator> index;
+
+	public:
+		string_cache (size_t size) : capacity(size) {}
+		JSString* get (JSContext*, const char*);
+		void clear (JSContext*);
+};
+
 class js_script
 {
 	private:
@@ -84,6 +425,16 @@ class js_script
 		void* gui;
 		string filename;
 		list<script_hook*> hooks;
+		map<string, list_snapshot> snapshots;
+		value_cache info_cache;
+		value_cache prefs_cache;
+		string_cache strings;
+		bool buffer_prints;
+		bool reloading;
+		vector<pair<hexchat_context*, string>> print_buffer;
+		pref_store* prefs;
+		kv_store* kv;
+		vector<int> nick_palette; // empty for the default
 
 		js_script (string, string);
 		void add_hook (script_hook*, hook_type, JSContext*, JSObject*, JSObject*, hexchat_hook*);
@@ -93,6 +444,74 @@ class js_script
 
 static list<js_script*> js_script_list;
 
+static js_script* hjs_script_find (JSContext* context);
+
+// what hook_unload handlers returned during a reload, keyed by file until get_reload_state
+static map<string, vector<uint64>> reload_states;
+
+// flood control for queue_command, one queue per server id
+static map<int, command_queue> command_queues;
+static hexchat_hook* queue_timer;
+static int queue_burst = 4;
+static int queue_interval = 2000; // ms per token
+static int queue_merge_limit = 4;
+
+// CASEMAPPING from each server's 005, rfc1459 is assumed otherwise
+static map<int, string> server_casemapping;
+
+// used by get_nickcolor and compile_format until a script calls set_nickcolor_palette
+static const vector<int> default_palette = {19, 20, 22, 24, 25, 26, 27, 28, 29};
+static vector<int> interp_palette = default_palette;
+
+// lines waiting for print_stream, drained a few at a time from a timer
+static list<pair<hexchat_context*, string>> stream_queue;
+static hexchat_hook* stream_timer;
+
+// pluginprefs of the /js interpreter, scripts keep their own
+static pref_store* interp_prefs;
+static kv_store* interp_kv;
+static hexchat_hook* store_timer;
+
+// owned by the plugin and readable from every script, watchers are told about changes from a timer
+static map<string, shared_value> shared_store;
+static list<shared_watcher> shared_watchers;
+static vector<string> shared_changed;
+static hexchat_hook* shared_timer;
+
+// journal_append only queues, a writer thread does the disk I/O
+static vector<journal_entry> journal_queue;
+static mutex journal_mutex;
+static condition_variable journal_wake;
+static thread journal_thread;
+static bool journal_stop;
+static atomic<unsigned long> journal_written;
+static atomic<unsigned long> journal_errors;
+static map<string, journal_policy> journal_policies; // main thread only
+
+// search_logs never indexes, logs too far behind are queued for a worker thread
+static map<string, string> logindex_queue; // log path to index prefix
+static mutex logindex_queue_mutex;
+static condition_variable logindex_wake;
+static thread logindex_thread;
+static atomic<bool> logindex_stop;
+static mutex logindex_mutex; // held by searches and while the worker swaps index files
+
+static map<string, pref_store*> open_prefs;
+static map<string, kv_store*> open_kvs;
+static map<string, table_data*> open_tables;
+
+// entries of every Cache in every script, most recently used first, trimmed to one budget
+static list<cache_entry> cache_lru;
+static size_t cache_budget = 16 * 1024 * 1024;
+static size_t cache_used;
+static const double cache_max_ttl = 365.0 * 24 * 60 * 60 * 1000; // ms, longer counts as never
+
+// bumped by hooks whenever cached get_info or get_prefs values may be stale,
+// and by a timer on the next main loop iteration so nothing outlives the current callback
+static unsigned int info_generation = 1;
+static unsigned int prefs_generation = 1;
+static hexchat_hook* generation_timer;
+
 
 /* utility functions */
 
@@ -147,6 +566,85 @@ hjs_util_getcontents (string filename)
 	return "";
 }
 
+static bool
+hjs_util_mkdir (string path)
+{
+#ifdef _WIN32
+	return _mkdir (path.c_str()) == 0 || errno == EEXIST;
+#else
+	return mkdir (path.c_str(), 0700) == 0 || errno == EEXIST;
+#endif
+}
+
+static bool
+hjs_util_replacefile (string from, string to)
+{
+#ifdef _WIN32
+	return MoveFileExA (from.c_str(), to.c_str(), MOVEFILE_REPLACE_EXISTING|MOVEFILE_WRITE_THROUGH) != 0;
+#else
+	return rename (from.c_str(), to.c_str()) == 0;
+#endif
+}
+
+// flushes and waits for the data to reach the disk, needed before a rename replaces a file
+static bool
+hjs_util_syncfile (FILE* file)
+{
+	if (fflush (file) != 0)
+		return false;
+#ifdef _WIN32
+	return _commit (_fileno (file)) == 0;
+#else
+	return fsync (fileno (file)) == 0;
+#endif
+}
+
+static JSBool
+hjs_util_stringifycb (const jschar *buf, uint32 len, void *data)
+{
+	((basic_string<jschar>*)data)->append (buf, len);
+	return JS_TRUE;
+}
+
+static bool
+hjs_util_getbuffer (jsval val, const char** data, size_t* len)
+{
+	JSObject* obj;
+
+	if (JSVAL_IS_PRIMITIVE(val))
+		return false;
+
+	// an ArrayBuffer or any typed array view of one
+	obj = JSVAL_TO_OBJECT(val);
+	if (js_IsArrayBuffer (obj))
+	{
+		js::ArrayBuffer* buffer = js::ArrayBuffer::fromJSObject (obj);
+		*data = (const char*)buffer->data;
+		*len = buffer->byteLength;
+		return true;
+	}
+	else if (js_IsTypedArray (obj))
+	{
+		js::TypedArray* array = js::TypedArray::fromJSObject (obj);
+		*data = (const char*)array->data;
+		*len = array->byteLength;
+		return true;
+	}
+
+	return false;
+}
+
+static JSObject*
+hjs_util_newbuffer (JSContext* context, const char* data, size_t len)
+{
+	JSObject* buffer = js_CreateArrayBuffer (context, len);
+
+	if (buffer != nullptr && len > 0)
+		memcpy (js::ArrayBuffer::fromJSObject (buffer)->data, data, len);
+
+	return buffer;
+}
+
 static bool
 hjs_util_isscript (string file)
 {
@@ -156,14 +654,31 @@ hjs_util_isscript (string file)
 	return false;
 }
 
+// nicks, channels and such repeat constantly, share one JSString for them
+static JSString*
+hjs_util_newstring (JSContext* context, js_script* script, const char* str)
+{
+	if (script != nullptr)
+		return script->strings.get (context, str);
+
+	return JS_NewStringCopyZ (context, str);
+}
+
+static JSString*
+hjs_util_newstring (JSContext* context, const char* str)
+{
+	return hjs_util_newstring (context, hjs_script_find (context), str);
+}
+
 static jsval
 hjs_util_buildword (JSContext* context, char* word[])
 {
 	JSObject* wordlist = JS_NewArrayObject (context, 0, nullptr);
+	js_script* script = hjs_script_find (context);
 
 	for (int i = 0; word[i][0]; i++)
 	{
-		JSString* str = JS_NewStringCopyZ (context, word[i]);
+		JSString* str = hjs_util_newstring (context, script, word[i]);
 		JS_DefineElement (context, wordlist, i, STRING_TO_JSVAL(str), nullptr, nullptr,
 						JSPROP_READONLY|JSPROP_PERMANENT|JSPROP_ENUMERATE);
 	}
@@ -232,7 +747,89 @@ static jsval
 hjs_util_pointer_to_jsval(JSContext *context, const void *ptr)
 {
 	string ctxstr = std::to_string((unsigned long long)ptr);
-	return STRING_TO_JSVAL(JS_NewStringCopyZ (context, ctxstr.c_str()));
+	return STRING_TO_JSVAL(hjs_util_newstring (context, ctxstr.c_str()));
+}
+
+// id of the server of the current context
+static int
+hjs_util_serverid ()
+{
+	const char* str;
+	int id;
+
+	if (hexchat_get_prefs (ph, "id", &str, &id) != 2)
+		return -1;
+
+	return id;
+}
+
+// encodes into a caller provided buffer, fails if it doesn't fit
+static bool
+hjs_util_encodebuf (JSString *str, char *buf, size_t size)
+{
+	size_t len = JS_EncodeStringToBuffer (str, buf, size - 1);
+
+	if (len >= size)
+		return false;
+	buf[len] = '\0';
+
+	return true;
+}
+
+static hexchat_context*
+hjs_util_jsval_to_context (JSContext *context, jsval val)
+{
+	char ctxcstr[32];
+	JSString* ctxstr = JS_ValueToString (context, val);
+
+	// ids are short decimal strings, no need to allocate for them
+	if (ctxstr == nullptr || !hjs_util_encodebuf (ctxstr, ctxcstr, sizeof(ctxcstr)))
+		return nullptr;
+
+	return (hexchat_context*)strtoull(ctxcstr, nullptr, 10);
+}
+
+static string
+hjs_util_getstringprop (JSContext *context, JSObject *obj, const char *prop)
+{
+	jsval val;
+	JSString* str;
+	char* cstr;
+	string ret;
+
+	if (!JS_GetProperty (context, obj, prop, &val) || JSVAL_IS_VOID(val) || JSVAL_IS_NULL(val))
+		return ret;
+
+	str = JS_ValueToString (context, val);
+	if (str != nullptr)
+	{
+		cstr = JSSTRING_TO_CHAR(str);
+		ret = string(cstr);
+		JS_free(context, cstr);
+	}
+
+	return ret;
+}
+
+static const char*
+hjs_util_listname (JSContext *context, JSString *list_name)
+{
+	const char* const *fields = hexchat_list_fields (ph, "lists");
+	const char* ret = nullptr;
+	char* name = JSSTRING_TO_CHAR(list_name);
+
+	// return hexchat's own copy so it can outlive the encoded string
+	for (int i = 0; fields[i]; i++)
+	{
+		if (strcmp (fields[i], name) == 0)
+		{
+			ret = fields[i];
+			break;
+		}
+	}
+	JS_free(context, name);
+
+	return ret;
 }
 
 /* script functions */
@@ -296,6 +893,54 @@ hjs_script_getproperty (JSContext* context, string property, string fallback)
 	return fallback;
 }
 
+static void
+hjs_script_flushprints (js_script* script)
+{
+	hexchat_context* oldctx;
+
+	if (script->print_buffer.empty())
+		return;
+
+	oldctx = hexchat_get_context (ph);
+	for (auto& output : script->print_buffer)
+	{
+		if (hexchat_set_context (ph, output.first))
+			hexchat_print (ph, output.second.c_str());
+	}
+	hexchat_set_context (ph, oldctx);
+
+	script->print_buffer.clear();
+}
+
+static void
+hjs_script_flushprints (JSContext* context)
+{
+	js_script* script = hjs_script_find (context);
+
+	if (script != nullptr)
+		hjs_script_flushprints (script);
+}
+
+static void
+hjs_script_print (JSContext* context, const char* text)
+{
+	js_script* script = hjs_script_find (context);
+	hexchat_context* ctx;
+
+	if (script == nullptr || !script->buffer_prints)
+	{
+		hexchat_print (ph, text);
+		return;
+	}
+
+	// hexchat splits on newlines so lines for the same context become one call
+	ctx = hexchat_get_context (ph);
+	if (!script->print_buffer.empty() && script->print_buffer.back().first == ctx)
+		script->print_buffer.back().second.append("\n").append(text);
+	else
+		script->print_buffer.push_back (make_pair (ctx, string(text)));
+}
+
 static void
 hjs_script_cleanup ()
 {
@@ -303,6 +948,23 @@ hjs_script_cleanup ()
 		delete script;
 }
 
+static void
+hjs_script_savestate (js_script* script, jsval state)
+{
+	uint64* data;
+	size_t nbytes;
+
+	// structured clone data is plain memory, it outlives the runtime that wrote it
+	if (!JS_WriteStructuredClone (script->context, state, &data, &nbytes, nullptr, nullptr))
+	{
+		hexchat_printf (ph, "\00320JavaScript Error:\017 %s: state could not be kept for reload", script->name.c_str());
+		return;
+	}
+
+	reload_states[script->filename].assign (data, data + nbytes / sizeof(uint64));
+	free (data);
+}
+
 static bool
 hjs_script_load (string file)
 {
@@ -348,6 +1010,7 @@ hjs_script_reload (string file)
 	if (script)
 	{
 		oldfile = script->filename;
+		script->reloading = true;
 		hjs_script_unload (oldfile);
 		hjs_script_load (oldfile);
 		return true;
@@ -375,7 +1038,62 @@ hjs_script_autoload ()
 }
 
 
-/* hexchat commands */
+/* streamed output */
+
+#define STREAM_LINES_PER_TICK 100
+#define STREAM_TICK_MS 20
+
+static int
+hjs_stream_timer_cb (void *userdata)
+{
+	hexchat_context* oldctx = hexchat_get_context (ph);
+	int budget = STREAM_LINES_PER_TICK;
+
+	// lines for the same context go out as one print
+	while (!stream_queue.empty() && budget > 0)
+	{
+		hexchat_context* ctx = stream_queue.front().first;
+		string text;
+
+		while (!stream_queue.empty() && stream_queue.front().first == ctx && budget-- > 0)
+		{
+			if (!text.empty())
+				text += '\n';
+			text += stream_queue.front().second;
+			stream_queue.pop_front();
+		}
+
+		if (hexchat_set_context (ph, ctx))
+			hexchat_print (ph, text.c_str());
+	}
+
+	hexchat_set_context (ph, oldctx);
+
+	if (!stream_queue.empty())
+		return 1;
+
+	stream_timer = nullptr;
+	return 0;
+}
+
+static void
+hjs_stream_push (hexchat_context *ctx, const char *text)
+{
+	const char* end;
+
+	do
+	{
+		end = strchr (text, '\n');
+		stream_queue.push_back (make_pair (ctx, end ? string(text, end - text) : string(text)));
+		text = end + 1;
+	} while (end != nullptr);
+
+	if (stream_timer == nullptr)
+		stream_timer = hexchat_hook_timer (ph, STREAM_TICK_MS, hjs_stream_timer_cb, nullptr);
+}
+
+
+/* hexchat commands */
 
 static int
 hjs_load_cb (char* word[], char* word_eol[], void *userdata)
@@ -420,7 +1138,14 @@ hjs_cmd_cb (char* word[], char* word_eol[], void *userdata)
 			{
 				ret = JS_EncodeString (interp_cx, str);
 				// fancy blue message, might be annoying but otherwise confusing
-				hexchat_printf (ph, "\00318JavaScript Output:\017 %s", ret);
+				if (count (ret, ret + strlen (ret), '\n') < STREAM_LINES_PER_TICK)
+					hexchat_printf (ph, "\00318JavaScript Output:\017 %s", ret);
+				else
+				{
+					// huge results would stall the gui if printed at once
+					hexchat_print (ph, "\00318JavaScript Output:\017");
+					hjs_stream_push (hexchat_get_context (ph), ret);
+				}
 				JS_free(interp_cx, ret);
 			}
 		}
@@ -448,6 +1173,50 @@ hjs_print_error (JSContext* context, const char* message, JSErrorReport* report)
 		hexchat_printf (ph, "\00320JavaScript Error:\017 %s", message);
 }
 
+static int
+hjs_invalidate_cb (char* word[], void *generation) // print
+{
+	(*(unsigned int*)generation)++;
+	return HEXCHAT_EAT_NONE;
+}
+
+static int
+hjs_invalidate_cb (char* word[], char* word_eol[], void *generation) // server and command
+{
+	(*(unsigned int*)generation)++;
+	return HEXCHAT_EAT_NONE;
+}
+
+static int
+hjs_generation_timer_cb (void *userdata)
+{
+	// prefs can change from the GUI or other plugins and events can be eaten before we see them
+	info_generation++;
+	prefs_generation++;
+
+	generation_timer = nullptr;
+	return 0;
+}
+
+static void
+hjs_generation_expire ()
+{
+	if (generation_timer == nullptr)
+		generation_timer = hexchat_hook_timer (ph, 0, hjs_generation_timer_cb, nullptr);
+}
+
+static int
+hjs_isupport_cb (char* word[], char* word_eol[], void *userdata)
+{
+	for (int i = 4; word[i][0]; i++)
+	{
+		if (strncmp (word[i], "CASEMAPPING=", 12) == 0)
+			server_casemapping[hjs_util_serverid ()] = string(word[i] + 12);
+	}
+
+	return HEXCHAT_EAT_NONE;
+}
+
 
 /* callback functions for hooks */
 
@@ -465,6 +1234,7 @@ hjs_callback (char* word[], char* word_eol[], hexchat_event_attrs *attrs, void *
 	argv[3] = OBJECT_TO_JSVAL(((script_hook*)hook)->userdata);
 
 	JS_CallFunction (context, JS_GetGlobalForScopeChain (context), fun, 4, argv, &rval);
+	hjs_script_flushprints (context);
 
 	if (JSVAL_IS_VOID(rval))
 		return HEXCHAT_EAT_NONE;
@@ -485,6 +1255,7 @@ hjs_callback (char* word[], char* word_eol[], void *hook) // command
 	argv[2] = OBJECT_TO_JSVAL(((script_hook*)hook)->userdata);
 
 	JS_CallFunction (context, JS_GetGlobalForScopeChain (context), fun, 3, argv, &rval);
+	hjs_script_flushprints (context);
 
 	if (JSVAL_IS_VOID(rval))
 		return HEXCHAT_EAT_NONE;
@@ -505,6 +1276,7 @@ hjs_callback (char* word[], hexchat_event_attrs *attrs, void *hook) // print
 	argv[2] = OBJECT_TO_JSVAL(((script_hook*)hook)->userdata);
 
 	JS_CallFunction (context, JS_GetGlobalForScopeChain (context), fun, 3, argv, &rval);
+	hjs_script_flushprints (context);
 
 	if (JSVAL_IS_VOID(rval))
 		return HEXCHAT_EAT_NONE;
@@ -524,6 +1296,7 @@ hjs_callback (char* word[], void *hook) // special
 	argv[1] = OBJECT_TO_JSVAL(((script_hook*)hook)->userdata);
 
 	JS_CallFunction (context, JS_GetGlobalForScopeChain (context), fun, 2, argv, &rval);
+	hjs_script_flushprints (context);
 
 	if (JSVAL_IS_VOID(rval))
 		return HEXCHAT_EAT_NONE;
@@ -542,6 +1315,7 @@ hjs_callback (void *hook) // timer
 	argv[0] = OBJECT_TO_JSVAL(((script_hook*)hook)->userdata);
 
 	JS_CallFunction (context, JS_GetGlobalForScopeChain (context), fun, 1, argv, &rval);
+	hjs_script_flushprints (context);
 
 	if (JSVAL_IS_VOID(rval))
 		return HEXCHAT_EAT_NONE;
@@ -550,823 +1324,6541 @@ hjs_callback (void *hook) // timer
 }
 
 
-/* js functions */
+/* command queue */
 
-static JSBool
-hjs_print (JSContext *context, unsigned argc, jsval *vp)
+static void
+hjs_queue_refill (command_queue& queue)
 {
-	JSObject* obj;
-	JSString* str;
-	char* cstr;
-
-	if (!JS_ConvertArguments (context, argc, JS_ARGV(context, vp), "o", &obj))
-		return JS_FALSE;
-
-	str = JS_ValueToString (context, OBJECT_TO_JSVAL(obj));
-	if (str != nullptr)
-	{
-		cstr = JSSTRING_TO_CHAR(str);
-		hexchat_print (ph, cstr);
-		JS_free(context, cstr);
-	}
+	auto now = chrono::steady_clock::now();
+	double elapsed = chrono::duration_cast<chrono::milliseconds>(now - queue.last_refill).count();
 
-	JS_SET_RVAL (context, vp, JSVAL_VOID);
+	queue.tokens += elapsed / queue_interval;
+	if (queue.tokens > queue_burst)
+		queue.tokens = queue_burst;
+	queue.last_refill = now;
+}
 
-	return JS_TRUE;
+static bool
+hjs_queue_ismodeop (const queued_command& command, char sign)
+{
+	// a single "+o nick" style change that can share a line with others
+	return command.verb == "mode" && command.rest.size() > 3
+		&& (sign == 0 ? (command.rest[0] == '+' || command.rest[0] == '-') : command.rest[0] == sign)
+		&& command.rest[2] == ' ' && command.rest.find (' ', 3) == string::npos;
 }
 
-static JSBool
-hjs_emitprint (JSContext *context, unsigned argc, jsval *vp)
+static string
+hjs_queue_takenext (command_queue& queue, hexchat_context** ctx)
 {
-	JSString* name;
-	JSString* args[5] = { nullptr };
-	char* carg[5] = { nullptr };
-	char* cname;
-	int ret;
+	auto best = queue.commands.begin();
+	string cmd;
 
-	if (!JS_ConvertArguments (context, argc, JS_ARGV(context, vp), "S/SSSSS",
-							&name, &args[0], &args[1], &args[2], &args[3], &args[4]))
-		return JS_FALSE;
+	for (auto it = queue.commands.begin(); it != queue.commands.end(); ++it)
+		if (it->priority > best->priority)
+			best = it;
 
-	// convert all jsstrings
-	for (int i = 0; args[i]; i++)
-		carg[i] = JSSTRING_TO_CHAR(args[i]);
+	queued_command first = *best;
+	queue.commands.erase (best);
+	*ctx = first.ctx;
 
-	cname = JSSTRING_TO_CHAR(name);
+	if (hjs_queue_ismodeop (first, 0))
+	{
+		string modes = first.rest.substr (0, 2);
+		string params = first.rest.substr (3);
+		int count = 1;
 
-	ret = hexchat_emit_print (ph, cname, carg[0], carg[1],
-								carg[2], carg[3], carg[4], nullptr);
+		for (auto it = queue.commands.begin(); it != queue.commands.end() && count < queue_merge_limit;)
+		{
+			if (it->ctx == first.ctx && it->target == first.target && hjs_queue_ismodeop (*it, first.rest[0]))
+			{
+				modes += it->rest[1];
+				params += ' ' + it->rest.substr (3);
+				count++;
+				queue.merged++;
+				it = queue.commands.erase (it);
+			}
+			else
+				++it;
+		}
 
-	JS_free(context, cname);
+		return "mode " + first.target + ' ' + modes + ' ' + params;
+	}
+	else if ((first.verb == "msg" || first.verb == "notice") && !first.rest.empty())
+	{
+		string targets = first.target;
+		int count = 1;
 
-	for (int i = 0; carg[i]; i++)
-		JS_free(context, carg[i]);
+		for (auto it = queue.commands.begin(); it != queue.commands.end() && count < queue_merge_limit;)
+		{
+			if (it->ctx == first.ctx && it->verb == first.verb && it->rest == first.rest)
+			{
+				targets += ',' + it->target;
+				count++;
+				queue.merged++;
+				it = queue.commands.erase (it);
+			}
+			else
+				++it;
+		}
 
-	JS_SET_RVAL (context, vp, BOOLEAN_TO_JSVAL(ret));
+		return first.verb + ' ' + targets + ' ' + first.rest;
+	}
 
-	return JS_TRUE;
+	return first.cmd;
 }
 
-static JSBool
-hjs_emitprintat (JSContext *context, unsigned argc, jsval *vp)
+static bool
+hjs_queue_drain ()
 {
-	JSObject* date;
-	JSString* name;
-	JSString* args[5] = { nullptr };
-	char* carg[5] = { nullptr };
-	char* cname;
-	hexchat_event_attrs* attrs;
-	int ret;
+	hexchat_context* oldctx = hexchat_get_context (ph);
+	bool pending = false;
 
-	if (!JS_ConvertArguments (context, argc, JS_ARGV(context, vp), "oS/SSSSS",
-							&date, &name, &args[0], &args[1], &args[2], &args[3], &args[4]))
-		return JS_FALSE;
+	for (auto entry = command_queues.begin(); entry != command_queues.end();)
+	{
+		command_queue& queue = entry->second;
 
-	// convert all jsstrings
-	for (int i = 0; args[i]; i++)
-		carg[i] = JSSTRING_TO_CHAR(args[i]);
+		hjs_queue_refill (queue);
+		while (!queue.commands.empty() && queue.tokens >= 1)
+		{
+			hexchat_context* ctx;
+			string cmd = hjs_queue_takenext (queue, &ctx);
 
-	cname = JSSTRING_TO_CHAR(name);
+			// the tab may have been closed since it was queued
+			if (hexchat_set_context (ph, ctx))
+			{
+				hexchat_command (ph, cmd.c_str());
+				queue.tokens -= 1;
+				queue.sent++;
+			}
+			else
+				queue.dropped++;
+		}
 
-	attrs = hexchat_event_attrs_create(ph);
-	attrs->server_time_utc = hjs_util_timefromdate(context, date);
+		if (!queue.commands.empty())
+			pending = true;
 
-	ret = hexchat_emit_print_attrs (ph, attrs, cname, carg[0], carg[1],
-								carg[2], carg[3], carg[4], nullptr);
+		// an idle queue with a full bucket is no different from a new one
+		if (queue.commands.empty() && queue.tokens >= queue_burst)
+			entry = command_queues.erase (entry);
+		else
+			++entry;
+	}
 
-	hexchat_event_attrs_free(ph, attrs);
-	JS_free(context, cname);
+	hexchat_set_context (ph, oldctx);
 
-	for (int i = 0; carg[i]; i++)
-		JS_free(context, carg[i]);
+	return pending;
+}
 
-	JS_SET_RVAL (context, vp, BOOLEAN_TO_JSVAL(ret));
+static int
+hjs_queue_timer_cb (void *userdata)
+{
+	if (hjs_queue_drain ())
+		return 1;
 
-	return JS_TRUE;
+	queue_timer = nullptr;
+	return 0;
 }
 
-static JSBool
-hjs_command (JSContext *context, unsigned argc, jsval *vp)
-{
-	JSString* cmd;
-	char* ccmd;
 
-	if (!JS_ConvertArguments (context, argc, JS_ARGV(context, vp), "S", &cmd))
-		return JS_FALSE;
+/* plugin preferences */
 
-	ccmd = JSSTRING_TO_CHAR(cmd);
-	hexchat_command (ph, ccmd);
-	JS_free(context, ccmd);
+// changes are written out this long after the first one, or on unload
+#define PREF_FLUSH_MS 5000
+#define PREF_INLINE_MAX 511
 
-	JS_SET_RVAL (context, vp, JSVAL_VOID);
+static string
+hjs_prefs_canon (const string& owner)
+{
+	string canon;
 
-	return JS_TRUE;
+	// the name hexchat's own pluginpref functions use for this handle
+	for (char c : owner)
+	{
+		if ((c >= '0' && c <= '9') || (c >= 'a' && c <= 'z'))
+			canon += c;
+		else if (c >= 'A' && c <= 'Z')
+			canon += c - 'A' + 'a';
+		else
+			canon += '_';
+	}
+
+	return canon;
 }
 
-static JSBool
-hjs_nickcmp (JSContext *context, unsigned argc, jsval *vp)
+static void
+hjs_prefs_load (const string& canon, pref_store* prefs)
 {
-	JSString* nick1;
-	JSString* nick2;
-	char* cnick1;
-	char* cnick2;
-	int ret;
+	string datadir = string(hexchat_get_info (ph, "configdir")) + DIR_SEP + "javascript";
+	string line;
+	size_t sep;
 
-	if (!JS_ConvertArguments (context, argc, JS_ARGV(context, vp), "SS", &nick1, &nick2))
-		return JS_FALSE;
+	ifstream in (prefs->path, ios::binary);
 
-	cnick1 = JSSTRING_TO_CHAR(nick1);
-	cnick2 = JSSTRING_TO_CHAR(nick2);
-	ret = hexchat_nickcmp (ph, cnick1, cnick2);
-	JS_free(context, cnick1);
-	JS_free(context, cnick2);
+	while (getline (in, line))
+	{
+		if (!line.empty() && line.back() == '\r')
+			line.pop_back();
 
-	JS_SET_RVAL (context, vp, INT_TO_JSVAL (ret));
+		sep = line.find (" = ");
+		if (sep != string::npos)
+			prefs->values[line.substr (0, sep)] = line.substr (sep + 3);
+	}
 
-	return JS_TRUE;
+	hjs_util_mkdir (datadir);
+	datadir += DIR_SEP;
+	datadir += "prefdata";
+	hjs_util_mkdir (datadir);
+
+	// the record file is written first on flush, so it wins if a crash left both
+	prefs->large.load (datadir + DIR_SEP + canon + ".dat");
+	for (const auto& record : prefs->large.keys())
+		prefs->values.erase (record.first);
 }
 
-static JSBool
-hjs_strip (JSContext *context, unsigned argc, jsval *vp)
+static pref_store*
+hjs_prefs_find (JSContext* context)
 {
-	JSString* str;
-	JSString* ret;
-	char* cstr;
-	char* cret;
-	int flags = 3;
+	js_script* script = hjs_script_find (context);
+	bool interp = script == nullptr || script->gui == nullptr;
+	pref_store** slot = interp ? &interp_prefs : &script->prefs;
+	string canon, path;
 
-	if (!JS_ConvertArguments (context, argc, JS_ARGV(context, vp), "S/i", &str, &flags))
-		return JS_FALSE;
+	if (*slot != nullptr)
+		return *slot;
 
-	cstr = JSSTRING_TO_CHAR(str);
-	cret = hexchat_strip (ph, cstr, -1, flags);
-	JS_free(context, cstr);
+	canon = hjs_prefs_canon (interp ? name : script->name);
+	path = string(hexchat_get_info (ph, "configdir")) + DIR_SEP + "addon_" + canon + ".conf";
 
-	if (cret == nullptr)
+	// each store rewrites the whole conf file, two of them would drop each other's keys
+	auto found = open_prefs.find (path);
+	if (found != open_prefs.end())
 	{
-		JS_SET_RVAL (context, vp, JSVAL_VOID);
+		found->second->refs++;
+		return *slot = found->second;
 	}
-	else
+
+	*slot = new pref_store;
+	(*slot)->refs = 1;
+	(*slot)->transactions = 0;
+	(*slot)->path = path;
+	hjs_prefs_load (canon, *slot);
+	open_prefs[path] = *slot;
+
+	return *slot;
+}
+
+static bool
+hjs_prefs_lookup (pref_store* prefs, const string& key, const char** value, size_t* len)
+{
+	auto found = prefs->values.find (key);
+
+	if (found == prefs->values.end())
 	{
-		ret = JS_NewStringCopyZ (context, cret);
-		JS_SET_RVAL (context, vp, STRING_TO_JSVAL(ret));
+		found = prefs->pending.find (key);
+		if (found == prefs->pending.end())
+		{
+			// deleted but not flushed yet
+			if (prefs->dirty.count (key))
+				return false;
 
-		hexchat_free (ph, cret);
+			return prefs->large.get (key, value, len);
+		}
 	}
 
-	return JS_TRUE;
+	*value = found->second.data();
+	*len = found->second.length();
+
+	return true;
 }
 
-static JSBool
-hjs_getinfo (JSContext *context, unsigned argc, jsval *vp)
+static set<string>
+hjs_prefs_keys (pref_store* prefs)
 {
-	JSString* str;
-	JSString* ret;
-	char* cstr;
-	const char* cret;
+	set<string> keys;
 
-	if (!JS_ConvertArguments (context, argc, JS_ARGV(context, vp), "S", &str))
-		return JS_FALSE;
+	for (const auto& pref : prefs->values)
+		keys.insert (pref.first);
+	for (const auto& pref : prefs->pending)
+		keys.insert (pref.first);
+	for (const auto& record : prefs->large.keys())
+		if (!prefs->dirty.count (record.first))
+			keys.insert (record.first);
 
-	cstr = JSSTRING_TO_CHAR(str);
-	cret = hexchat_get_info (ph, cstr);
-	JS_free(context, cstr);
+	return keys;
+}
 
-	if (cret == nullptr)
+static void
+hjs_prefs_set (pref_store* prefs, const string& key, const string& value, bool binary = false)
+{
+	// hexchat reads at most 511 bytes of a single line, anything else goes to the record file.
+	// A key never moves back to the conf file, so a crash can't lose it between the two files
+	if (binary || value.length() > PREF_INLINE_MAX || value.find_first_of ("\r\n") != string::npos
+		|| prefs->large.has (key))
 	{
-		JS_SET_RVAL (context, vp, JSVAL_VOID);
+		prefs->pending[key] = value;
+		prefs->values.erase (key);
 	}
 	else
 	{
-		ret = JS_NewStringCopyZ (context, cret);
-		JS_SET_RVAL (context, vp, STRING_TO_JSVAL(ret));
+		prefs->values[key] = value;
+		prefs->pending.erase (key);
 	}
 
-	return JS_TRUE;
+	prefs->dirty.insert (key);
 }
 
-static JSBool
-hjs_getprefs (JSContext *context, unsigned argc, jsval *vp)
+static bool
+hjs_prefs_delete (pref_store* prefs, const string& key)
 {
-	JSString* str;
-	JSString* ret;
-	char* cstr;
-	const char* cstrret;
-	int intret, cret;
-
-	if (!JS_ConvertArguments (context, argc, JS_ARGV(context, vp), "S", &str))
-		return JS_FALSE;
-
-	cstr = JSSTRING_TO_CHAR(str);
-	cret = hexchat_get_prefs (ph, cstr, &cstrret, &intret);
-	JS_free(context, cstr);
-
-	switch (cret)
-	{
-		case 0: // fail
-			JS_SET_RVAL (context, vp, JSVAL_VOID);
-			break;
-
-		case 1: // string
-			ret = JS_NewStringCopyZ (context, cstrret);
-			JS_SET_RVAL (context, vp, STRING_TO_JSVAL(ret));
-			break;
+	bool found = prefs->values.erase (key) > 0;
 
-		case 2: // int
-			JS_SET_RVAL (context, vp, INT_TO_JSVAL(intret));
-			break;
+	found = prefs->pending.erase (key) > 0 || found;
+	found = found || (!prefs->dirty.count (key) && prefs->large.has (key));
 
-		case 3: // bool
-			JS_SET_RVAL (context, vp, BOOLEAN_TO_JSVAL(intret));
-			break;
-	}
+	if (found)
+		prefs->dirty.insert (key);
 
-	return JS_TRUE;
+	return found;
 }
 
-static JSBool
-hjs_getlist (JSContext *context, unsigned argc, jsval *vp)
+static bool
+hjs_prefs_flush (pref_store* prefs)
 {
-	JSString* list_name;
-	JSObject* js_list;
-	const char* const *fields;
-	const char* field;
-	char* name;
-	hexchat_list* list = nullptr;
-	jsval iattr, sattr, tattr;
+	string tmppath = prefs->path + ".new";
 
-	if (!JS_ConvertArguments (context, argc, JS_ARGV(context, vp), "S", &list_name))
-		return JS_FALSE;
+	if (prefs->dirty.empty() || prefs->transactions > 0)
+		return true;
 
-	fields = hexchat_list_fields(ph, "lists");
-	name = JSSTRING_TO_CHAR(list_name);
-	for (int i = 0; fields[i]; i++)
+	for (const string& key : prefs->dirty)
 	{
-		if (strcmp (fields[i], name) == 0)
+		auto found = prefs->pending.find (key);
+
+		if (found != prefs->pending.end())
 		{
-			JS_free(context, name);
-			name = (char*)fields[i];
-			break;
+			if (!prefs->large.put (key, found->second.data(), found->second.length()))
+				return false;
 		}
+		else if (prefs->large.has (key) && !prefs->large.remove (key))
+			return false;
 	}
-	if (name == nullptr)
-		goto listerr;
 
-	js_list = JS_NewArrayObject (context, 0, nullptr);
-	if (js_list == nullptr)
-		goto listerr;
+	if (!prefs->large.sync ())
+		return false;
+	prefs->pending.clear();
 
-	list = hexchat_list_get (ph, name);
-	if (list == nullptr)
-		goto listerr;
+	if (prefs->large.wasteful ())
+		prefs->large.compact ();
 
-	fields = hexchat_list_fields (ph, name);
-	for (int index = 0; hexchat_list_next (ph, list); index++)
+	// the whole file is rewritten next to the old one and moved over it, a crash leaves either the old or the new one
+	FILE* out = fopen (tmppath.c_str(), "wb");
+	if (out == nullptr)
+		return false;
+
+	for (const auto& pref : prefs->values)
+	{
+		string line = pref.first + " = " + pref.second + '\n';
+		fwrite (line.data(), 1, line.length(), out);
+	}
+
+	bool failed = ferror (out) != 0 || !hjs_util_syncfile (out);
+	if (fclose (out) != 0 || failed || !hjs_util_replacefile (tmppath, prefs->path))
+	{
+		remove (tmppath.c_str());
+		return false;
+	}
+
+	prefs->dirty.clear();
+	return true;
+}
+
+static void
+hjs_prefs_release (pref_store* prefs)
+{
+	if (prefs == nullptr || --prefs->refs > 0)
+		return;
+
+	open_prefs.erase (prefs->path);
+	hjs_prefs_flush (prefs);
+	delete prefs;
+}
+
+static jsval
+hjs_prefs_tojsval (JSContext* context, const char* value, size_t len)
+{
+	char* end;
+	long num;
+
+	// everything is stored as a string, whole numbers that fit an int come back as numbers
+	if (len > 0 && len <= 11 && (isdigit ((unsigned char)value[0])
+		|| (value[0] == '-' && len > 1 && isdigit ((unsigned char)value[1]))))
+	{
+		char buf[12];
+
+		memcpy (buf, value, len);
+		buf[len] = '\0';
+
+		errno = 0;
+		num = strtol (buf, &end, 10);
+
+		if (*end == '\0' && errno == 0 && num == (int32)num)
+			return INT_TO_JSVAL((int32)num);
+	}
+
+	return STRING_TO_JSVAL(JS_NewStringCopyN (context, value, len));
+}
+
+
+/* key-value store */
+
+static kv_store*
+hjs_kv_find (JSContext* context)
+{
+	js_script* script = hjs_script_find (context);
+	kv_store** slot = script != nullptr ? &script->kv : &interp_kv;
+	string dir, path;
+
+	if (*slot != nullptr)
+		return *slot;
+
+	dir = string(hexchat_get_info (ph, "configdir")) + DIR_SEP + "javascript";
+	hjs_util_mkdir (dir);
+	dir += DIR_SEP;
+	dir += "kv";
+	hjs_util_mkdir (dir);
+	path = dir + DIR_SEP + hjs_prefs_canon (script != nullptr ? script->name : name) + ".db";
+
+	// a file is only ever opened once, two indexes over it would overwrite each other
+	auto found = open_kvs.find (path);
+	if (found != open_kvs.end())
+	{
+		found->second->refs++;
+		return *slot = found->second;
+	}
+
+	*slot = new kv_store;
+	(*slot)->refs = 1;
+	(*slot)->path = path;
+	(*slot)->records.load (path);
+	open_kvs[path] = *slot;
+
+	return *slot;
+}
+
+static void
+hjs_kv_release (kv_store* kv)
+{
+	if (kv == nullptr || --kv->refs > 0)
+		return;
+
+	open_kvs.erase (kv->path);
+	kv->records.sync ();
+	delete kv;
+}
+
+static void
+hjs_kv_sync (kv_store* kv)
+{
+	kv->records.sync ();
+
+	// done here rather than on write so a burst of updates never waits on it
+	if (kv->records.wasteful ())
+		kv->records.compact ();
+}
+
+static int
+hjs_store_timer_cb (void *userdata)
+{
+	for (auto& prefs : open_prefs)
+		hjs_prefs_flush (prefs.second);
+
+	for (auto& kv : open_kvs)
+		hjs_kv_sync (kv.second);
+
+	for (auto& table : open_tables)
+	{
+		table.second->records.sync ();
+		if (table.second->records.wasteful ())
+			table.second->records.compact ();
+	}
+
+	store_timer = nullptr;
+	return 0;
+}
+
+static void
+hjs_store_schedule ()
+{
+	if (store_timer == nullptr)
+		store_timer = hexchat_hook_timer (ph, PREF_FLUSH_MS, hjs_store_timer_cb, nullptr);
+}
+
+
+/* shared store */
+
+static bool
+hjs_shared_watched (const string& key)
+{
+	for (const shared_watcher& watcher : shared_watchers)
+		if (key.compare (0, watcher.prefix.length(), watcher.prefix) == 0)
+			return true;
+
+	return false;
+}
+
+static jsval
+hjs_shared_tojsval (JSContext* context, const string& key)
+{
+	auto found = shared_store.find (key);
+	jsval val = JSVAL_VOID;
+
+	if (found == shared_store.end())
+		return JSVAL_VOID;
+
+	switch (found->second.type)
+	{
+	case 'b':
+		return BOOLEAN_TO_JSVAL(found->second.num != 0);
+	case 'n':
+		if (!JS_NewNumberValue (context, found->second.num, &val))
+			return JSVAL_VOID;
+		return val;
+	default:
+		return STRING_TO_JSVAL(JS_NewUCStringCopyN (context, found->second.str.data(), found->second.str.length()));
+	}
+}
+
+static int
+hjs_shared_timer_cb (void *userdata)
+{
+	vector<string> changed;
+
+	// callbacks may change more keys, those are delivered next time
+	changed.swap (shared_changed);
+	shared_timer = nullptr;
+
+	for (const string& key : changed)
+	{
+		vector<script_hook*> hooks;
+
+		for (const shared_watcher& watcher : shared_watchers)
+			if (key.compare (0, watcher.prefix.length(), watcher.prefix) == 0)
+				hooks.push_back (watcher.hook);
+
+		for (script_hook* hook : hooks)
+		{
+			JSContext* context;
+			jsval argv[3];
+			jsval rval;
+
+			// an earlier callback may have removed it, or unloaded its script
+			if (find_if (shared_watchers.begin(), shared_watchers.end(),
+						[hook](const shared_watcher& watcher) { return watcher.hook == hook; }) == shared_watchers.end())
+				continue;
+
+			context = hook->context;
+			argv[0] = STRING_TO_JSVAL(JS_NewStringCopyN (context, key.data(), key.length()));
+			argv[1] = hjs_shared_tojsval (context, key);
+			argv[2] = OBJECT_TO_JSVAL(hook->userdata);
+
+			JS_CallFunctionValue (context, JS_GetGlobalForScopeChain (context), OBJECT_TO_JSVAL(hook->callback),
+								3, argv, &rval);
+			hjs_script_flushprints (context);
+		}
+	}
+
+	return 0;
+}
+
+static void
+hjs_shared_notify (const string& key)
+{
+	if (!hjs_shared_watched (key) || find (shared_changed.begin(), shared_changed.end(), key) != shared_changed.end())
+		return;
+
+	shared_changed.push_back (key);
+
+	if (shared_timer == nullptr)
+		shared_timer = hexchat_hook_timer (ph, 0, hjs_shared_timer_cb, nullptr);
+}
+
+static void
+hjs_shared_unwatch (script_hook* hook)
+{
+	shared_watchers.remove_if ([hook](const shared_watcher& watcher) { return watcher.hook == hook; });
+}
+
+
+/* journal */
+
+// appends arriving this close together are written as one batch
+#define JOURNAL_BATCH_MS 200
+
+static void
+hjs_journal_rotate (const string& path, const journal_policy& policy)
+{
+	for (int i = policy.keep - 1; i > 0; i--)
+		hjs_util_replacefile (path + "." + to_string (i), path + "." + to_string (i + 1));
+
+	if (policy.keep > 0)
+		hjs_util_replacefile (path, path + ".1");
+	else
+		remove (path.c_str());
+}
+
+
+static void
+hjs_journal_writer ()
+{
+	map<string, journal_file> files;
+	map<string, journal_policy> touched;
+	vector<journal_entry> batch;
+	unique_lock<mutex> lock (journal_mutex);
+
+	// no hexchat or JS calls in here, neither is safe off the main thread
+	for (;;)
+	{
+		auto ready = [] { return journal_stop || !journal_queue.empty(); };
+		auto deadline = chrono::steady_clock::time_point::max();
+
+		// a sync:"second" journal is synced within a second even if nothing else gets appended
+		for (const auto& journal : files)
+			if (journal.second.unsynced && journal.second.synced + chrono::seconds(1) < deadline)
+				deadline = journal.second.synced + chrono::seconds(1);
+
+		if (deadline == chrono::steady_clock::time_point::max())
+			journal_wake.wait (lock, ready);
+		else if (!journal_wake.wait_until (lock, deadline, ready))
+		{
+			lock.unlock ();
+			for (auto& journal : files)
+			{
+				journal_file& out = journal.second;
+				if (out.unsynced && chrono::steady_clock::now() - out.synced >= chrono::seconds(1))
+				{
+					if (!hjs_util_syncfile (out.file))
+						journal_errors++;
+					out.synced = chrono::steady_clock::now();
+					out.unsynced = false;
+				}
+			}
+			lock.lock ();
+			continue;
+		}
+
+		if (journal_queue.empty())
+			break;
+
+		if (!journal_stop)
+			journal_wake.wait_for (lock, chrono::milliseconds(JOURNAL_BATCH_MS), [] { return journal_stop; });
+
+		batch.swap (journal_queue);
+		lock.unlock ();
+
+		for (const journal_entry& entry : batch)
+		{
+			journal_file& out = files[entry.path];
+
+			if (out.file != nullptr && out.size > 0 && out.size + entry.record.length() + 1 > entry.policy.max_size)
+			{
+				if (out.unsynced && !hjs_util_syncfile (out.file))
+					journal_errors++;
+				fclose (out.file);
+				out.file = nullptr;
+				out.unsynced = false;
+				hjs_journal_rotate (entry.path, entry.policy);
+			}
+
+			if (out.file == nullptr)
+			{
+				out.file = fopen (entry.path.c_str(), "ab");
+				if (out.file == nullptr)
+				{
+					journal_errors++;
+					files.erase (entry.path);
+					continue;
+				}
+
+				fseek (out.file, 0, SEEK_END);
+				out.size = ftell (out.file);
+				out.synced = chrono::steady_clock::now();
+			}
+
+			if (fwrite (entry.record.data(), 1, entry.record.length(), out.file) != entry.record.length()
+				|| fputc ('\n', out.file) == EOF)
+				journal_errors++;
+			else
+				journal_written++;
+
+			out.size += entry.record.length() + 1;
+			touched[entry.path] = entry.policy;
+		}
+		batch.clear();
+
+		for (const auto& journal : touched)
+		{
+			journal_file& out = files[journal.first];
+			auto now = chrono::steady_clock::now();
+			bool ok;
+
+			if (out.file == nullptr)
+				continue;
+
+			if (journal.second.sync == JOURNAL_SYNC_BATCH
+				|| (journal.second.sync == JOURNAL_SYNC_SECOND && now - out.synced >= chrono::seconds(1)))
+			{
+				ok = hjs_util_syncfile (out.file);
+				out.synced = now;
+				out.unsynced = false;
+			}
+			else
+			{
+				ok = fflush (out.file) == 0;
+				out.unsynced = journal.second.sync == JOURNAL_SYNC_SECOND;
+			}
+
+			if (!ok)
+				journal_errors++;
+		}
+		touched.clear();
+
+		lock.lock ();
+	}
+
+	for (auto& journal : files)
+	{
+		hjs_util_syncfile (journal.second.file);
+		fclose (journal.second.file);
+	}
+}
+
+static string
+hjs_journal_path (JSContext* context, const char* journal)
+{
+	js_script* script = hjs_script_find (context);
+	string dir = string(hexchat_get_info (ph, "configdir")) + DIR_SEP + "javascript";
+	string owner = hjs_prefs_canon (script != nullptr ? script->name : name);
+	string path = dir + DIR_SEP + "journal" + DIR_SEP + owner + DIR_SEP + hjs_prefs_canon (journal) + ".log";
+
+	if (journal_policies.find (path) == journal_policies.end())
+	{
+		hjs_util_mkdir (dir);
+		dir = dir + DIR_SEP + "journal";
+		hjs_util_mkdir (dir);
+		hjs_util_mkdir (dir + DIR_SEP + owner);
+
+		journal_policies[path] = {JOURNAL_SYNC_BATCH, 10 * 1024 * 1024, 5};
+	}
+
+	return path;
+}
+
+static void
+hjs_journal_shutdown ()
+{
+	if (!journal_thread.joinable())
+		return;
+
+	// everything already queued is still written
+	{
+		lock_guard<mutex> lock (journal_mutex);
+		journal_stop = true;
+	}
+	journal_wake.notify_one ();
+	journal_thread.join ();
+}
+
+
+/* log index */
+
+// above this much unindexed log the index is extended, below it the tail is scanned
+#define LOG_INDEX_SLACK (1024 * 1024)
+// log indexed into each new segment, which bounds the memory the worker uses
+#define LOG_SEGMENT_BYTES (4 * 1024 * 1024)
+#define LOG_TOKEN_MAX 32
+
+static const char* log_months[] = { "Jan", "Feb", "Mar", "Apr", "May", "Jun",
+									"Jul", "Aug", "Sep", "Oct", "Nov", "Dec" };
+
+static int32
+hjs_log_daynum (int year, int month, int day)
+{
+	// days_from_civil, month is 1-12
+	year -= month <= 2;
+	int era = (year >= 0 ? year : year - 399) / 400;
+	int yoe = year - era * 400;
+	int doy = (153 * (month + (month > 2 ? -3 : 9)) + 2) / 5 + day - 1;
+	int doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+
+	return era * 146097 + doe - 719468;
+}
+
+static int
+hjs_log_month (const char *name)
+{
+	for (int i = 0; i < 12; i++)
+		if (strncmp (name, log_months[i], 3) == 0)
+			return i + 1;
+
+	return 0;
+}
+
+// updates year/month from a line and returns its day, or -1 if it has no date
+static int32
+hjs_log_parseday (const string& line, int32& year, int32& month)
+{
+	char mon[4];
+	int day, newyear;
+	int newmonth;
+
+	if (line.compare (0, 22, "**** BEGIN LOGGING AT ") == 0)
+	{
+		// "**** BEGIN LOGGING AT Mon Jan  1 12:00:00 2024"
+		if (sscanf (line.c_str() + 22, "%*3s %3s %d %*d:%*d:%*d %d", mon, &day, &newyear) != 3
+			|| (newmonth = hjs_log_month (mon)) == 0)
+			return -1;
+
+		year = newyear;
+		month = newmonth;
+		return hjs_log_daynum (year, month, day);
+	}
+
+	// default timestamp, "Jan 01 12:00:00 <nick> text"
+	if (line.size() < 16 || sscanf (line.c_str(), "%3s %d", mon, &day) != 2
+		|| (newmonth = hjs_log_month (mon)) == 0)
+		return -1;
+
+	if (newmonth < month)
+		year++;
+	month = newmonth;
+
+	return hjs_log_daynum (year, month, day);
+}
+
+static void
+hjs_log_tokenize (const string& line, vector<string>& tokens)
+{
+	string token;
+
+	tokens.clear();
+	for (size_t i = 0; i <= line.size(); i++)
+	{
+		unsigned char c = i < line.size() ? line[i] : ' ';
+
+		if (isalnum (c) || c >= 0x80 || c == '_' || c == '#')
+			token += tolower (c);
+		else if (!token.empty())
+		{
+			if (token.size() >= 2 && token.size() <= LOG_TOKEN_MAX)
+				tokens.push_back (token);
+			token.clear();
+		}
+	}
+
+	sort (tokens.begin(), tokens.end());
+	tokens.erase (unique (tokens.begin(), tokens.end()), tokens.end());
+}
+
+template <typename T> static bool
+hjs_log_read (ifstream& in, T& value)
+{
+	return (bool)in.read ((char*)&value, sizeof(value));
+}
+
+template <typename T> static void
+hjs_log_write (ofstream& out, T value)
+{
+	out.write ((const char*)&value, sizeof(value));
+}
+
+/* Index files, all integers in host byte order:
+ *   <index>.meta: "HJSM" size u64, lines u32, year i32, month i32, next segment u32, buckets u32,
+ *                 segments u32, then buckets (first line u32, day i32) and segments (id, first line, lines u32)
+ *   <index>.lines: byte offset of every line, u64 each
+ *   <index>.<id>.seg: "HJSS" tokens u32, a directory sorted by token (token zero padded to
+ *                 LOG_TOKEN_MAX, count u32, postings offset u64) and the postings, ascending line ids u32
+ * Segments are never changed once written, the worker adds new ones and then replaces the meta file. */
+#define LOG_HEADER_SIZE (4 + sizeof(uint32))
+#define LOG_ENTRY_SIZE (LOG_TOKEN_MAX + sizeof(uint32) + sizeof(uint64_t))
+
+typedef struct
+{
+	char token[LOG_TOKEN_MAX];
+	uint32 count;
+	uint64_t offset;
+} log_entry;
+
+static string
+hjs_log_segpath (const string& prefix, uint32 id)
+{
+	return prefix + "." + to_string ((unsigned long long)id) + ".seg";
+}
+
+static void
+hjs_log_resetindex (log_index& index)
+{
+	index.size = 0;
+	index.lines = 0;
+	index.year = 1970;
+	index.month = 1;
+	index.next_segment = 0;
+	index.buckets.clear();
+	index.segments.clear();
+}
+
+static bool
+hjs_log_readindex (const string& prefix, log_index& index)
+{
+	ifstream in(prefix + ".meta", ios::in | ios::binary);
+	char magic[4];
+	uint32 nbuckets, nsegments;
+
+	if (!in.good() || !in.read (magic, 4) || memcmp (magic, "HJSM", 4) != 0)
+		return false;
+
+	if (!hjs_log_read (in, index.size) || !hjs_log_read (in, index.lines) || !hjs_log_read (in, index.year)
+		|| !hjs_log_read (in, index.month) || !hjs_log_read (in, index.next_segment)
+		|| !hjs_log_read (in, nbuckets) || !hjs_log_read (in, nsegments))
+		return false;
+
+	index.buckets.resize (nbuckets);
+	index.segments.resize (nsegments);
+	if (nbuckets && !in.read ((char*)&index.buckets[0], nbuckets * sizeof(log_bucket)))
+		return false;
+	if (nsegments && !in.read ((char*)&index.segments[0], nsegments * sizeof(log_segment)))
+		return false;
+
+	return true;
+}
+
+static bool
+hjs_log_writeindex (const string& prefix, const log_index& index)
+{
+	string tmppath = prefix + ".meta.tmp";
+	ofstream out(tmppath, ios::out | ios::binary | ios::trunc);
+
+	if (!out.good())
+		return false;
+
+	out.write ("HJSM", 4);
+	hjs_log_write (out, index.size);
+	hjs_log_write (out, index.lines);
+	hjs_log_write (out, index.year);
+	hjs_log_write (out, index.month);
+	hjs_log_write (out, index.next_segment);
+	hjs_log_write (out, (uint32)index.buckets.size());
+	hjs_log_write (out, (uint32)index.segments.size());
+	if (!index.buckets.empty())
+		out.write ((const char*)&index.buckets[0], index.buckets.size() * sizeof(log_bucket));
+	if (!index.segments.empty())
+		out.write ((const char*)&index.segments[0], index.segments.size() * sizeof(log_segment));
+
+	out.close();
+	if (out.fail())
+		return false;
+
+	return hjs_util_replacefile (tmppath, prefix + ".meta");
+}
+
+static bool
+hjs_log_readentry (ifstream& in, log_entry& entry)
+{
+	return in.read (entry.token, LOG_TOKEN_MAX) && hjs_log_read (in, entry.count) && hjs_log_read (in, entry.offset);
+}
+
+static bool
+hjs_log_readpostings (ifstream& in, const log_entry& entry, vector<uint32>& postings)
+{
+	postings.resize (entry.count);
+	in.clear();
+	in.seekg (entry.offset);
+
+	return !entry.count || in.read ((char*)&postings[0], entry.count * sizeof(uint32));
+}
+
+static bool
+hjs_log_openseg (ifstream& in, const string& path, uint32& ntokens)
+{
+	char magic[4];
+
+	in.open (path, ios::in | ios::binary);
+
+	return in.good() && in.read (magic, 4) && memcmp (magic, "HJSS", 4) == 0 && hjs_log_read (in, ntokens);
+}
+
+// binary search of the directory on disk, only the probed entries are read
+static bool
+hjs_log_findtoken (ifstream& in, uint32 ntokens, const string& token, log_entry& entry)
+{
+	char key[LOG_TOKEN_MAX] = { 0 };
+	uint32 low = 0, high = ntokens;
+
+	memcpy (key, token.data(), min (token.size(), (size_t)LOG_TOKEN_MAX));
+	while (low < high)
+	{
+		uint32 mid = low + (high - low) / 2;
+		int cmp;
+
+		in.clear();
+		in.seekg (LOG_HEADER_SIZE + (uint64_t)mid * LOG_ENTRY_SIZE);
+		if (!hjs_log_readentry (in, entry))
+			return false;
+
+		cmp = memcmp (entry.token, key, LOG_TOKEN_MAX);
+		if (cmp == 0)
+			return true;
+		else if (cmp < 0)
+			low = mid + 1;
+		else
+			high = mid;
+	}
+
+	return false;
+}
+
+static bool
+hjs_log_writesegment (const string& path, const map<string, vector<uint32>>& postings)
+{
+	ofstream out(path, ios::out | ios::binary | ios::trunc);
+	uint64_t offset = LOG_HEADER_SIZE + postings.size() * LOG_ENTRY_SIZE;
+
+	if (!out.good())
+		return false;
+
+	out.write ("HJSS", 4);
+	hjs_log_write (out, (uint32)postings.size());
+	for (const auto& token : postings)
+	{
+		char padded[LOG_TOKEN_MAX] = { 0 };
+
+		memcpy (padded, token.first.data(), token.first.size());
+		out.write (padded, LOG_TOKEN_MAX);
+		hjs_log_write (out, (uint32)token.second.size());
+		hjs_log_write (out, offset);
+		offset += token.second.size() * sizeof(uint32);
+	}
+
+	for (const auto& token : postings)
+		out.write ((const char*)&token.second[0], token.second.size() * sizeof(uint32));
+
+	out.close();
+	return !out.fail();
+}
+
+// calls visit for every token of two sorted directories in order, with nullptr for the one lacking it
+template <typename F> static bool
+hjs_log_mergewalk (ifstream& a, uint32 na, ifstream& b, uint32 nb, F visit)
+{
+	log_entry ea, eb;
+	uint32 ia = 0, ib = 0;
+	bool hasa, hasb;
+
+	a.clear();
+	b.clear();
+	a.seekg (LOG_HEADER_SIZE);
+	b.seekg (LOG_HEADER_SIZE);
+	hasa = na > 0 && hjs_log_readentry (a, ea);
+	hasb = nb > 0 && hjs_log_readentry (b, eb);
+
+	while (hasa || hasb)
+	{
+		int cmp = !hasa ? 1 : !hasb ? -1 : memcmp (ea.token, eb.token, LOG_TOKEN_MAX);
+
+		if (!visit (cmp <= 0 ? &ea : nullptr, cmp >= 0 ? &eb : nullptr))
+			return false;
+
+		if (cmp <= 0)
+			hasa = ++ia < na && hjs_log_readentry (a, ea);
+		if (cmp >= 0)
+			hasb = ++ib < nb && hjs_log_readentry (b, eb);
+	}
+
+	// a short read ends the walk early
+	return ia == na && ib == nb;
+}
+
+// streams two neighbouring segments into one, nothing but a single posting list is held in memory
+static bool
+hjs_log_mergesegments (const string& older, const string& newer, const string& path)
+{
+	ifstream a, b, postings_a, postings_b;
+	ofstream out;
+	vector<uint32> postings;
+	uint32 na, nb, nc, ntokens = 0;
+	uint64_t offset;
+
+	if (!hjs_log_openseg (a, older, na) || !hjs_log_openseg (b, newer, nb)
+		|| !hjs_log_openseg (postings_a, older, nc) || !hjs_log_openseg (postings_b, newer, nc))
+		return false;
+
+	// counted first so the directory can be written ahead of the postings
+	if (!hjs_log_mergewalk (a, na, b, nb, [&](const log_entry*, const log_entry*) { ntokens++; return true; }))
+		return false;
+
+	out.open (path, ios::out | ios::binary | ios::trunc);
+	if (!out.good())
+		return false;
+
+	out.write ("HJSS", 4);
+	hjs_log_write (out, ntokens);
+	offset = LOG_HEADER_SIZE + (uint64_t)ntokens * LOG_ENTRY_SIZE;
+
+	if (!hjs_log_mergewalk (a, na, b, nb, [&](const log_entry* ea, const log_entry* eb) {
+			uint32 count = (ea ? ea->count : 0) + (eb ? eb->count : 0);
+
+			out.write ((ea ? ea : eb)->token, LOG_TOKEN_MAX);
+			hjs_log_write (out, count);
+			hjs_log_write (out, offset);
+			offset += (uint64_t)count * sizeof(uint32);
+			return true;
+		}))
+		return false;
+
+	// the older segment has the lower line ids so its postings simply go first
+	if (!hjs_log_mergewalk (a, na, b, nb, [&](const log_entry* ea, const log_entry* eb) {
+			if (logindex_stop)
+				return false;
+			if (ea && (!hjs_log_readpostings (postings_a, *ea, postings)
+						|| (!postings.empty() && !out.write ((const char*)&postings[0], postings.size() * sizeof(uint32)))))
+				return false;
+			if (eb && (!hjs_log_readpostings (postings_b, *eb, postings)
+						|| (!postings.empty() && !out.write ((const char*)&postings[0], postings.size() * sizeof(uint32)))))
+				return false;
+			return true;
+		}))
+		return false;
+
+	out.close();
+	return !out.fail();
+}
+
+// indexes up to LOG_SEGMENT_BYTES more of a log as a new segment, false once there is nothing left to do
+static bool
+hjs_log_indexchunk (const string& logpath, const string& prefix)
+{
+	log_index index;
+	map<string, vector<uint32>> postings;
+	vector<uint64_t> offsets;
+	vector<uint32> obsolete;
+	vector<string> tokens;
+	string line;
+	struct stat st;
+	uint64_t pos;
+	bool valid;
+
+	if (stat (logpath.c_str(), &st) != 0)
+		return false;
+
+	// rotated or truncated logs are indexed from scratch, the reset is visible before any new segment is
+	valid = hjs_log_readindex (prefix, index);
+	if (!valid || index.size > (uint64_t)st.st_size)
+	{
+		lock_guard<mutex> lock (logindex_mutex);
+
+		if (valid)
+			for (const log_segment& segment : index.segments)
+				remove (hjs_log_segpath (prefix, segment.id).c_str());
+
+		hjs_log_resetindex (index);
+		if (!hjs_log_writeindex (prefix, index))
+			return false;
+	}
+
+	ifstream log(logpath, ios::in | ios::binary);
+	log.seekg (index.size);
+	pos = index.size;
+
+	while (pos - index.size < LOG_SEGMENT_BYTES && getline (log, line))
+	{
+		// a line still being written has no newline yet
+		if (log.eof())
+			break;
+
+		uint32 id = index.lines + offsets.size();
+		int32 day = hjs_log_parseday (line, index.year, index.month);
+
+		if (day >= 0 && (index.buckets.empty() || index.buckets.back().day != day))
+			index.buckets.push_back ({ id, day });
+
+		offsets.push_back (pos);
+		hjs_log_tokenize (line, tokens);
+		for (const string& token : tokens)
+			postings[token].push_back (id);
+
+		pos += line.size() + 1;
+	}
+
+	if (offsets.empty())
+		return false;
+
+	// offsets past index.lines are left over from an update that never got committed
+	{
+		ofstream create(prefix + ".lines", ios::out | ios::binary | ios::app);
+	}
+	fstream lines(prefix + ".lines", ios::in | ios::out | ios::binary);
+	lines.seekp (index.lines * sizeof(uint64_t));
+	lines.write ((const char*)&offsets[0], offsets.size() * sizeof(uint64_t));
+	lines.close();
+	if (lines.fail())
+		return false;
+
+	index.segments.push_back ({ index.next_segment++, index.lines, (uint32)offsets.size() });
+	if (!hjs_log_writesegment (hjs_log_segpath (prefix, index.segments.back().id), postings))
+		return false;
+	postings.clear();
+
+	index.size = pos;
+	index.lines += offsets.size();
+
+	// equal sized neighbours are merged like a binary counter, so a log never has more than log n segments
+	while (index.segments.size() >= 2 && index.segments[index.segments.size() - 2].lines <= index.segments.back().lines)
+	{
+		log_segment newer = index.segments.back();
+		log_segment older = index.segments[index.segments.size() - 2];
+		log_segment merged = { index.next_segment++, older.first_line, older.lines + newer.lines };
+
+		if (!hjs_log_mergesegments (hjs_log_segpath (prefix, older.id), hjs_log_segpath (prefix, newer.id),
+									hjs_log_segpath (prefix, merged.id)))
+			return false;
+
+		obsolete.push_back (older.id);
+		obsolete.push_back (newer.id);
+		index.segments.pop_back();
+		index.segments.back() = merged;
+	}
+
+	// searches hold the lock throughout, so no segment disappears from under one
+	lock_guard<mutex> lock (logindex_mutex);
+
+	if (!hjs_log_writeindex (prefix, index))
+		return false;
+
+	for (uint32 id : obsolete)
+		remove (hjs_log_segpath (prefix, id).c_str());
+
+	return true;
+}
+
+static void
+hjs_log_indexer ()
+{
+	unique_lock<mutex> lock (logindex_queue_mutex);
+
+	// no hexchat or JS calls in here, neither is safe off the main thread
+	for (;;)
+	{
+		logindex_wake.wait (lock, [] { return logindex_stop || !logindex_queue.empty(); });
+		if (logindex_stop)
+			break;
+
+		pair<string, string> job = *logindex_queue.begin();
+		lock.unlock ();
+
+		// a segment at a time so stopping never waits for a whole log
+		bool more = hjs_log_indexchunk (job.first, job.second);
+
+		lock.lock ();
+		if (!more)
+			logindex_queue.erase (job.first);
+	}
+}
+
+static void
+hjs_log_queueindex (const log_file& logfile)
+{
+	{
+		lock_guard<mutex> lock (logindex_queue_mutex);
+		logindex_queue[logfile.path] = logfile.index_path;
+	}
+
+	if (!logindex_thread.joinable())
+		logindex_thread = thread (hjs_log_indexer);
+	logindex_wake.notify_one ();
+}
+
+static void
+hjs_log_shutdown ()
+{
+	if (!logindex_thread.joinable())
+		return;
+
+	// unlike the journal nothing is lost, indexing continues from the last segment next time
+	{
+		lock_guard<mutex> lock (logindex_queue_mutex);
+		logindex_stop = true;
+	}
+	logindex_wake.notify_one ();
+	logindex_thread.join ();
+}
+
+static int32
+hjs_log_lineday (const log_index& index, uint32 id)
+{
+	auto it = upper_bound (index.buckets.begin(), index.buckets.end(), id,
+							[](uint32 line, const log_bucket& bucket) { return line < bucket.first_line; });
+
+	return it == index.buckets.begin() ? -1 : (it - 1)->day;
+}
+
+// adds every line of one log matching all tokens to matches, false if it is still being indexed
+// and the unindexed part was left out, the caller holds logindex_mutex
+static bool
+hjs_log_search (const log_file& logfile, const vector<string>& query, uint32 file, vector<log_match>& matches)
+{
+	log_index index;
+	struct stat st;
+	vector<string> tokens;
+	string line;
+
+	if (stat (logfile.path.c_str(), &st) != 0)
+		return true;
+
+	if (!hjs_log_readindex (logfile.index_path, index) || index.size > (uint64_t)st.st_size)
+		hjs_log_resetindex (index);
+
+	// segments follow each other so intersecting each one on its own keeps line ids ascending
+	for (const log_segment& segment : index.segments)
+	{
+		ifstream in;
+		vector<log_entry> entries (query.size());
+		vector<uint32> result, postings, merged;
+		uint32 ntokens;
+		bool found = hjs_log_openseg (in, hjs_log_segpath (logfile.index_path, segment.id), ntokens);
+
+		for (size_t i = 0; i < query.size() && found; i++)
+			found = hjs_log_findtoken (in, ntokens, query[i], entries[i]);
+		if (!found)
+			continue;
+
+		// smallest first
+		sort (entries.begin(), entries.end(), [](const log_entry& a, const log_entry& b) { return a.count < b.count; });
+
+		hjs_log_readpostings (in, entries[0], result);
+		for (size_t i = 1; i < entries.size() && !result.empty(); i++)
+		{
+			hjs_log_readpostings (in, entries[i], postings);
+			merged.clear();
+			set_intersection (result.begin(), result.end(), postings.begin(), postings.end(),
+								back_inserter (merged));
+			result.swap (merged);
+		}
+
+		for (uint32 id : result)
+			matches.push_back ({ hjs_log_lineday (index, id), file, id, true });
+	}
+
+	// more than a little unindexed log is left to the worker rather than scanned here
+	if ((uint64_t)st.st_size - index.size > LOG_INDEX_SLACK)
+	{
+		hjs_log_queueindex (logfile);
+		return false;
+	}
+
+	// scan whatever was logged since the index was written
+	ifstream log(logfile.path, ios::in | ios::binary);
+	uint64_t pos = index.size;
+	int32 day = index.buckets.empty() ? -1 : index.buckets.back().day;
+
+	log.seekg (pos);
+	while (getline (log, line))
+	{
+		int32 lineday = hjs_log_parseday (line, index.year, index.month);
+		if (lineday >= 0)
+			day = lineday;
+
+		hjs_log_tokenize (line, tokens);
+		if (includes (tokens.begin(), tokens.end(), query.begin(), query.end()))
+			matches.push_back ({ day, file, pos, false });
+
+		pos += line.size() + 1;
+	}
+
+	return true;
+}
+
+
+/* js functions */
+
+static JSBool
+hjs_print (JSContext *context, unsigned argc, jsval *vp)
+{
+	JSObject* obj;
+	JSString* str;
+	char* cstr;
+
+	if (!JS_ConvertArguments (context, argc, JS_ARGV(context, vp), "o", &obj))
+		return JS_FALSE;
+
+	str = JS_ValueToString (context, OBJECT_TO_JSVAL(obj));
+	if (str != nullptr)
+	{
+		cstr = JSSTRING_TO_CHAR(str);
+		hjs_script_print (context, cstr);
+		JS_free(context, cstr);
+	}
+
+	JS_SET_RVAL (context, vp, JSVAL_VOID);
+
+	return JS_TRUE;
+}
+
+static JSBool
+hjs_printlines (JSContext *context, unsigned argc, jsval *vp)
+{
+	JSObject* lines;
+	jsuint len;
+	string text;
+
+	if (!JS_ConvertArguments (context, argc, JS_ARGV(context, vp), "o", &lines))
+		return JS_FALSE;
+
+	if (!JS_IsArrayObject (context, lines) || !JS_GetArrayLength (context, lines, &len))
+		return JS_FALSE;
+
+	for (jsuint i = 0; i < len; i++)
+	{
+		JSString* str;
+		jsval val;
+		char* cstr;
+
+		if (!JS_GetElement (context, lines, i, &val) || (str = JS_ValueToString (context, val)) == nullptr)
+			return JS_FALSE;
+
+		cstr = JSSTRING_TO_CHAR(str);
+		if (i)
+			text += '\n';
+		text += cstr;
+		JS_free(context, cstr);
+	}
+
+	if (len)
+		hjs_script_print (context, text.c_str());
+
+	JS_SET_RVAL (context, vp, JSVAL_VOID);
+
+	return JS_TRUE;
+}
+
+static JSBool
+hjs_printstream (JSContext *context, unsigned argc, jsval *vp)
+{
+	jsval* argv = JS_ARGV(context, vp);
+	hexchat_context* ctx = hexchat_get_context (ph);
+	JSString* str;
+	char* cstr;
+
+	if (!JS_ConvertArguments (context, argc, argv, "*"))
+		return JS_FALSE;
+
+	if (!JSVAL_IS_PRIMITIVE(argv[0]) && JS_IsArrayObject (context, JSVAL_TO_OBJECT(argv[0])))
+	{
+		JSObject* lines = JSVAL_TO_OBJECT(argv[0]);
+		jsuint len;
+
+		if (!JS_GetArrayLength (context, lines, &len))
+			return JS_FALSE;
+
+		for (jsuint i = 0; i < len; i++)
+		{
+			jsval val;
+
+			if (!JS_GetElement (context, lines, i, &val) || (str = JS_ValueToString (context, val)) == nullptr)
+				return JS_FALSE;
+
+			cstr = JSSTRING_TO_CHAR(str);
+			hjs_stream_push (ctx, cstr);
+			JS_free(context, cstr);
+		}
+	}
+	else
+	{
+		if ((str = JS_ValueToString (context, argv[0])) == nullptr)
+			return JS_FALSE;
+
+		cstr = JSSTRING_TO_CHAR(str);
+		hjs_stream_push (ctx, cstr);
+		JS_free(context, cstr);
+	}
+
+	// scripts can hold off producing more while this is large
+	JS_SET_RVAL (context, vp, INT_TO_JSVAL(stream_queue.size()));
+
+	return JS_TRUE;
+}
+
+static JSBool
+hjs_streampending (JSContext *context, unsigned argc, jsval *vp)
+{
+	if (!JS_ConvertArguments (context, argc, JS_ARGV(context, vp), ""))
+		return JS_FALSE;
+
+	JS_SET_RVAL (context, vp, INT_TO_JSVAL(stream_queue.size()));
+
+	return JS_TRUE;
+}
+
+static JSBool
+hjs_bufferprints (JSContext *context, unsigned argc, jsval *vp)
+{
+	JSBool enable;
+	js_script* script = hjs_script_find (context);
+
+	if (!JS_ConvertArguments (context, argc, JS_ARGV(context, vp), "b", &enable))
+		return JS_FALSE;
+
+	if (script != nullptr)
+	{
+		JS_SET_RVAL (context, vp, BOOLEAN_TO_JSVAL(script->buffer_prints));
+		script->buffer_prints = enable;
+		if (!enable)
+			hjs_script_flushprints (context);
+	}
+	else
+		JS_SET_RVAL (context, vp, JSVAL_FALSE);
+
+	return JS_TRUE;
+}
+
+static JSBool
+hjs_flushprints (JSContext *context, unsigned argc, jsval *vp)
+{
+	if (!JS_ConvertArguments (context, argc, JS_ARGV(context, vp), ""))
+		return JS_FALSE;
+
+	hjs_script_flushprints (context);
+
+	JS_SET_RVAL (context, vp, JSVAL_VOID);
+
+	return JS_TRUE;
+}
+
+static JSBool
+hjs_emitprint (JSContext *context, unsigned argc, jsval *vp)
+{
+	jsval* argv = JS_ARGV(context, vp);
+	JSString* name;
+	char* carg[HJS_MAX_EVENT_ARGS] = { nullptr };
+	char* cname;
+	scratch_encoder encoder (context);
+	int ret;
+
+	if (!JS_ConvertArguments (context, argc, argv, "S", &name))
+		return JS_FALSE;
+
+	cname = encoder.encode (name);
+
+	// any further arguments are event arguments
+	for (unsigned i = 1; i < argc && i <= HJS_MAX_EVENT_ARGS; i++)
+	{
+		JSString* str = JS_ValueToString (context, argv[i]);
+		if (str == nullptr)
+			return JS_FALSE;
+		carg[i - 1] = encoder.encode (str);
+	}
+
+	hjs_script_flushprints (context);
+	ret = hexchat_emit_print (ph, cname, EVENT_ARGS(carg));
+
+	JS_SET_RVAL (context, vp, BOOLEAN_TO_JSVAL(ret));
+
+	return JS_TRUE;
+}
+
+static JSBool
+hjs_emitprintat (JSContext *context, unsigned argc, jsval *vp)
+{
+	jsval* argv = JS_ARGV(context, vp);
+	JSObject* date;
+	JSString* name;
+	char* carg[HJS_MAX_EVENT_ARGS] = { nullptr };
+	char* cname;
+	scratch_encoder encoder (context);
+	hexchat_event_attrs* attrs;
+	int ret;
+
+	if (!JS_ConvertArguments (context, argc, argv, "oS", &date, &name))
+		return JS_FALSE;
+
+	cname = encoder.encode (name);
+
+	for (unsigned i = 2; i < argc && i < HJS_MAX_EVENT_ARGS + 2; i++)
+	{
+		JSString* str = JS_ValueToString (context, argv[i]);
+		if (str == nullptr)
+			return JS_FALSE;
+		carg[i - 2] = encoder.encode (str);
+	}
+
+	hjs_script_flushprints (context);
+	attrs = hexchat_event_attrs_create(ph);
+	attrs->server_time_utc = hjs_util_timefromdate(context, date);
+
+	ret = hexchat_emit_print_attrs (ph, attrs, cname, EVENT_ARGS(carg));
+
+	hexchat_event_attrs_free(ph, attrs);
+
+	JS_SET_RVAL (context, vp, BOOLEAN_TO_JSVAL(ret));
+
+	return JS_TRUE;
+}
+
+static JSBool
+hjs_emitprintbatch (JSContext *context, unsigned argc, jsval *vp)
+{
+	JSString* name;
+	JSObject* rows;
+	char cname[64];
+	jsuint len;
+	int count = 0;
+
+	if (!JS_ConvertArguments (context, argc, JS_ARGV(context, vp), "So", &name, &rows))
+		return JS_FALSE;
+
+	if (!JS_IsArrayObject (context, rows) || !JS_GetArrayLength (context, rows, &len))
+		return JS_FALSE;
+
+	// no event name is this long
+	if (!hjs_util_encodebuf (name, cname, sizeof(cname)))
+	{
+		JS_SET_RVAL (context, vp, INT_TO_JSVAL(0));
+		return JS_TRUE;
+	}
+
+	hjs_script_flushprints (context);
+
+	for (jsuint i = 0; i < len; i++)
+	{
+		JSObject* row;
+		jsval val;
+		jsuint nargs = 0;
+		char* carg[HJS_MAX_EVENT_ARGS] = { nullptr };
+		scratch_encoder encoder (context);
+
+		if (!JS_GetElement (context, rows, i, &val) || JSVAL_IS_PRIMITIVE(val))
+			continue;
+
+		row = JSVAL_TO_OBJECT(val);
+		JS_GetArrayLength (context, row, &nargs);
+
+		for (jsuint j = 0; j < nargs && j < HJS_MAX_EVENT_ARGS; j++)
+		{
+			JSString* str;
+
+			if (!JS_GetElement (context, row, j, &val) || (str = JS_ValueToString (context, val)) == nullptr)
+				return JS_FALSE;
+			carg[j] = encoder.encode (str);
+		}
+
+		if (hexchat_emit_print (ph, cname, EVENT_ARGS(carg)))
+			count++;
+	}
+
+	JS_SET_RVAL (context, vp, INT_TO_JSVAL(count));
+
+	return JS_TRUE;
+}
+
+static JSBool
+hjs_command (JSContext *context, unsigned argc, jsval *vp)
+{
+	JSString* cmd;
+	char* ccmd;
+
+	if (!JS_ConvertArguments (context, argc, JS_ARGV(context, vp), "S", &cmd))
+		return JS_FALSE;
+
+	hjs_script_flushprints (context);
+
+	ccmd = JSSTRING_TO_CHAR(cmd);
+	hexchat_command (ph, ccmd);
+	JS_free(context, ccmd);
+
+	JS_SET_RVAL (context, vp, JSVAL_VOID);
+
+	return JS_TRUE;
+}
+
+static JSBool
+hjs_queuecommand (JSContext *context, unsigned argc, jsval *vp)
+{
+	JSString* cmd;
+	char* ccmd;
+	int pri = HEXCHAT_PRI_NORM;
+	int id = hjs_util_serverid ();
+	queued_command command;
+	size_t pos;
+
+	if (!JS_ConvertArguments (context, argc, JS_ARGV(context, vp), "S/i", &cmd, &pri))
+		return JS_FALSE;
+
+	ccmd = JSSTRING_TO_CHAR(cmd);
+	command.cmd = string(ccmd);
+	JS_free(context, ccmd);
+
+	command.priority = pri;
+	command.ctx = hexchat_get_context (ph);
+	command.owner = hjs_script_find (context);
+
+	// split into verb, target and the rest for merging
+	pos = command.cmd.find (' ');
+	command.verb = command.cmd.substr (0, pos);
+	for (char& c : command.verb)
+		c = tolower ((unsigned char)c);
+	if (pos != string::npos)
+	{
+		size_t end = command.cmd.find (' ', pos + 1);
+		command.target = command.cmd.substr (pos + 1, end == string::npos ? end : end - pos - 1);
+		if (end != string::npos)
+			command.rest = command.cmd.substr (end + 1);
+	}
+
+	auto found = command_queues.find (id);
+	if (found == command_queues.end())
+	{
+		command_queue queue;
+		queue.tokens = queue_burst;
+		queue.last_refill = chrono::steady_clock::now();
+		queue.sent = queue.merged = queue.dropped = 0;
+		found = command_queues.insert (make_pair (id, queue)).first;
+	}
+	found->second.commands.push_back (command);
+
+	hjs_script_flushprints (context);
+
+	// send right away while there are tokens left
+	if (hjs_queue_drain () && queue_timer == nullptr)
+		queue_timer = hexchat_hook_timer (ph, 250, hjs_queue_timer_cb, nullptr);
+
+	JS_SET_RVAL (context, vp, INT_TO_JSVAL(found->second.commands.size()));
+
+	return JS_TRUE;
+}
+
+static JSBool
+hjs_queuestats (JSContext *context, unsigned argc, jsval *vp)
+{
+	JSObject* ret;
+	jsval val;
+	int depth = 0;
+	double drain = 0;
+	unsigned long sent = 0, merged = 0, dropped = 0;
+
+	if (!JS_ConvertArguments (context, argc, JS_ARGV(context, vp), ""))
+		return JS_FALSE;
+
+	auto found = command_queues.find (hjs_util_serverid ());
+	if (found != command_queues.end())
+	{
+		command_queue& queue = found->second;
+
+		hjs_queue_refill (queue);
+		depth = queue.commands.size();
+		sent = queue.sent;
+		merged = queue.merged;
+		dropped = queue.dropped;
+
+		// worst case, merging can only make it faster
+		if (depth > queue.tokens)
+			drain = (depth - queue.tokens) * queue_interval;
+	}
+
+	ret = JS_NewObject (context, nullptr, nullptr, nullptr);
+	if (ret == nullptr)
+		return JS_FALSE;
+
+	if (!JS_DefineProperty (context, ret, "depth", INT_TO_JSVAL(depth), nullptr, nullptr,
+							JSPROP_READONLY|JSPROP_ENUMERATE)
+		|| !JS_NewNumberValue (context, drain, &val)
+		|| !JS_DefineProperty (context, ret, "drain_time", val, nullptr, nullptr, JSPROP_READONLY|JSPROP_ENUMERATE)
+		|| !JS_NewNumberValue (context, sent, &val)
+		|| !JS_DefineProperty (context, ret, "sent", val, nullptr, nullptr, JSPROP_READONLY|JSPROP_ENUMERATE)
+		|| !JS_NewNumberValue (context, merged, &val)
+		|| !JS_DefineProperty (context, ret, "merged", val, nullptr, nullptr, JSPROP_READONLY|JSPROP_ENUMERATE)
+		|| !JS_NewNumberValue (context, dropped, &val)
+		|| !JS_DefineProperty (context, ret, "dropped", val, nullptr, nullptr, JSPROP_READONLY|JSPROP_ENUMERATE))
+		return JS_FALSE;
+
+	JS_SET_RVAL (context, vp, OBJECT_TO_JSVAL(ret));
+
+	return JS_TRUE;
+}
+
+static JSBool
+hjs_setqueuerate (JSContext *context, unsigned argc, jsval *vp)
+{
+	int burst, interval;
+	int merge = queue_merge_limit;
+
+	if (!JS_ConvertArguments (context, argc, JS_ARGV(context, vp), "ii/i", &burst, &interval, &merge))
+		return JS_FALSE;
+
+	if (burst < 1 || interval < 1 || merge < 1)
+		return JS_FALSE;
+
+	queue_burst = burst;
+	queue_interval = interval;
+	queue_merge_limit = merge;
+
+	JS_SET_RVAL (context, vp, JSVAL_VOID);
+
+	return JS_TRUE;
+}
+
+static JSBool
+hjs_clearqueue (JSContext *context, unsigned argc, jsval *vp)
+{
+	int cleared = 0;
+
+	if (!JS_ConvertArguments (context, argc, JS_ARGV(context, vp), ""))
+		return JS_FALSE;
+
+	auto found = command_queues.find (hjs_util_serverid ());
+	if (found != command_queues.end())
+	{
+		cleared = found->second.commands.size();
+		found->second.commands.clear();
+	}
+
+	JS_SET_RVAL (context, vp, INT_TO_JSVAL(cleared));
+
+	return JS_TRUE;
+}
+
+static JSBool
+hjs_nickcmp (JSContext *context, unsigned argc, jsval *vp)
+{
+	JSString* nick1;
+	JSString* nick2;
+	char* cnick1;
+	char* cnick2;
+	int ret;
+
+	if (!JS_ConvertArguments (context, argc, JS_ARGV(context, vp), "SS", &nick1, &nick2))
+		return JS_FALSE;
+
+	cnick1 = JSSTRING_TO_CHAR(nick1);
+	cnick2 = JSSTRING_TO_CHAR(nick2);
+	ret = hexchat_nickcmp (ph, cnick1, cnick2);
+	JS_free(context, cnick1);
+	JS_free(context, cnick2);
+
+	JS_SET_RVAL (context, vp, INT_TO_JSVAL (ret));
+
+	return JS_TRUE;
+}
+
+// index of the first control character, or len if there is none
+static size_t
+hjs_strip_findctrl (const jschar *chars, size_t len)
+{
+	size_t i = 0;
+
+#ifdef HJS_HAVE_SSE2
+	const __m128i max = _mm_set1_epi16 (0x1f);
+	const __m128i zero = _mm_setzero_si128 ();
+
+	// 8 chars at a time, saturating subtract leaves 0 for anything <= 0x1f
+	for (; i + 8 <= len; i += 8)
+	{
+		__m128i v = _mm_loadu_si128 ((const __m128i*)(chars + i));
+		if (_mm_movemask_epi8 (_mm_cmpeq_epi16 (_mm_subs_epu16 (v, max), zero)))
+			break;
+	}
+#endif
+
+	for (; i < len; i++)
+		if (chars[i] < 0x20)
+			return i;
+
+	return len;
+}
+
+static JSString*
+hjs_strip_string (JSContext *context, JSString *str, int flags)
+{
+	const jschar* chars;
+	size_t len, i;
+	vector<jschar> out;
+
+	chars = JS_GetStringCharsAndLength (context, str, &len);
+	if (chars == nullptr)
+		return nullptr;
+
+	i = hjs_strip_findctrl (chars, len);
+	if (i == len)
+		return str;
+
+	out.reserve (len);
+	out.assign (chars, chars + i);
+
+	for (; i < len; i++)
+	{
+		jschar c = chars[i];
+
+		if (c == '\003' && (flags & 1))
+		{
+			int digits = 0;
+
+			// \003[fg][,bg] with up to two digits each, hexchat takes a lone ,bg too
+			while (digits < 2 && i + 1 < len && chars[i + 1] >= '0' && chars[i + 1] <= '9')
+			{
+				i++;
+				digits++;
+			}
+
+			if (i + 2 < len && chars[i + 1] == ',' && chars[i + 2] >= '0' && chars[i + 2] <= '9')
+			{
+				i += 2;
+				if (i + 1 < len && chars[i + 1] >= '0' && chars[i + 1] <= '9')
+					i++;
+			}
+		}
+		else if ((flags & 2) && (c == '\002' || c == '\007' || c == '\017' || c == '\026'
+									|| c == '\035' || c == '\036' || c == '\037'))
+			continue;
+		else if ((flags & 4) && c == '\010') // hidden text, only stripped on request like hexchat does
+			continue;
+		else
+			out.push_back (c);
+	}
+
+	if (out.size() == len)
+		return str;
+
+	return JS_NewUCStringCopyN (context, out.data(), out.size());
+}
+
+static JSBool
+hjs_strip (JSContext *context, unsigned argc, jsval *vp)
+{
+	jsval* argv = JS_ARGV(context, vp);
+	JSString* str;
+	JSString* ret;
+	int flags = 3;
+
+	if (!JS_ConvertArguments (context, argc, argv, "*/i", &flags))
+		return JS_FALSE;
+
+	// arrays are stripped element by element into a new array
+	if (!JSVAL_IS_PRIMITIVE(argv[0]) && JS_IsArrayObject (context, JSVAL_TO_OBJECT(argv[0])))
+	{
+		JSObject* input = JSVAL_TO_OBJECT(argv[0]);
+		JSObject* output;
+		jsuint len;
+
+		if (!JS_GetArrayLength (context, input, &len)
+			|| (output = JS_NewArrayObject (context, 0, nullptr)) == nullptr)
+			return JS_FALSE;
+
+		for (jsuint i = 0; i < len; i++)
+		{
+			jsval val;
+
+			if (!JS_GetElement (context, input, i, &val)
+				|| (str = JS_ValueToString (context, val)) == nullptr
+				|| (ret = hjs_strip_string (context, str, flags)) == nullptr)
+				return JS_FALSE;
+
+			val = STRING_TO_JSVAL(ret);
+			if (!JS_SetElement (context, output, i, &val))
+				return JS_FALSE;
+		}
+
+		JS_SET_RVAL (context, vp, OBJECT_TO_JSVAL(output));
+		return JS_TRUE;
+	}
+
+	str = JS_ValueToString (context, argv[0]);
+	if (str == nullptr || (ret = hjs_strip_string (context, str, flags)) == nullptr)
+		return JS_FALSE;
+
+	JS_SET_RVAL (context, vp, STRING_TO_JSVAL(ret));
+
+	return JS_TRUE;
+}
+
+static bool
+hjs_info_iscacheable (const char *id)
+{
+	// only values whose changes are covered by the invalidation hooks
+	static const char* cacheable[] = { "away", "channel", "configdir", "host", "libdirfs",
+										"network", "nick", "server", "topic", "version", nullptr };
+
+	for (int i = 0; cacheable[i]; i++)
+		if (strcmp (cacheable[i], id) == 0)
+			return true;
+
+	return false;
+}
+
+static JSBool
+hjs_getinfo (JSContext *context, unsigned argc, jsval *vp)
+{
+	JSString* str;
+	char cstr[64];
+	const char* cret;
+	string key;
+	jsval ret;
+	js_script* script = hjs_script_find (context);
+
+	if (!JS_ConvertArguments (context, argc, JS_ARGV(context, vp), "S", &str))
+		return JS_FALSE;
+
+	// no valid id is this long
+	if (!hjs_util_encodebuf (str, cstr, sizeof(cstr)))
+	{
+		JS_SET_RVAL (context, vp, JSVAL_VOID);
+		return JS_TRUE;
+	}
+
+	if (script != nullptr && hjs_info_iscacheable (cstr))
+	{
+		key = string(cstr) + '@' + to_string((unsigned long long)hexchat_get_context (ph));
+		if (script->info_cache.lookup (context, info_generation, key, &ret))
+		{
+			JS_SET_RVAL (context, vp, ret);
+			return JS_TRUE;
+		}
+	}
+
+	cret = hexchat_get_info (ph, cstr);
+
+	if (cret == nullptr)
+	{
+		JS_SET_RVAL (context, vp, JSVAL_VOID);
+	}
+	else
+	{
+		ret = STRING_TO_JSVAL(hjs_util_newstring (context, script, cret));
+		if (!key.empty())
+		{
+			script->info_cache.store (context, key, ret);
+			hjs_generation_expire ();
+		}
+		JS_SET_RVAL (context, vp, ret);
+	}
+
+	return JS_TRUE;
+}
+
+static JSBool
+hjs_getprefs (JSContext *context, unsigned argc, jsval *vp)
+{
+	JSString* str;
+	char cstr[64];
+	const char* cstrret;
+	int intret, cret;
+	jsval ret = JSVAL_VOID;
+	bool cacheable;
+	js_script* script = hjs_script_find (context);
+
+	if (!JS_ConvertArguments (context, argc, JS_ARGV(context, vp), "S", &str))
+		return JS_FALSE;
+
+	if (!hjs_util_encodebuf (str, cstr, sizeof(cstr)))
+	{
+		JS_SET_RVAL (context, vp, JSVAL_VOID);
+		return JS_TRUE;
+	}
+
+	// these two are not settings but current state
+	cacheable = (script != nullptr && strcmp (cstr, "id") != 0 && strcmp (cstr, "state_cursor") != 0);
+
+	if (cacheable && script->prefs_cache.lookup (context, prefs_generation, cstr, &ret))
+	{
+		JS_SET_RVAL (context, vp, ret);
+		return JS_TRUE;
+	}
+
+	cret = hexchat_get_prefs (ph, cstr, &cstrret, &intret);
+
+	switch (cret)
+	{
+		case 0: // fail
+			JS_SET_RVAL (context, vp, JSVAL_VOID);
+			return JS_TRUE;
+
+		case 1: // string
+			ret = STRING_TO_JSVAL(JS_NewStringCopyZ (context, cstrret));
+			break;
+
+		case 2: // int
+			ret = INT_TO_JSVAL(intret);
+			break;
+
+		case 3: // bool
+			ret = BOOLEAN_TO_JSVAL(intret);
+			break;
+	}
+
+	if (cacheable)
+	{
+		script->prefs_cache.store (context, cstr, ret);
+		hjs_generation_expire ();
+	}
+
+	JS_SET_RVAL (context, vp, ret);
+
+	return JS_TRUE;
+}
+
+static JSBool
+hjs_getlist (JSContext *context, unsigned argc, jsval *vp)
+{
+	JSString* list_name;
+	JSObject* js_list;
+	const char* const *fields;
+	const char* field;
+	const char* name;
+	hexchat_list* list = nullptr;
+	jsval iattr, sattr, tattr;
+	js_script* script = hjs_script_find (context);
+
+	if (!JS_ConvertArguments (context, argc, JS_ARGV(context, vp), "S", &list_name))
+		return JS_FALSE;
+
+	name = hjs_util_listname (context, list_name);
+	if (name == nullptr)
+		goto listerr;
+
+	js_list = JS_NewArrayObject (context, 0, nullptr);
+	if (js_list == nullptr)
+		goto listerr;
+
+	list = hexchat_list_get (ph, name);
+	if (list == nullptr)
+		goto listerr;
+
+	fields = hexchat_list_fields (ph, name);
+	for (int index = 0; hexchat_list_next (ph, list); index++)
+	{
+		JSObject* list_obj = JS_NewObject (context, &list_entry_class, nullptr, nullptr);
+		if (list_obj == nullptr)
+			goto listerr;
+
+		for (int i = 0; fields[i]; i++)
+		{
+			field = fields[i]+1;
+			switch(fields[i][0])
+			{
+				case 's': // string
+					sattr = STRING_TO_JSVAL(hjs_util_newstring (context, script, hexchat_list_str (ph, list, field)));
+					if (!JS_DefineProperty (context, list_obj, field, sattr,
+											nullptr, nullptr, JSPROP_READONLY|JSPROP_ENUMERATE))
+							goto listerr;
+					break;
+
+				case 'i': // int
+					iattr = INT_TO_JSVAL(hexchat_list_int (ph, list, field));
+					if (!JS_DefineProperty (context, list_obj, field, iattr,
+										nullptr, nullptr, JSPROP_READONLY|JSPROP_ENUMERATE))
+							goto listerr;
+					break;
+
+				case 't': // time
+					tattr = hjs_util_datefromtime (context, hexchat_list_time (ph, list, field));
+					if (!JS_DefineProperty (context, list_obj, field, tattr,
+										nullptr, nullptr, JSPROP_READONLY|JSPROP_ENUMERATE))
+							goto listerr;
+					break;
+
+				case 'p': // pointer
+					if (!strcmp(field, "context"))
+					{
+						const char *ptr = hexchat_list_str (ph, list, field);
+						sattr = hjs_util_pointer_to_jsval (context, ptr);
+						if (!JS_DefineProperty (context, list_obj, field, sattr,
+										nullptr, nullptr, JSPROP_READONLY|JSPROP_ENUMERATE))
+							goto listerr;
+					}
+					// No other pointers exist atm and we couldn't handle them.
+					break;
+			}
+		}
+		JS_DefineElement (context, js_list, index, OBJECT_TO_JSVAL(list_obj), nullptr, nullptr,
+						JSPROP_READONLY|JSPROP_PERMANENT|JSPROP_ENUMERATE);
+	}
+
+	hexchat_list_free (ph, list);
+
+	JS_SET_RVAL (context, vp, OBJECT_TO_JSVAL(js_list));
+
+	return JS_TRUE;
+
+	listerr:
+		if (list)
+			hexchat_list_free (ph, list);
+
+		JS_SET_RVAL (context, vp, JSVAL_VOID);
+		return JS_FALSE;
+}
+
+// filters for count_list: every string field compares case-insensitively using the
+// server's casemapping (hexchat_nickcmp), not just nicks; numbers and pointers compare exactly
+// and times take a Date or seconds
+static bool
+hjs_list_parsefilter (JSContext *context, JSObject *obj, const char *name, vector<list_filter>& filters)
+{
+	const char* const *fields = hexchat_list_fields (ph, name);
+	JSIdArray* ids = JS_Enumerate (context, obj);
+
+	if (ids == nullptr)
+		return false;
+
+	for (jsint i = 0; i < ids->length; i++)
+	{
+		list_filter filter;
+		jsval idval, val;
+		JSString* str;
+		char* cstr;
+
+		// a filter that can't be read is an error, dropping it would count more than asked for
+		if (!JS_IdToValue (context, ids->vector[i], &idval)
+			|| !JS_GetPropertyById (context, obj, ids->vector[i], &val)
+			|| (str = JS_ValueToString (context, idval)) == nullptr)
+			goto filtererr;
+
+		cstr = JSSTRING_TO_CHAR(str);
+		filter.field = string(cstr);
+		JS_free(context, cstr);
+
+		// unknown fields and pointers can never match
+		filter.type = 0;
+		for (int f = 0; fields[f]; f++)
+			if (filter.field == fields[f] + 1)
+				filter.type = fields[f][0];
+
+		if (filter.type == 's' || filter.type == 'p')
+		{
+			if ((str = JS_ValueToString (context, val)) == nullptr)
+				goto filtererr;
+			cstr = JSSTRING_TO_CHAR(str);
+			filter.str = string(cstr);
+			JS_free(context, cstr);
+		}
+		else if (filter.type == 'i')
+		{
+			int32 num;
+			if (!JS_ValueToECMAInt32 (context, val, &num))
+				goto filtererr;
+			filter.num = num;
+		}
+		else if (filter.type == 't')
+		{
+			double num;
+
+			// a Date as get_list returns it, or seconds
+			if (!JSVAL_IS_PRIMITIVE(val) && JS_ObjectIsDate (context, JSVAL_TO_OBJECT(val)))
+				filter.time = hjs_util_timefromdate (context, JSVAL_TO_OBJECT(val));
+			else if (JS_ValueToNumber (context, val, &num) && !std::isnan (num))
+				filter.time = (time_t)num;
+			else
+				goto filtererr;
+		}
+
+		filters.push_back (filter);
+	}
+	JS_DestroyIdArray (context, ids);
+
+	return true;
+
+	filtererr:
+		JS_DestroyIdArray (context, ids);
+		return false;
+}
+
+static bool
+hjs_list_matches (hexchat_list *list, const vector<list_filter>& filters)
+{
+	for (const list_filter& filter : filters)
+	{
+		const char* str;
+
+		switch (filter.type)
+		{
+			case 's':
+				str = hexchat_list_str (ph, list, filter.field.c_str());
+				if (str == nullptr || hexchat_nickcmp (ph, str, filter.str.c_str()) != 0)
+					return false;
+				break;
+
+			case 'p':
+				str = hexchat_list_str (ph, list, filter.field.c_str());
+				if (to_string((unsigned long long)str) != filter.str)
+					return false;
+				break;
+
+			case 'i':
+				if (hexchat_list_int (ph, list, filter.field.c_str()) != filter.num)
+					return false;
+				break;
+
+			case 't':
+				if (hexchat_list_time (ph, list, filter.field.c_str()) != filter.time)
+					return false;
+				break;
+
+			default:
+				return false;
+		}
+	}
+
+	return true;
+}
+
+static JSBool
+hjs_countlist (JSContext *context, unsigned argc, jsval *vp)
+{
+	JSString* list_name;
+	JSObject* filterobj = nullptr;
+	const char* name;
+	hexchat_list* list;
+	vector<list_filter> filters;
+	int count = 0;
+
+	if (!JS_ConvertArguments (context, argc, JS_ARGV(context, vp), "S/o", &list_name, &filterobj))
+		return JS_FALSE;
+
+	name = hjs_util_listname (context, list_name);
+	if (name == nullptr)
+	{
+		JS_SET_RVAL (context, vp, JSVAL_VOID);
+		return JS_TRUE;
+	}
+
+	if (filterobj && !hjs_list_parsefilter (context, filterobj, name, filters))
+		return JS_FALSE;
+
+	list = hexchat_list_get (ph, name);
+	if (list == nullptr)
+	{
+		JS_SET_RVAL (context, vp, INT_TO_JSVAL(0));
+		return JS_TRUE;
+	}
+
+	while (hexchat_list_next (ph, list))
+		if (filters.empty() || hjs_list_matches (list, filters))
+			count++;
+
+	hexchat_list_free (ph, list);
+
+	JS_SET_RVAL (context, vp, INT_TO_JSVAL(count));
+
+	return JS_TRUE;
+}
+
+static JSBool
+hjs_countusers (JSContext *context, unsigned argc, jsval *vp)
+{
+	JSObject* ret;
+	JSObject* prefixes;
+	hexchat_list* list;
+	map<string, int> prefix_counts;
+	int total = 0, away = 0;
+
+	if (!JS_ConvertArguments (context, argc, JS_ARGV(context, vp), ""))
+		return JS_FALSE;
+
+	list = hexchat_list_get (ph, "users");
+	if (list == nullptr)
+	{
+		JS_SET_RVAL (context, vp, JSVAL_VOID);
+		return JS_TRUE;
+	}
+
+	while (hexchat_list_next (ph, list))
+	{
+		const char* prefix = hexchat_list_str (ph, list, "prefix");
+
+		total++;
+		if (hexchat_list_int (ph, list, "away"))
+			away++;
+		prefix_counts[prefix ? prefix : ""]++;
+	}
+	hexchat_list_free (ph, list);
+
+	ret = JS_NewObject (context, nullptr, nullptr, nullptr);
+	prefixes = JS_NewObject (context, nullptr, nullptr, nullptr);
+	if (ret == nullptr || prefixes == nullptr)
+		return JS_FALSE;
+
+	// users without a prefix are counted under ""
+	for (auto& prefix : prefix_counts)
+	{
+		if (!JS_DefineProperty (context, prefixes, prefix.first.c_str(), INT_TO_JSVAL(prefix.second),
+								nullptr, nullptr, JSPROP_READONLY|JSPROP_ENUMERATE))
+			return JS_FALSE;
+	}
+
+	if (!JS_DefineProperty (context, ret, "total", INT_TO_JSVAL(total), nullptr, nullptr,
+							JSPROP_READONLY|JSPROP_ENUMERATE)
+		|| !JS_DefineProperty (context, ret, "away", INT_TO_JSVAL(away), nullptr, nullptr,
+								JSPROP_READONLY|JSPROP_ENUMERATE)
+		|| !JS_DefineProperty (context, ret, "prefixes", OBJECT_TO_JSVAL(prefixes), nullptr, nullptr,
+								JSPROP_READONLY|JSPROP_ENUMERATE))
+		return JS_FALSE;
+
+	JS_SET_RVAL (context, vp, OBJECT_TO_JSVAL(ret));
+
+	return JS_TRUE;
+}
+
+static void
+hjs_util_jsonescape (string& out, const char *str)
+{
+	static const char hex[] = "0123456789abcdef";
+
+	out += '"';
+	for (; *str; str++)
+	{
+		unsigned char c = *str;
+
+		if (c == '"' || c == '\\')
+		{
+			out += '\\';
+			out += c;
+		}
+		else if (c < 0x20)
+		{
+			// irc formatting codes are control characters
+			out += "\\u00";
+			out += hex[c >> 4];
+			out += hex[c & 0xf];
+		}
+		else
+			out += c;
+	}
+	out += '"';
+}
+
+template <typename T> static void
+hjs_util_packvalue (string& out, T value)
+{
+	out.append ((const char*)&value, sizeof(value));
+}
+
+/* Binary layout, all integers in host byte order:
+ *   "HJSL" uint32 rows, uint16 fields, per field: uint8 type, uint8 namelen, name
+ *   per row and field: 's'/'p' uint32 len + bytes, 'i' int32, 't' int64 seconds */
+static JSBool
+hjs_getlistserialized (JSContext *context, unsigned argc, jsval *vp)
+{
+	JSString* list_name;
+	JSObject* fieldsobj = nullptr;
+	JSString* format = nullptr;
+	const char* const *fields;
+	const char* name;
+	hexchat_list* list;
+	vector<const char*> wanted;
+	bool binary = false;
+	string out;
+	uint32 rows = 0;
+
+	if (!JS_ConvertArguments (context, argc, JS_ARGV(context, vp), "S/oS", &list_name, &fieldsobj, &format))
+		return JS_FALSE;
+
+	name = hjs_util_listname (context, list_name);
+	if (name == nullptr)
+	{
+		JS_SET_RVAL (context, vp, JSVAL_VOID);
+		return JS_TRUE;
+	}
+
+	if (format)
+	{
+		char cformat[16];
+
+		if (!hjs_util_encodebuf (format, cformat, sizeof(cformat)))
+			return JS_FALSE;
+		binary = (strcmp (cformat, "binary") == 0);
+		if (!binary && strcmp (cformat, "json") != 0)
+			return JS_FALSE;
+	}
+
+	// null or undefined picks every field, anything else has to be a list of names
+	if (fieldsobj != nullptr && !JS_IsArrayObject (context, fieldsobj))
+		return JS_FALSE;
+
+	// pick the requested fields, or all of them, skipping pointers we can't represent
+	fields = hexchat_list_fields (ph, name);
+	for (int i = 0; fields[i]; i++)
+	{
+		if (fields[i][0] == 'p' && strcmp (fields[i] + 1, "context") != 0)
+			continue;
+
+		if (fieldsobj != nullptr)
+		{
+			jsuint len;
+			bool found = false;
+
+			JS_GetArrayLength (context, fieldsobj, &len);
+			for (jsuint j = 0; !found && j < len; j++)
+			{
+				jsval val;
+				char cfield[32];
+
+				if (JS_GetElement (context, fieldsobj, j, &val) && JSVAL_IS_STRING(val)
+					&& hjs_util_encodebuf (JSVAL_TO_STRING(val), cfield, sizeof(cfield)))
+					found = (strcmp (cfield, fields[i] + 1) == 0);
+			}
+
+			if (!found)
+				continue;
+		}
+
+		wanted.push_back (fields[i]);
+	}
+
+	list = hexchat_list_get (ph, name);
+	if (list == nullptr)
+	{
+		JS_SET_RVAL (context, vp, JSVAL_VOID);
+		return JS_TRUE;
+	}
+
+	if (binary)
+	{
+		out.append ("HJSL", 4);
+		hjs_util_packvalue (out, rows); // patched below
+		hjs_util_packvalue (out, (uint16_t)wanted.size());
+		for (const char* field : wanted)
+		{
+			out += field[0];
+			hjs_util_packvalue (out, (uint8_t)strlen (field + 1));
+			out += field + 1;
+		}
+	}
+	else
+		out += '[';
+
+	while (hexchat_list_next (ph, list))
+	{
+		if (!binary)
+			out += rows ? ",{" : "{";
+
+		for (size_t i = 0; i < wanted.size(); i++)
+		{
+			const char* field = wanted[i] + 1;
+			const char* str = nullptr;
+			string ptrstr;
+			long long num = 0;
+
+			switch (wanted[i][0])
+			{
+				case 's':
+					str = hexchat_list_str (ph, list, field);
+					if (str == nullptr)
+						str = "";
+					break;
+
+				case 'p':
+					ptrstr = to_string((unsigned long long)hexchat_list_str (ph, list, field));
+					str = ptrstr.c_str();
+					break;
+
+				case 'i':
+					num = hexchat_list_int (ph, list, field);
+					break;
+
+				case 't':
+					num = hexchat_list_time (ph, list, field);
+					break;
+			}
+
+			if (binary)
+			{
+				if (str != nullptr)
+				{
+					hjs_util_packvalue (out, (uint32)strlen (str));
+					out += str;
+				}
+				else if (wanted[i][0] == 'i')
+					hjs_util_packvalue (out, (int32)num);
+				else
+					hjs_util_packvalue (out, (int64_t)num);
+			}
+			else
+			{
+				if (i)
+					out += ',';
+				hjs_util_jsonescape (out, field);
+				out += ':';
+				if (str != nullptr)
+					hjs_util_jsonescape (out, str);
+				else
+					out += to_string(wanted[i][0] == 't' ? num * 1000 : num); // like Date.getTime()
+			}
+		}
+
+		if (!binary)
+			out += '}';
+		rows++;
+	}
+	hexchat_list_free (ph, list);
+
+	if (binary)
+	{
+		JSObject* buffer;
+
+		memcpy (&out[4], &rows, sizeof(rows));
+
+		buffer = js_CreateArrayBuffer (context, out.size());
+		if (buffer == nullptr)
+			return JS_FALSE;
+		memcpy (js::ArrayBuffer::fromJSObject (buffer)->data, out.data(), out.size());
+
+		JS_SET_RVAL (context, vp, OBJECT_TO_JSVAL(buffer));
+	}
+	else
+	{
+		out += ']';
+		JS_SET_RVAL (context, vp, STRING_TO_JSVAL(JS_NewStringCopyN (context, out.data(), out.size())));
+	}
+
+	return JS_TRUE;
+}
+
+static map<string, list_snapshot> interp_snapshots;
+
+static int
+hjs_closecontext_cb (char* word[], void *userdata)
+{
+	// the pointer may be reused by a new context which must not inherit this snapshot
+	string snapname = "users" + to_string((unsigned long long)hexchat_get_context (ph));
+
+	for (js_script* script : js_script_list)
+		script->snapshots.erase (snapname);
+	interp_snapshots.erase (snapname);
+
+	info_generation++;
+	return HEXCHAT_EAT_NONE;
+}
+
+static string
+hjs_list_rowkey (const char *name, const vector<string>& fields, const vector<list_value>& values)
+{
+	const char* keys[4] = { nullptr };
+	string key;
+
+	// fields that identify a row across polls, everything else is compared
+	if (strcmp (name, "channels") == 0)
+		keys[0] = "pcontext";
+	else if (strcmp (name, "dcc") == 0)
+	{
+		keys[0] = "itype"; keys[1] = "snick"; keys[2] = "sfile"; keys[3] = "iport";
+	}
+	else if (strcmp (name, "ignore") == 0)
+		keys[0] = "smask";
+	else if (strcmp (name, "notify") == 0)
+	{
+		keys[0] = "snick"; keys[1] = "snetworks";
+	}
+	else if (strcmp (name, "users") == 0)
+		keys[0] = "snick";
+
+	for (size_t i = 0; i < fields.size(); i++)
+	{
+		bool use = (keys[0] == nullptr);
+
+		for (int k = 0; k < 4 && keys[k]; k++)
+			if (fields[i] == keys[k])
+				use = true;
+
+		if (use)
+		{
+			key += values[i].type == 's' || values[i].type == 'p' ? values[i].str : to_string(values[i].num);
+			key += '\x1f';
+		}
+	}
+
+	return key;
+}
+
+static JSObject*
+hjs_list_buildentry (JSContext *context, const vector<string>& fields, const vector<list_value>& values)
+{
+	JSObject* list_obj = JS_NewObject (context, &list_entry_class, nullptr, nullptr);
+	jsval attr;
+
+	if (list_obj == nullptr)
+		return nullptr;
+
+	for (size_t i = 0; i < fields.size(); i++)
+	{
+		switch (values[i].type)
+		{
+			case 's':
+			case 'p':
+				attr = STRING_TO_JSVAL(hjs_util_newstring (context, values[i].str.c_str()));
+				break;
+
+			case 'i':
+				attr = INT_TO_JSVAL((int)values[i].num);
+				break;
+
+			case 't':
+				attr = hjs_util_datefromtime (context, (time_t)values[i].num);
+				break;
+
+			default:
+				continue;
+		}
+
+		if (!JS_DefineProperty (context, list_obj, fields[i].c_str() + 1, attr,
+								nullptr, nullptr, JSPROP_READONLY|JSPROP_ENUMERATE))
+			return nullptr;
+	}
+
+	return list_obj;
+}
+
+static bool
+hjs_list_pushentry (JSContext *context, JSObject *js_list, const vector<string>& fields,
+					const vector<list_value>& values)
+{
+	JSObject* list_obj = hjs_list_buildentry (context, fields, values);
+	jsuint len;
+
+	if (list_obj == nullptr || !JS_GetArrayLength (context, js_list, &len))
+		return false;
+
+	return JS_DefineElement (context, js_list, len, OBJECT_TO_JSVAL(list_obj), nullptr, nullptr,
+							JSPROP_READONLY|JSPROP_PERMANENT|JSPROP_ENUMERATE);
+}
+
+static JSBool
+hjs_getlistdelta (JSContext *context, unsigned argc, jsval *vp)
+{
+	JSString* list_name;
+	JSObject* ret;
+	JSObject* added;
+	JSObject* changed;
+	JSObject* removed;
+	const char* const *fields;
+	const char* name;
+	hexchat_list* list;
+	jsval val;
+	uint32 token = 0;
+	bool full;
+	string snapname;
+	unordered_map<string, vector<list_value>> rows;
+	js_script* script = hjs_script_find (context);
+
+	if (!JS_ConvertArguments (context, argc, JS_ARGV(context, vp), "S/u", &list_name, &token))
+		return JS_FALSE;
+
+	name = hjs_util_listname (context, list_name);
+	if (name == nullptr)
+	{
+		JS_SET_RVAL (context, vp, JSVAL_VOID);
+		return JS_TRUE;
+	}
+
+	// users are per channel so keep a snapshot per context
+	snapname = name;
+	if (strcmp (name, "users") == 0)
+		snapname += to_string((unsigned long long)hexchat_get_context (ph));
+
+	list_snapshot& snap = (script ? script->snapshots : interp_snapshots)[snapname];
+
+	list = hexchat_list_get (ph, name);
+	if (list == nullptr)
+	{
+		JS_SET_RVAL (context, vp, JSVAL_VOID);
+		return JS_TRUE;
+	}
+
+	fields = hexchat_list_fields (ph, name);
+	snap.fields.clear();
+	for (int i = 0; fields[i]; i++)
+		snap.fields.push_back (fields[i]);
+
+	while (hexchat_list_next (ph, list))
+	{
+		vector<list_value> values (snap.fields.size());
+
+		for (size_t i = 0; i < snap.fields.size(); i++)
+		{
+			const char* field = fields[i] + 1;
+			const char* str;
+
+			values[i].type = fields[i][0];
+			values[i].num = 0;
+			switch (fields[i][0])
+			{
+				case 's':
+					str = hexchat_list_str (ph, list, field);
+					values[i].str = str ? str : "";
+					break;
+
+				case 'i':
+					values[i].num = hexchat_list_int (ph, list, field);
+					break;
+
+				case 't':
+					values[i].num = hexchat_list_time (ph, list, field);
+					break;
+
+				case 'p':
+					if (!strcmp(field, "context"))
+						values[i].str = to_string((unsigned long long)hexchat_list_str (ph, list, field));
+					else
+						values[i].type = 0; // can't handle other pointers, see hjs_getlist
+					break;
+			}
+		}
+
+		rows[hjs_list_rowkey (name, snap.fields, values)] = values;
+	}
+	hexchat_list_free (ph, list);
+
+	added = JS_NewArrayObject (context, 0, nullptr);
+	changed = JS_NewArrayObject (context, 0, nullptr);
+	removed = JS_NewArrayObject (context, 0, nullptr);
+	ret = JS_NewObject (context, nullptr, nullptr, nullptr);
+	if (!added || !changed || !removed || !ret)
+		return JS_FALSE;
+
+	// an unknown token means the caller has nothing to diff against
+	full = (token == 0 || token != snap.token);
+
+	for (auto& row : rows)
+	{
+		auto old = snap.rows.find (row.first);
+
+		if (full || old == snap.rows.end())
+		{
+			if (!hjs_list_pushentry (context, added, snap.fields, row.second))
+				return JS_FALSE;
+		}
+		else
+		{
+			bool same = true;
+
+			for (size_t i = 0; same && i < row.second.size(); i++)
+				same = (row.second[i].str == old->second[i].str && row.second[i].num == old->second[i].num);
+
+			if (!same && !hjs_list_pushentry (context, changed, snap.fields, row.second))
+				return JS_FALSE;
+		}
+	}
+
+	if (!full)
+	{
+		for (auto& row : snap.rows)
+		{
+			if (rows.find (row.first) == rows.end()
+				&& !hjs_list_pushentry (context, removed, snap.fields, row.second))
+				return JS_FALSE;
+		}
+	}
+
+	snap.rows.swap (rows);
+	if (++snap.token == 0)
+		snap.token = 1;
+
+	if (!JS_NewNumberValue (context, snap.token, &val)
+		|| !JS_DefineProperty (context, ret, "token", val, nullptr, nullptr, JSPROP_READONLY|JSPROP_ENUMERATE)
+		|| !JS_DefineProperty (context, ret, "full", BOOLEAN_TO_JSVAL(full), nullptr, nullptr,
+								JSPROP_READONLY|JSPROP_ENUMERATE)
+		|| !JS_DefineProperty (context, ret, "added", OBJECT_TO_JSVAL(added), nullptr, nullptr,
+								JSPROP_READONLY|JSPROP_ENUMERATE)
+		|| !JS_DefineProperty (context, ret, "changed", OBJECT_TO_JSVAL(changed), nullptr, nullptr,
+								JSPROP_READONLY|JSPROP_ENUMERATE)
+		|| !JS_DefineProperty (context, ret, "removed", OBJECT_TO_JSVAL(removed), nullptr, nullptr,
+								JSPROP_READONLY|JSPROP_ENUMERATE))
+		return JS_FALSE;
+
+	JS_SET_RVAL (context, vp, OBJECT_TO_JSVAL(ret));
+
+	return JS_TRUE;
+}
+
+static JSBool
+hjs_findcontext (JSContext *context, unsigned argc, jsval *vp)
+{
+	JSString* network = nullptr;
+	JSString* channel = nullptr;
+	char* cnetwork = nullptr;
+	char* cchannel = nullptr;
+	jsval ret;
+	hexchat_context* ctx;
+
+	if (!JS_ConvertArguments (context, argc, JS_ARGV(context, vp), "/SS", &network, &channel))
+		return JS_FALSE;
+
+	if (network && JS_GetStringLength(network))
+		cnetwork = JSSTRING_TO_CHAR(network);
+	if (channel && JS_GetStringLength(channel))
+		cchannel = JSSTRING_TO_CHAR(channel);
+
+	ctx = hexchat_find_context (ph, cnetwork, cchannel);
+
+	if (cnetwork)
+		JS_free(context, cnetwork);
+	if (cchannel)
+		JS_free(context, cchannel);
+
+	if (!ctx)
+		JS_SET_RVAL (context, vp, JSVAL_NULL);
+	else
+	{
+		ret = hjs_util_pointer_to_jsval (context, ctx);
+		JS_SET_RVAL (context, vp, ret);
+	}
+
+	return JS_TRUE;
+}
+
+static JSBool
+hjs_getcontext (JSContext *context, unsigned argc, jsval *vp)
+{
+	hexchat_context* ctx;
+	string ctxstr;
+	jsval ret;
+
+	if (!JS_ConvertArguments (context, argc, JS_ARGV(context, vp), ""))
+		return JS_FALSE;
+
+	ctx = hexchat_get_context (ph);
+	ret = hjs_util_pointer_to_jsval (context, ctx);
+
+	JS_SET_RVAL(context, vp, ret);
+
+	return JS_TRUE;
+}
+
+static JSBool
+hjs_setcontext (JSContext *context, unsigned argc, jsval *vp)
+{
+	JSString *ctxstr;
+	hexchat_context* ctx;
+
+	if (!JS_ConvertArguments (context, argc, JS_ARGV(context, vp), "S", &ctxstr))
+		return JS_FALSE;
+
+	ctx = hjs_util_jsval_to_context (context, STRING_TO_JSVAL(ctxstr));
+
+	if (hexchat_set_context (ph, ctx))
+		JS_SET_RVAL (context, vp, JSVAL_TRUE);
+	else
+		JS_SET_RVAL (context, vp, JSVAL_FALSE);
+
+	return JS_TRUE;
+}
+
+static JSBool
+hjs_withcontext (JSContext *context, unsigned argc, jsval *vp)
+{
+	JSObject* funcobj;
+	JSObject* userdata = nullptr;
+	hexchat_context* ctx;
+	hexchat_context* oldctx;
+	jsval argv[1];
+	jsval rval = JSVAL_VOID;
+	JSBool ok;
+
+	if (!JS_ConvertArguments (context, argc, JS_ARGV(context, vp), "*o/o", &funcobj, &userdata))
+		return JS_FALSE;
+
+	if (!JS_ObjectIsFunction (context, funcobj))
+		return JS_FALSE;
+
+	ctx = hjs_util_jsval_to_context (context, JS_ARGV(context, vp)[0]);
+	oldctx = hexchat_get_context (ph);
+
+	if (!hexchat_set_context (ph, ctx))
+	{
+		JS_SET_RVAL (context, vp, JSVAL_FALSE);
+		return JS_TRUE;
+	}
+
+	argv[0] = OBJECT_TO_JSVAL(userdata);
+	ok = JS_CallFunctionValue (context, JS_GetGlobalForScopeChain (context), OBJECT_TO_JSVAL(funcobj),
+								1, argv, &rval);
+
+	// the old context may have been closed by the callback, nothing to do then
+	hexchat_set_context (ph, oldctx);
+
+	if (!ok)
+		return JS_FALSE;
+
+	JS_SET_RVAL (context, vp, rval);
+
+	return JS_TRUE;
+}
+
+static JSBool
+hjs_foreachcontext (JSContext *context, unsigned argc, jsval *vp)
+{
+	jsval filter;
+	JSObject* funcobj;
+	JSObject* userdata = nullptr;
+	string network, channel;
+	int type = 0;
+	vector<hexchat_context*> contexts;
+	hexchat_context* oldctx;
+	hexchat_list* list;
+	jsval argv[1];
+	jsval rval;
+	int count = 0;
+
+	if (!JS_ConvertArguments (context, argc, JS_ARGV(context, vp), "*o/o", &funcobj, &userdata))
+		return JS_FALSE;
+
+	if (!JS_ObjectIsFunction (context, funcobj))
+		return JS_FALSE;
+
+	// filter is an optional object of {network, channel, type}
+	filter = JS_ARGV(context, vp)[0];
+	if (!JSVAL_IS_PRIMITIVE(filter))
+	{
+		jsval typeval;
+
+		network = hjs_util_getstringprop (context, JSVAL_TO_OBJECT(filter), "network");
+		channel = hjs_util_getstringprop (context, JSVAL_TO_OBJECT(filter), "channel");
+		if (JS_GetProperty (context, JSVAL_TO_OBJECT(filter), "type", &typeval) && JSVAL_IS_INT(typeval))
+			type = JSVAL_TO_INT(typeval);
+	}
+
+	// collect first, the callback may open or close tabs
+	list = hexchat_list_get (ph, "channels");
+	if (list == nullptr)
+	{
+		JS_SET_RVAL (context, vp, INT_TO_JSVAL(0));
+		return JS_TRUE;
+	}
+
+	while (hexchat_list_next (ph, list))
+	{
+		const char* str;
+
+		if (type && hexchat_list_int (ph, list, "type") != type)
+			continue;
+
+		str = hexchat_list_str (ph, list, "network");
+		if (!network.empty() && (str == nullptr || hexchat_nickcmp (ph, str, network.c_str()) != 0))
+			continue;
+
+		str = hexchat_list_str (ph, list, "channel");
+		if (!channel.empty() && (str == nullptr || hexchat_nickcmp (ph, str, channel.c_str()) != 0))
+			continue;
+
+		contexts.push_back ((hexchat_context*)hexchat_list_str (ph, list, "context"));
+	}
+	hexchat_list_free (ph, list);
+
+	oldctx = hexchat_get_context (ph);
+	argv[0] = OBJECT_TO_JSVAL(userdata);
+
+	for (hexchat_context* ctx : contexts)
+	{
+		if (!hexchat_set_context (ph, ctx))
+			continue;
+
+		rval = JSVAL_VOID;
+		if (!JS_CallFunctionValue (context, JS_GetGlobalForScopeChain (context), OBJECT_TO_JSVAL(funcobj),
+									1, argv, &rval))
+		{
+			hexchat_set_context (ph, oldctx);
+			return JS_FALSE;
+		}
+
+		count++;
+
+		// returning false stops the iteration early
+		if (JSVAL_IS_BOOLEAN(rval) && !JSVAL_TO_BOOLEAN(rval))
+			break;
+	}
+
+	hexchat_set_context (ph, oldctx);
+
+	JS_SET_RVAL (context, vp, INT_TO_JSVAL(count));
+
+	return JS_TRUE;
+}
+
+static JSBool
+hjs_hookcmd (JSContext *context, unsigned argc, jsval *vp)
+{
+	JSString* cmdstr;
+	JSString* helpstr = nullptr;
+	JSObject* funcobj;
+	JSObject* userdata = nullptr;
+	jsval ret;
+	char* chelpstr = nullptr;
+	char* ccmdstr;
+	int pri = HEXCHAT_PRI_NORM;
+	hexchat_hook* hexhook;
+	script_hook* hook;
+	js_script* script = hjs_script_find (context);
+
+	// these are slightly out of normal order, does jsapi have kwargs?
+	if (!JS_ConvertArguments (context, argc, JS_ARGV(context, vp), "So/Soi",
+							&cmdstr, &funcobj, &helpstr, &userdata, &pri))
+		return JS_FALSE;
+
+	if (!JS_ObjectIsFunction (context, funcobj))
+		return JS_FALSE;
+
+	ccmdstr = JSSTRING_TO_CHAR(cmdstr);
+	if (helpstr)
+		chelpstr = JSSTRING_TO_CHAR(helpstr);
+
+	hook = new script_hook;
+	hexhook = hexchat_hook_command (ph, ccmdstr, pri, hjs_callback, helpstr ? chelpstr : "", hook);
+
+	JS_free(context, ccmdstr);
+	if (chelpstr)
+		JS_free(context, chelpstr);
+
+	script->add_hook (hook, HOOK_CMD, context, funcobj, userdata, hexhook);
+
+	if (!JS_NewNumberValue(context, (long)hexhook, &ret))
+		JS_SET_RVAL (context, vp, JSVAL_VOID);
+	else
+		JS_SET_RVAL (context, vp, ret);
+
+	return JS_TRUE;
+}
+
+static JSBool
+hjs_hookprint (JSContext *context, unsigned argc, jsval *vp)
+{
+	JSString* event;
+	JSObject* funcobj;
+	JSObject* userdata = nullptr;
+	jsval ret;
+	char* cevent;
+	int pri = HEXCHAT_PRI_NORM;
+	hexchat_hook* hexhook;
+	script_hook* hook;
+	js_script* script = hjs_script_find (context);
+
+	if (!JS_ConvertArguments (context, argc, JS_ARGV(context, vp), "So/oi",
+							&event, &funcobj, &userdata, &pri))
+		return JS_FALSE;
+
+	if (!JS_ObjectIsFunction (context, funcobj))
+		return JS_FALSE;
+
+	cevent = JSSTRING_TO_CHAR(event);
+	hook = new script_hook;
+	hexhook = hexchat_hook_print_attrs (ph, cevent, pri, hjs_callback, hook);
+	JS_free(context, cevent);
+
+	script->add_hook (hook, HOOK_PRINT, context, funcobj, userdata, hexhook);
+
+	if (!JS_NewNumberValue(context, (long)hexhook, &ret))
+		JS_SET_RVAL (context, vp, JSVAL_VOID);
+	else
+		JS_SET_RVAL (context, vp, ret);
+
+	return JS_TRUE;
+}
+
+static JSBool
+hjs_hookspecial (JSContext *context, unsigned argc, jsval *vp)
+{
+	JSString* event;
+	JSObject* funcobj;
+	JSObject* userdata = nullptr;
+	jsval ret;
+	char* cevent;
+	int pri = HEXCHAT_PRI_NORM;
+	hexchat_hook* hexhook;
+	script_hook* hook;
+	js_script* script = hjs_script_find (context);
+
+	if (!JS_ConvertArguments (context, argc, JS_ARGV(context, vp), "So/oi",
+							&event, &funcobj, &userdata, &pri))
+		return JS_FALSE;
+
+	if (!JS_ObjectIsFunction (context, funcobj))
+		return JS_FALSE;
+
+	/* This is technically the same as hook_print except that hook_print_attrs won't work with
+	 * the "special" hooks, so to avoid confusion or adding another hook_print for attrs
+	 * just create a new function hook_special */
+	hook = new script_hook;
+	cevent = JSSTRING_TO_CHAR(event);
+	hexhook = hexchat_hook_print (ph, cevent, pri, hjs_callback, hook);
+	JS_free(context, cevent);
+
+	script->add_hook (hook, HOOK_PRINT, context, funcobj, userdata, hexhook);
+
+	if (!JS_NewNumberValue(context, (long)hexhook, &ret))
+		JS_SET_RVAL (context, vp, JSVAL_VOID);
+	else
+		JS_SET_RVAL (context, vp, ret);
+
+	return JS_TRUE;
+}
+
+static JSBool
+hjs_hookserver (JSContext *context, unsigned argc, jsval *vp)
+{
+	JSString* serverstr;
+	JSObject* funcobj;
+	JSObject* userdata = nullptr;
+	jsval ret;
+	char* cserverstr;
+	int pri = HEXCHAT_PRI_NORM;
+	hexchat_hook* hexhook;
+	script_hook* hook;
+	js_script* script = hjs_script_find (context);
+
+	if (!JS_ConvertArguments (context, argc, JS_ARGV(context, vp), "So/oi",
+							&serverstr, &funcobj, &userdata, &pri))
+		return JS_FALSE;
+
+	if (!JS_ObjectIsFunction (context, funcobj))
+		return JS_FALSE;
+
+	hook = new script_hook;
+	cserverstr = JSSTRING_TO_CHAR(serverstr);
+	hexhook = hexchat_hook_server_attrs (ph, cserverstr, pri, hjs_callback, hook);
+	JS_free(context, cserverstr);
+
+	script->add_hook (hook, HOOK_SERVER, context, funcobj, userdata, hexhook);
+
+	if (!JS_NewNumberValue(context, (long)hexhook, &ret))
+		JS_SET_RVAL (context, vp, JSVAL_VOID);
+	else
+		JS_SET_RVAL (context, vp, ret);
+
+	return JS_TRUE;
+}
+
+static JSBool
+hjs_hooktimer (JSContext *context, unsigned argc, jsval *vp)
+{
+	JSObject* funcobj;
+	JSObject* userdata = nullptr;
+	jsval ret;
+	int timeout;
+	hexchat_hook* hexhook;
+	script_hook* hook;
+	js_script* script = hjs_script_find (context);
+
+	if (!JS_ConvertArguments (context, argc, JS_ARGV(context, vp), "io/o",
+							&timeout, &funcobj, &userdata))
+		return JS_FALSE;
+
+	if (!JS_ObjectIsFunction (context, funcobj))
+		return JS_FALSE;
+
+	hook = new script_hook;
+	hexhook = hexchat_hook_timer (ph, timeout, hjs_callback, hook);
+
+	script->add_hook (hook, HOOK_TIMER, context, funcobj, userdata, hexhook);
+
+	if (!JS_NewNumberValue(context, (long)hexhook, &ret))
+		JS_SET_RVAL (context, vp, JSVAL_VOID);
+	else
+		JS_SET_RVAL (context, vp, ret);
+
+	return JS_TRUE;
+}
+
+static JSBool
+hjs_hookshared (JSContext *context, unsigned argc, jsval *vp)
+{
+	JSObject* funcobj;
+	JSObject* userdata = nullptr;
+	JSString* prefix;
+	jsval ret;
+	char* cprefix;
+	script_hook* hook;
+	js_script* script = hjs_script_find (context);
+
+	if (!JS_ConvertArguments (context, argc, JS_ARGV(context, vp), "So/o", &prefix, &funcobj, &userdata))
+		return JS_FALSE;
+
+	if (script == nullptr || !JS_ObjectIsFunction (context, funcobj))
+		return JS_FALSE;
+
+	hook = new script_hook;
+	script->add_hook (hook, HOOK_SHARED, context, funcobj, userdata, nullptr);
+
+	cprefix = JSSTRING_TO_CHAR(prefix);
+	shared_watchers.push_back ({cprefix, hook});
+	JS_free(context, cprefix);
+
+	// there is no hexchat hook, unhook knows these by the script_hook itself
+	if (!JS_NewNumberValue(context, (long)hook, &ret))
+		JS_SET_RVAL (context, vp, JSVAL_VOID);
+	else
+		JS_SET_RVAL (context, vp, ret);
+
+	return JS_TRUE;
+}
+
+static JSBool
+hjs_hookunload (JSContext *context, unsigned argc, jsval *vp)
+{
+	JSObject* funcobj;
+	JSObject* userdata = nullptr;
+	script_hook* hook;
+	js_script* script = hjs_script_find (context);
+
+	if (!JS_ConvertArguments (context, argc, JS_ARGV(context, vp), "o/o", &funcobj, &userdata))
+		return JS_FALSE;
+
+	hook = new script_hook;
+	script->add_hook (hook, HOOK_UNLOAD, context, funcobj, userdata, nullptr);
+
+	JS_SET_RVAL (context, vp, JSVAL_VOID);
+
+	return JS_TRUE;
+}
+
+static JSBool
+hjs_getreloadstate (JSContext *context, unsigned argc, jsval *vp)
+{
+	js_script* script = hjs_script_find (context);
+	jsval state = JSVAL_NULL;
+	JSBool ok;
+
+	if (!JS_ConvertArguments (context, argc, JS_ARGV(context, vp), ""))
+		return JS_FALSE;
+
+	auto found = script != nullptr ? reload_states.find (script->filename) : reload_states.end();
+	if (found != reload_states.end())
+	{
+		// handed out once, a second call or the next load starts fresh
+		ok = JS_ReadStructuredClone (context, found->second.data(), found->second.size() * sizeof(uint64),
+									&state, nullptr, nullptr);
+		reload_states.erase (found);
+
+		if (!ok)
+			return JS_FALSE;
+	}
+
+	JS_SET_RVAL (context, vp, state);
+
+	return JS_TRUE;
+}
+
+static JSBool
+hjs_unhook (JSContext *context, unsigned argc, jsval *vp)
+{
+	long hooknum;
+	js_script* script;
+	script_hook* hook;
+	hexchat_hook* hexhook;
+
+	if (!JS_ConvertArguments (context, argc, JS_ARGV(context, vp), "u", &hooknum))
+		return JS_FALSE;
+
+	hexhook = (hexchat_hook*)hooknum;
+	script = hjs_script_find (context);
+
+	for (script_hook* shared : script->hooks)
+	{
+		if (shared->type == HOOK_SHARED && (hexchat_hook*)shared == hexhook)
+		{
+			hjs_shared_unwatch (shared);
+			script->remove_hook (shared);
+
+			JS_SET_RVAL (context, vp, JSVAL_VOID);
+			return JS_TRUE;
+		}
+	}
+
+	// unhook returns your original userdata
+	hook =  (script_hook*)hexchat_unhook (ph, hexhook);
+	script->remove_hook (hook);
+
+
+	JS_SET_RVAL (context, vp, JSVAL_VOID);
+
+	return JS_TRUE;
+}
+
+static JSBool
+hjs_setpluginpref (JSContext *context, unsigned argc, jsval *vp)
+{
+	pref_store* prefs;
+	JSString* var;
+	JSString* val;
+	char* cvar;
+	char* cval;
+
+	if (!JS_ConvertArguments (context, argc, JS_ARGV(context, vp), "SS", &var, &val))
+		return JS_FALSE;
+
+	prefs = hjs_prefs_find (context);
+	cvar = JSSTRING_TO_CHAR(var);
+	cval = JSSTRING_TO_CHAR(val);
+
+	// it is always stored as a string anyway.
+	hjs_prefs_set (prefs, cvar, cval);
+	hjs_store_schedule ();
+
+	JS_free(context, cvar);
+	JS_free(context, cval);
+
+	JS_SET_RVAL (context, vp, JSVAL_TRUE);
+
+	return JS_TRUE;
+}
+
+static JSBool
+hjs_delpluginpref (JSContext *context, unsigned argc, jsval *vp)
+{
+	pref_store* prefs;
+	JSString* var;
+	char* cvar;
+	bool ret;
+
+	if (!JS_ConvertArguments (context, argc, JS_ARGV(context, vp), "S", &var))
+		return JS_FALSE;
+
+	prefs = hjs_prefs_find (context);
+	cvar = JSSTRING_TO_CHAR(var);
+
+	ret = hjs_prefs_delete (prefs, cvar);
+	if (ret)
+		hjs_store_schedule ();
+
+	JS_free(context, cvar);
+
+	JS_SET_RVAL (context, vp, BOOLEAN_TO_JSVAL(ret));
+
+	return JS_TRUE;
+}
+
+static JSBool
+hjs_listpluginpref (JSContext *context, unsigned argc, jsval *vp)
+{
+	pref_store* prefs;
+	JSObject* js_list;
+	JSString* list_item;
+	int index = 0;
+
+	if (!JS_ConvertArguments (context, argc, JS_ARGV(context, vp), ""))
+		return JS_FALSE;
+
+	prefs = hjs_prefs_find (context);
+	set<string> keys = hjs_prefs_keys (prefs);
+	if (keys.empty())
+	{
+		JS_SET_RVAL (context, vp, JSVAL_NULL);
+		return JS_TRUE;
+	}
+
+	js_list = JS_NewArrayObject (context, 0, nullptr);
+	if (js_list == nullptr)
+	{
+		JS_SET_RVAL (context, vp, JSVAL_VOID);
+		return JS_FALSE;
+	}
+
+	JS_SET_RVAL (context, vp, OBJECT_TO_JSVAL(js_list));
+
+	for (const string& key : keys)
+	{
+		list_item = JS_NewStringCopyN (context, key.data(), key.length());
+		JS_DefineElement (context, js_list, index, STRING_TO_JSVAL(list_item), nullptr, nullptr,
+						JSPROP_READONLY|JSPROP_PERMANENT|JSPROP_ENUMERATE);
+		index++;
+	}
+
+	return JS_TRUE;
+}
+
+static JSBool
+hjs_getpluginpref (JSContext *context, unsigned argc, jsval *vp)
+{
+	pref_store* prefs;
+	JSString* var;
+	char* cvar;
+	const char* value;
+	size_t len;
+
+	if (!JS_ConvertArguments (context, argc, JS_ARGV(context, vp), "S", &var))
+		return JS_FALSE;
+
+	prefs = hjs_prefs_find (context);
+	cvar = JSSTRING_TO_CHAR(var);
+
+	if (hjs_prefs_lookup (prefs, cvar, &value, &len))
+		JS_SET_RVAL (context, vp, hjs_prefs_tojsval (context, value, len));
+	else
+		JS_SET_RVAL (context, vp, JSVAL_VOID);
+	JS_free(context, cvar);
+
+	return JS_TRUE;
+}
+
+static JSBool
+hjs_setpluginprefs (JSContext *context, unsigned argc, jsval *vp)
+{
+	pref_store* prefs;
+	JSObject* obj;
+	JSIdArray* ids;
+	JSString* str;
+	char* cvar;
+	char* cval;
+
+	if (!JS_ConvertArguments (context, argc, JS_ARGV(context, vp), "o", &obj))
+		return JS_FALSE;
+
+	if (obj == nullptr || (ids = JS_Enumerate (context, obj)) == nullptr)
+		return JS_FALSE;
+
+	prefs = hjs_prefs_find (context);
+
+	for (jsint i = 0; i < ids->length; i++)
+	{
+		jsval idval, val;
+
+		if (!JS_IdToValue (context, ids->vector[i], &idval)
+			|| !JS_GetPropertyById (context, obj, ids->vector[i], &val)
+			|| (str = JS_ValueToString (context, idval)) == nullptr)
+		{
+			JS_DestroyIdArray (context, ids);
+			return JS_FALSE;
+		}
+
+		cvar = JSSTRING_TO_CHAR(str);
+
+		// null or undefined deletes the key
+		if (JSVAL_IS_NULL(val) || JSVAL_IS_VOID(val))
+			hjs_prefs_delete (prefs, cvar);
+		else
+		{
+			if ((str = JS_ValueToString (context, val)) == nullptr)
+			{
+				JS_free(context, cvar);
+				JS_DestroyIdArray (context, ids);
+				return JS_FALSE;
+			}
+
+			cval = JSSTRING_TO_CHAR(str);
+			hjs_prefs_set (prefs, cvar, cval);
+			JS_free(context, cval);
+		}
+
+		JS_free(context, cvar);
+	}
+	JS_DestroyIdArray (context, ids);
+
+	// one rewrite for all of them, unless a transaction is still open
+	JS_SET_RVAL (context, vp, BOOLEAN_TO_JSVAL(hjs_prefs_flush (prefs)));
+
+	return JS_TRUE;
+}
+
+static JSBool
+hjs_getpluginprefs (JSContext *context, unsigned argc, jsval *vp)
+{
+	pref_store* prefs;
+	JSObject* keys = nullptr;
+	JSObject* ret;
+	jsuint len;
+
+	if (!JS_ConvertArguments (context, argc, JS_ARGV(context, vp), "/o", &keys))
+		return JS_FALSE;
+
+	prefs = hjs_prefs_find (context);
+
+	ret = JS_NewObject (context, nullptr, nullptr, nullptr);
+	if (ret == nullptr)
+		return JS_FALSE;
+
+	JS_SET_RVAL (context, vp, OBJECT_TO_JSVAL(ret));
+
+	if (keys == nullptr)
+	{
+		for (const string& key : hjs_prefs_keys (prefs))
+		{
+			const char* value;
+			size_t len;
+
+			if (hjs_prefs_lookup (prefs, key, &value, &len)
+				&& !JS_DefineProperty (context, ret, key.c_str(), hjs_prefs_tojsval (context, value, len),
+										nullptr, nullptr, JSPROP_ENUMERATE))
+				return JS_FALSE;
+		}
+
+		return JS_TRUE;
+	}
+
+	if (!JS_GetArrayLength (context, keys, &len))
+		return JS_FALSE;
+
+	for (jsuint i = 0; i < len; i++)
+	{
+		JSString* str;
+		jsval val;
+		char* cvar;
+		const char* value;
+		size_t len;
+
+		if (!JS_GetElement (context, keys, i, &val) || (str = JS_ValueToString (context, val)) == nullptr)
+			return JS_FALSE;
+
+		cvar = JSSTRING_TO_CHAR(str);
+
+		// missing keys are simply left out
+		if (hjs_prefs_lookup (prefs, cvar, &value, &len)
+			&& !JS_DefineProperty (context, ret, cvar, hjs_prefs_tojsval (context, value, len),
+									nullptr, nullptr, JSPROP_ENUMERATE))
+		{
+			JS_free(context, cvar);
+			return JS_FALSE;
+		}
+		JS_free(context, cvar);
+	}
+
+	return JS_TRUE;
+}
+
+static JSBool
+hjs_pluginpreftransaction (JSContext *context, unsigned argc, jsval *vp)
+{
+	pref_store* prefs;
+	JSObject* funcobj;
+	JSObject* userdata = nullptr;
+	jsval argv[1];
+	jsval rval = JSVAL_VOID;
+	JSBool ok;
+
+	if (!JS_ConvertArguments (context, argc, JS_ARGV(context, vp), "o/o", &funcobj, &userdata))
+		return JS_FALSE;
+
+	if (funcobj == nullptr || !JS_ObjectIsFunction (context, funcobj))
+		return JS_FALSE;
+
+	prefs = hjs_prefs_find (context);
+	map<string, string> values = prefs->values;
+	map<string, string> pending = prefs->pending;
+	set<string> dirty = prefs->dirty;
+
+	argv[0] = OBJECT_TO_JSVAL(userdata);
+	prefs->transactions++;
+	ok = JS_CallFunctionValue (context, JS_GetGlobalForScopeChain (context), OBJECT_TO_JSVAL(funcobj),
+								1, argv, &rval);
+	prefs->transactions--;
+
+	// throwing or returning false undoes every change made inside
+	if (!ok || (JSVAL_IS_BOOLEAN(rval) && !JSVAL_TO_BOOLEAN(rval)))
+	{
+		prefs->values.swap (values);
+		prefs->pending.swap (pending);
+		prefs->dirty.swap (dirty);
+
+		if (!ok)
+			return JS_FALSE;
+
+		JS_SET_RVAL (context, vp, JSVAL_FALSE);
+		return JS_TRUE;
+	}
+
+	JS_SET_RVAL (context, vp, BOOLEAN_TO_JSVAL(hjs_prefs_flush (prefs)));
+
+	return JS_TRUE;
+}
+
+static JSBool
+hjs_setkv (JSContext *context, unsigned argc, jsval *vp)
+{
+	kv_store* kv;
+	JSString* key;
+	JSString* val;
+	char* ckey;
+	char* cval;
+	bool ret;
+
+	if (!JS_ConvertArguments (context, argc, JS_ARGV(context, vp), "SS", &key, &val))
+		return JS_FALSE;
+
+	kv = hjs_kv_find (context);
+	ckey = JSSTRING_TO_CHAR(key);
+	cval = JSSTRING_TO_CHAR(val);
+
+	ret = kv->records.put (ckey, cval, strlen (cval));
+	hjs_store_schedule ();
+
+	JS_free(context, ckey);
+	JS_free(context, cval);
+
+	JS_SET_RVAL (context, vp, BOOLEAN_TO_JSVAL(ret));
+
+	return JS_TRUE;
+}
+
+static JSBool
+hjs_getkv (JSContext *context, unsigned argc, jsval *vp)
+{
+	kv_store* kv;
+	JSString* key;
+	char* ckey;
+	const char* value;
+	size_t len;
+
+	if (!JS_ConvertArguments (context, argc, JS_ARGV(context, vp), "S", &key))
+		return JS_FALSE;
+
+	kv = hjs_kv_find (context);
+	ckey = JSSTRING_TO_CHAR(key);
+
+	if (kv->records.get (ckey, &value, &len))
+	{
+		// values are plain strings, unlike pluginprefs nothing is turned back into a number
+		JSString* str = JS_NewStringCopyN (context, value, len);
+		if (str == nullptr)
+		{
+			JS_free(context, ckey);
+			return JS_FALSE;
+		}
+		JS_SET_RVAL (context, vp, STRING_TO_JSVAL(str));
+	}
+	else
+		JS_SET_RVAL (context, vp, JSVAL_VOID);
+	JS_free(context, ckey);
+
+	return JS_TRUE;
+}
+
+static JSBool
+hjs_delkv (JSContext *context, unsigned argc, jsval *vp)
+{
+	kv_store* kv;
+	JSString* key;
+	char* ckey;
+	bool ret;
+
+	if (!JS_ConvertArguments (context, argc, JS_ARGV(context, vp), "S", &key))
+		return JS_FALSE;
+
+	kv = hjs_kv_find (context);
+	ckey = JSSTRING_TO_CHAR(key);
+
+	ret = kv->records.remove (ckey);
+	if (ret)
+		hjs_store_schedule ();
+
+	JS_free(context, ckey);
+
+	JS_SET_RVAL (context, vp, BOOLEAN_TO_JSVAL(ret));
+
+	return JS_TRUE;
+}
+
+static JSBool
+hjs_listkv (JSContext *context, unsigned argc, jsval *vp)
+{
+	kv_store* kv;
+	JSString* prefix = nullptr;
+	JSObject* js_list;
+	string cprefix;
+	char* cstr;
+	int index = 0;
+
+	if (!JS_ConvertArguments (context, argc, JS_ARGV(context, vp), "/S", &prefix))
+		return JS_FALSE;
+
+	kv = hjs_kv_find (context);
+
+	if (prefix != nullptr)
+	{
+		cstr = JSSTRING_TO_CHAR(prefix);
+		cprefix = cstr;
+		JS_free(context, cstr);
+	}
+
+	js_list = JS_NewArrayObject (context, 0, nullptr);
+	if (js_list == nullptr)
+		return JS_FALSE;
+
+	JS_SET_RVAL (context, vp, OBJECT_TO_JSVAL(js_list));
+
+	// keys are kept sorted, everything with the prefix is one contiguous run
+	const auto& keys = kv->records.keys();
+	for (auto it = keys.lower_bound (cprefix); it != keys.end() && it->first.compare (0, cprefix.length(), cprefix) == 0; ++it)
+	{
+		JSString* str = JS_NewStringCopyN (context, it->first.data(), it->first.length());
+
+		if (str == nullptr || !JS_DefineElement (context, js_list, index++, STRING_TO_JSVAL(str), nullptr, nullptr, JSPROP_ENUMERATE))
+			return JS_FALSE;
+	}
+
+	return JS_TRUE;
+}
+
+static JSBool
+hjs_rangekv (JSContext *context, unsigned argc, jsval *vp)
+{
+	kv_store* kv;
+	JSString* from;
+	JSString* to = nullptr;
+	JSObject* js_list;
+	int32 limit = -1;
+	string cfrom, cto;
+	char* cstr;
+	int index = 0;
+
+	if (!JS_ConvertArguments (context, argc, JS_ARGV(context, vp), "S/Si", &from, &to, &limit))
+		return JS_FALSE;
+
+	kv = hjs_kv_find (context);
+
+	cstr = JSSTRING_TO_CHAR(from);
+	cfrom = cstr;
+	JS_free(context, cstr);
+
+	if (to != nullptr)
+	{
+		cstr = JSSTRING_TO_CHAR(to);
+		cto = cstr;
+		JS_free(context, cstr);
+	}
+
+	js_list = JS_NewArrayObject (context, 0, nullptr);
+	if (js_list == nullptr)
+		return JS_FALSE;
+
+	JS_SET_RVAL (context, vp, OBJECT_TO_JSVAL(js_list));
+
+	// [from, to) in key order, an empty or missing end runs to the last key
+	const auto& keys = kv->records.keys();
+	for (auto it = keys.lower_bound (cfrom); it != keys.end() && index != limit; ++it)
+	{
+		JSObject* pair;
+		JSString* str;
+		const char* value;
+		size_t len;
+		jsval elems[2];
+
+		if (!cto.empty() && it->first >= cto)
+			break;
+
+		if (!kv->records.get (it->first, &value, &len))
+			continue;
+
+		str = JS_NewStringCopyN (context, it->first.data(), it->first.length());
+		if (str == nullptr)
+			return JS_FALSE;
+		elems[0] = STRING_TO_JSVAL(str);
+
+		str = JS_NewStringCopyN (context, value, len);
+		if (str == nullptr)
+			return JS_FALSE;
+		elems[1] = STRING_TO_JSVAL(str);
+
+		pair = JS_NewArrayObject (context, 2, elems);
+		if (pair == nullptr || !JS_DefineElement (context, js_list, index++, OBJECT_TO_JSVAL(pair), nullptr, nullptr, JSPROP_ENUMERATE))
+			return JS_FALSE;
+	}
+
+	return JS_TRUE;
+}
+
+static JSBool
+hjs_sharedset (JSContext *context, unsigned argc, jsval *vp)
+{
+	jsval* argv = JS_ARGV(context, vp);
+	JSString* key;
+	shared_value value;
+	const jschar* chars;
+	size_t len;
+	char* ckey;
+
+	if (!JS_ConvertArguments (context, argc, argv, "S*", &key))
+		return JS_FALSE;
+
+	ckey = JSSTRING_TO_CHAR(key);
+	string skey (ckey);
+	JS_free(context, ckey);
+
+	if (JSVAL_IS_NULL(argv[1]) || JSVAL_IS_VOID(argv[1]))
+	{
+		// null or undefined deletes the key
+		if (shared_store.erase (skey))
+			hjs_shared_notify (skey);
+
+		JS_SET_RVAL (context, vp, JSVAL_TRUE);
+		return JS_TRUE;
+	}
+
+	if (JSVAL_IS_BOOLEAN(argv[1]))
+	{
+		value.type = 'b';
+		value.num = JSVAL_TO_BOOLEAN(argv[1]);
+	}
+	else if (JSVAL_IS_NUMBER(argv[1]))
+	{
+		value.type = 'n';
+		if (!JS_ValueToNumber (context, argv[1], &value.num))
+			return JS_FALSE;
+	}
+	else if (JSVAL_IS_STRING(argv[1]))
+	{
+		value.type = 's';
+		value.num = 0;
+		if ((chars = JS_GetStringCharsAndLength (context, JSVAL_TO_STRING(argv[1]), &len)) == nullptr)
+			return JS_FALSE;
+		value.str.assign (chars, len);
+	}
+	else
+	{
+		// objects would have to be copied into every reader's heap, store them serialized instead
+		JS_SET_RVAL (context, vp, JSVAL_FALSE);
+		return JS_TRUE;
+	}
+
+	shared_store[skey] = value;
+	hjs_shared_notify (skey);
+
+	JS_SET_RVAL (context, vp, JSVAL_TRUE);
+
+	return JS_TRUE;
+}
+
+static JSBool
+hjs_sharedget (JSContext *context, unsigned argc, jsval *vp)
+{
+	JSString* key;
+	char* ckey;
+
+	if (!JS_ConvertArguments (context, argc, JS_ARGV(context, vp), "S", &key))
+		return JS_FALSE;
+
+	ckey = JSSTRING_TO_CHAR(key);
+	JS_SET_RVAL (context, vp, hjs_shared_tojsval (context, ckey));
+	JS_free(context, ckey);
+
+	return JS_TRUE;
+}
+
+static JSBool
+hjs_sharedkeys (JSContext *context, unsigned argc, jsval *vp)
+{
+	JSString* prefix = nullptr;
+	JSObject* js_list;
+	string cprefix;
+	char* cstr;
+	int index = 0;
+
+	if (!JS_ConvertArguments (context, argc, JS_ARGV(context, vp), "/S", &prefix))
+		return JS_FALSE;
+
+	if (prefix != nullptr)
+	{
+		cstr = JSSTRING_TO_CHAR(prefix);
+		cprefix = cstr;
+		JS_free(context, cstr);
+	}
+
+	js_list = JS_NewArrayObject (context, 0, nullptr);
+	if (js_list == nullptr)
+		return JS_FALSE;
+
+	JS_SET_RVAL (context, vp, OBJECT_TO_JSVAL(js_list));
+
+	for (auto it = shared_store.lower_bound (cprefix);
+		it != shared_store.end() && it->first.compare (0, cprefix.length(), cprefix) == 0; ++it)
+	{
+		JSString* str = JS_NewStringCopyN (context, it->first.data(), it->first.length());
+
+		if (str == nullptr || !JS_DefineElement (context, js_list, index++, STRING_TO_JSVAL(str), nullptr, nullptr, JSPROP_ENUMERATE))
+			return JS_FALSE;
+	}
+
+	return JS_TRUE;
+}
+
+static JSBool
+hjs_journalappend (JSContext *context, unsigned argc, jsval *vp)
+{
+	jsval* argv = JS_ARGV(context, vp);
+	JSString* journal;
+	JSString* str;
+	journal_entry entry;
+	char* cstr;
+
+	if (!JS_ConvertArguments (context, argc, argv, "S*", &journal))
+		return JS_FALSE;
+
+	// objects and strings are written as one line of JSON, so a newline in a string can't split a record
+	if (JSVAL_IS_STRING(argv[1])
+		|| (!JSVAL_IS_PRIMITIVE(argv[1]) && !JS_ObjectIsFunction (context, JSVAL_TO_OBJECT(argv[1]))))
+	{
+		basic_string<jschar> json;
+
+		if (!JS_Stringify (context, &argv[1], nullptr, JSVAL_NULL, hjs_util_stringifycb, &json))
+			return JS_FALSE;
+		str = JS_NewUCStringCopyN (context, json.data(), json.length());
+	}
+	else
+		str = JS_ValueToString (context, argv[1]);
+
+	if (str == nullptr)
+		return JS_FALSE;
+
+	cstr = JSSTRING_TO_CHAR(str);
+	entry.record = cstr;
+	JS_free(context, cstr);
+
+	cstr = JSSTRING_TO_CHAR(journal);
+	entry.path = hjs_journal_path (context, cstr);
+	JS_free(context, cstr);
+
+	entry.policy = journal_policies[entry.path];
+
+	{
+		lock_guard<mutex> lock (journal_mutex);
+		journal_queue.push_back (entry);
+	}
+
+	if (!journal_thread.joinable())
+		journal_thread = thread (hjs_journal_writer);
+	journal_wake.notify_one ();
+
+	JS_SET_RVAL (context, vp, JSVAL_TRUE);
+
+	return JS_TRUE;
+}
+
+static JSBool
+hjs_journalconfig (JSContext *context, unsigned argc, jsval *vp)
+{
+	JSString* journal;
+	JSObject* options;
+	char* cstr;
+	jsval val;
+	string path;
+
+	if (!JS_ConvertArguments (context, argc, JS_ARGV(context, vp), "So", &journal, &options))
+		return JS_FALSE;
+
+	if (options == nullptr)
+		return JS_FALSE;
+
+	cstr = JSSTRING_TO_CHAR(journal);
+	path = hjs_journal_path (context, cstr);
+	JS_free(context, cstr);
+
+	journal_policy& policy = journal_policies[path];
+
+	if (JS_GetProperty (context, options, "sync", &val) && JSVAL_IS_STRING(val))
+	{
+		cstr = JSSTRING_TO_CHAR(JSVAL_TO_STRING(val));
+		if (strcmp (cstr, "never") == 0)
+			policy.sync = JOURNAL_SYNC_NEVER;
+		else if (strcmp (cstr, "second") == 0)
+			policy.sync = JOURNAL_SYNC_SECOND;
+		else
+			policy.sync = JOURNAL_SYNC_BATCH;
+		JS_free(context, cstr);
+	}
+
+	if (JS_GetProperty (context, options, "max_size", &val) && JSVAL_IS_NUMBER(val))
+	{
+		double size;
+
+		if (JS_ValueToNumber (context, val, &size) && size >= 1)
+			policy.max_size = (uint64_t)size;
+	}
+
+	if (JS_GetProperty (context, options, "keep", &val) && JSVAL_IS_INT(val) && JSVAL_TO_INT(val) >= 0)
+		policy.keep = JSVAL_TO_INT(val);
+
+	JS_SET_RVAL (context, vp, JSVAL_TRUE);
+
+	return JS_TRUE;
+}
+
+static JSBool
+hjs_journalstats (JSContext *context, unsigned argc, jsval *vp)
+{
+	JSObject* ret;
+	jsval val;
+	size_t pending;
+
+	if (!JS_ConvertArguments (context, argc, JS_ARGV(context, vp), ""))
+		return JS_FALSE;
+
+	{
+		lock_guard<mutex> lock (journal_mutex);
+		pending = journal_queue.size();
+	}
+
+	ret = JS_NewObject (context, nullptr, nullptr, nullptr);
+	if (ret == nullptr)
+		return JS_FALSE;
+
+	JS_SET_RVAL (context, vp, OBJECT_TO_JSVAL(ret));
+
+	if (!JS_NewNumberValue (context, pending, &val)
+		|| !JS_DefineProperty (context, ret, "pending", val, nullptr, nullptr, JSPROP_READONLY|JSPROP_ENUMERATE)
+		|| !JS_NewNumberValue (context, journal_written, &val)
+		|| !JS_DefineProperty (context, ret, "written", val, nullptr, nullptr, JSPROP_READONLY|JSPROP_ENUMERATE)
+		|| !JS_NewNumberValue (context, journal_errors, &val)
+		|| !JS_DefineProperty (context, ret, "errors", val, nullptr, nullptr, JSPROP_READONLY|JSPROP_ENUMERATE))
+		return JS_FALSE;
+
+	return JS_TRUE;
+}
+
+static JSBool
+hjs_setpluginprefbuffer (JSContext *context, unsigned argc, jsval *vp)
+{
+	jsval* argv = JS_ARGV(context, vp);
+	pref_store* prefs;
+	JSString* var;
+	const char* data;
+	size_t len;
+	char* cvar;
+
+	if (!JS_ConvertArguments (context, argc, argv, "S*", &var))
+		return JS_FALSE;
+
+	if (!hjs_util_getbuffer (argv[1], &data, &len))
+	{
+		JS_SET_RVAL (context, vp, JSVAL_FALSE);
+		return JS_TRUE;
+	}
+
+	prefs = hjs_prefs_find (context);
+	cvar = JSSTRING_TO_CHAR(var);
+
+	// always kept in the record file, the conf file can't hold arbitrary bytes
+	hjs_prefs_set (prefs, cvar, string(data, len), true);
+	hjs_store_schedule ();
+
+	JS_free(context, cvar);
+
+	JS_SET_RVAL (context, vp, JSVAL_TRUE);
+
+	return JS_TRUE;
+}
+
+static JSBool
+hjs_getpluginprefbuffer (JSContext *context, unsigned argc, jsval *vp)
+{
+	pref_store* prefs;
+	JSString* var;
+	JSObject* buffer = nullptr;
+	const char* value;
+	size_t len;
+	char* cvar;
+
+	if (!JS_ConvertArguments (context, argc, JS_ARGV(context, vp), "S", &var))
+		return JS_FALSE;
+
+	prefs = hjs_prefs_find (context);
+	cvar = JSSTRING_TO_CHAR(var);
+
+	if (hjs_prefs_lookup (prefs, cvar, &value, &len) && (buffer = hjs_util_newbuffer (context, value, len)) == nullptr)
+	{
+		JS_free(context, cvar);
+		return JS_FALSE;
+	}
+	JS_free(context, cvar);
+
+	JS_SET_RVAL (context, vp, buffer ? OBJECT_TO_JSVAL(buffer) : JSVAL_VOID);
+
+	return JS_TRUE;
+}
+
+static JSBool
+hjs_setkvbuffer (JSContext *context, unsigned argc, jsval *vp)
+{
+	jsval* argv = JS_ARGV(context, vp);
+	kv_store* kv;
+	JSString* key;
+	const char* data;
+	size_t len;
+	char* ckey;
+	bool ret;
+
+	if (!JS_ConvertArguments (context, argc, argv, "S*", &key))
+		return JS_FALSE;
+
+	if (!hjs_util_getbuffer (argv[1], &data, &len))
+	{
+		JS_SET_RVAL (context, vp, JSVAL_FALSE);
+		return JS_TRUE;
+	}
+
+	kv = hjs_kv_find (context);
+	ckey = JSSTRING_TO_CHAR(key);
+
+	ret = kv->records.put (ckey, data, len);
+	hjs_store_schedule ();
+
+	JS_free(context, ckey);
+
+	JS_SET_RVAL (context, vp, BOOLEAN_TO_JSVAL(ret));
+
+	return JS_TRUE;
+}
+
+static JSBool
+hjs_getkvbuffer (JSContext *context, unsigned argc, jsval *vp)
+{
+	kv_store* kv;
+	JSString* key;
+	JSObject* buffer = nullptr;
+	const char* value;
+	size_t len;
+	char* ckey;
+
+	if (!JS_ConvertArguments (context, argc, JS_ARGV(context, vp), "S", &key))
+		return JS_FALSE;
+
+	kv = hjs_kv_find (context);
+	ckey = JSSTRING_TO_CHAR(key);
+
+	// copied straight out of the mapped file
+	if (kv->records.get (ckey, &value, &len) && (buffer = hjs_util_newbuffer (context, value, len)) == nullptr)
+	{
+		JS_free(context, ckey);
+		return JS_FALSE;
+	}
+	JS_free(context, ckey);
+
+	JS_SET_RVAL (context, vp, buffer ? OBJECT_TO_JSVAL(buffer) : JSVAL_VOID);
+
+	return JS_TRUE;
+}
+
+static string
+hjs_buffer_path (JSContext *context, JSString *file)
+{
+	js_script* script = hjs_script_find (context);
+	char* cfile = JSSTRING_TO_CHAR(file);
+	string path = cfile;
+	string dir;
+	bool absolute;
+
+	JS_free(context, cfile);
+
+	if (path.empty())
+		return path;
+
+#ifdef _WIN32
+	absolute = !PathIsRelative (path.c_str());
+#else
+	absolute = path[0] == '/';
+#endif
+
+	// absolute paths are used as given, relative names are kept apart per script
+	if (!absolute)
+	{
+		vector<string> parts;
+		size_t start = 0, end;
+
+		do
+		{
+#ifdef _WIN32
+			end = path.find_first_of ("/\\", start);
+#else
+			end = path.find ('/', start);
+#endif
+			parts.push_back (path.substr (start, end == string::npos ? end : end - start));
+			start = end + 1;
+		} while (end != string::npos);
+
+		// and can't climb out of their directory
+		for (const string& part : parts)
+			if (part == "..")
+				return string();
+
+		dir = string(hexchat_get_info (ph, "configdir")) + DIR_SEP + "javascript";
+		hjs_util_mkdir (dir);
+		dir = dir + DIR_SEP + "files";
+		hjs_util_mkdir (dir);
+		dir = dir + DIR_SEP + hjs_prefs_canon (script != nullptr ? script->name : name);
+		hjs_util_mkdir (dir);
+
+		// subdirectories are made on the way
+		for (size_t i = 0; i + 1 < parts.size(); i++)
+		{
+			if (parts[i].empty() || parts[i] == ".")
+				continue;
+
+			dir = dir + DIR_SEP + parts[i];
+			hjs_util_mkdir (dir);
+		}
+
+		path = dir + DIR_SEP + parts.back();
+	}
+
+	return path;
+}
+
+static JSBool
+hjs_readbuffer (JSContext *context, unsigned argc, jsval *vp)
+{
+	JSString* file;
+	JSObject* buffer;
+	string path;
+
+	if (!JS_ConvertArguments (context, argc, JS_ARGV(context, vp), "S", &file))
+		return JS_FALSE;
+
+	path = hjs_buffer_path (context, file);
+	ifstream in (path, ios::binary | ios::ate);
+
+	if (path.empty() || !in)
+	{
+		JS_SET_RVAL (context, vp, JSVAL_NULL);
+		return JS_TRUE;
+	}
+
+	streamoff size = in.tellg();
+	if (size < 0 || (buffer = js_CreateArrayBuffer (context, (jsuint)size)) == nullptr)
+		return JS_FALSE;
+
+	// read right into the buffer's memory
+	in.seekg (0);
+	if (size > 0 && !in.read ((char*)js::ArrayBuffer::fromJSObject (buffer)->data, size))
+	{
+		JS_SET_RVAL (context, vp, JSVAL_NULL);
+		return JS_TRUE;
+	}
+
+	JS_SET_RVAL (context, vp, OBJECT_TO_JSVAL(buffer));
+
+	return JS_TRUE;
+}
+
+static JSBool
+hjs_writebuffer (JSContext *context, unsigned argc, jsval *vp)
+{
+	jsval* argv = JS_ARGV(context, vp);
+	JSString* file;
+	JSBool append = JS_FALSE;
+	const char* data;
+	size_t len;
+	string path, tmppath;
+
+	if (!JS_ConvertArguments (context, argc, argv, "S*/b", &file, &append))
+		return JS_FALSE;
+
+	if (!hjs_util_getbuffer (argv[1], &data, &len))
+	{
+		JS_SET_RVAL (context, vp, JSVAL_FALSE);
+		return JS_TRUE;
+	}
+
+	path = hjs_buffer_path (context, file);
+	if (path.empty())
+	{
+		JS_SET_RVAL (context, vp, JSVAL_FALSE);
+		return JS_TRUE;
+	}
+
+	// appends go straight to the file, replacing it goes through a temporary one
+	tmppath = append ? path : path + ".tmp";
+	ofstream out (tmppath, ios::binary | (append ? ios::app : ios::trunc));
+
+	out.write (data, len);
+	out.close();
+
+	if (out.fail() || (!append && !hjs_util_replacefile (tmppath, path)))
+	{
+		if (!append)
+			remove (tmppath.c_str());
+
+		JS_SET_RVAL (context, vp, JSVAL_FALSE);
+		return JS_TRUE;
+	}
+
+	JS_SET_RVAL (context, vp, JSVAL_TRUE);
+
+	return JS_TRUE;
+}
+
+/* Convenience functions */
+
+static const vector<int>&
+hjs_util_nickpalette (JSContext *context)
+{
+	js_script* script = hjs_script_find (context);
+
+	if (script == nullptr)
+		return interp_palette;
+
+	return script->nick_palette.empty() ? default_palette : script->nick_palette;
+}
+
+static int
+hjs_util_nickcolor (const vector<int>& palette, const jschar *nick, size_t len)
+{
+	// FNV-1a over the UTF-16 chars, similar nicks still spread across the palette
+	uint32 hash = 2166136261u;
+
+	for (size_t i = 0; i < len; i++)
+	{
+		hash ^= nick[i];
+		hash *= 16777619u;
+	}
+
+	return palette[hash % palette.size()];
+}
+
+static JSBool
+hjs_getnickcolor (JSContext *context, unsigned argc, jsval *vp)
+{
+	jsval* argv = JS_ARGV(context, vp);
+	const vector<int>& palette = hjs_util_nickpalette (context);
+	JSString* nick;
+	const jschar* chars;
+	size_t len;
+
+	if (!JS_ConvertArguments (context, argc, argv, "*"))
+		return JS_FALSE;
+
+	// an array of nicks gives an array of colors
+	if (!JSVAL_IS_PRIMITIVE(argv[0]) && JS_IsArrayObject (context, JSVAL_TO_OBJECT(argv[0])))
+	{
+		JSObject* nicks = JSVAL_TO_OBJECT(argv[0]);
+		JSObject* colors;
+		jsuint count;
+
+		if (!JS_GetArrayLength (context, nicks, &count)
+			|| (colors = JS_NewArrayObject (context, 0, nullptr)) == nullptr)
+			return JS_FALSE;
+
+		for (jsuint i = 0; i < count; i++)
+		{
+			jsval val;
+
+			if (!JS_GetElement (context, nicks, i, &val)
+				|| (nick = JS_ValueToString (context, val)) == nullptr
+				|| (chars = JS_GetStringCharsAndLength (context, nick, &len)) == nullptr)
+				return JS_FALSE;
+
+			val = INT_TO_JSVAL(hjs_util_nickcolor (palette, chars, len));
+			if (!JS_SetElement (context, colors, i, &val))
+				return JS_FALSE;
+		}
+
+		JS_SET_RVAL(context, vp, OBJECT_TO_JSVAL(colors));
+		return JS_TRUE;
+	}
+
+	if ((nick = JS_ValueToString (context, argv[0])) == nullptr
+		|| (chars = JS_GetStringCharsAndLength (context, nick, &len)) == nullptr)
+		return JS_FALSE;
+
+	JS_SET_RVAL(context, vp, INT_TO_JSVAL(hjs_util_nickcolor (palette, chars, len)));
+
+	return JS_TRUE;
+}
+
+static JSBool
+hjs_setnickcolorpalette (JSContext *context, unsigned argc, jsval *vp)
+{
+	JSObject* colors;
+	jsuint len;
+	vector<int> palette;
+	js_script* script;
+
+	if (!JS_ConvertArguments (context, argc, JS_ARGV(context, vp), "o", &colors))
+		return JS_FALSE;
+
+	if (!JS_IsArrayObject (context, colors) || !JS_GetArrayLength (context, colors, &len) || len == 0)
+		return JS_FALSE;
+
+	for (jsuint i = 0; i < len; i++)
+	{
+		jsval val;
+		int32 color;
+
+		if (!JS_GetElement (context, colors, i, &val) || !JS_ValueToECMAInt32 (context, val, &color)
+			|| color < 0 || color > 99)
+			return JS_FALSE;
+		palette.push_back (color);
+	}
+
+	// per script, another script's colors never change
+	script = hjs_script_find (context);
+	(script != nullptr ? script->nick_palette : interp_palette).swap (palette);
+
+	JS_SET_RVAL (context, vp, JSVAL_VOID);
+
+	return JS_TRUE;
+}
+
+static void
+hjs_format_finalize (JSContext *context, JSObject *obj)
+{
+	delete (format_template*)JS_GetPrivate (context, obj);
+}
+
+static JSClass format_class = {"format", JSCLASS_HAS_PRIVATE,
+    JS_PropertyStub, JS_PropertyStub, JS_PropertyStub, JS_StrictPropertyStub,
+    JS_EnumerateStub, JS_ResolveStub, JS_ConvertStub, hjs_format_finalize,
+    JSCLASS_NO_OPTIONAL_MEMBERS};
+
+static void
+hjs_format_color (vector<jschar>& out, int color)
+{
+	// always two digits so text starting with a digit isn't taken as part of it
+	out.push_back ('\003');
+	out.push_back ('0' + color / 10);
+	out.push_back ('0' + color % 10);
+}
+
+static JSBool
+hjs_formatrender (JSContext *context, unsigned argc, jsval *vp)
+{
+	JSObject* args;
+	JSObject* self = JS_THIS_OBJECT(context, vp);
+	format_template* tmpl;
+
+	if (!JS_ConvertArguments (context, argc, JS_ARGV(context, vp), "o", &args))
+		return JS_FALSE;
+
+	tmpl = (format_template*)JS_GetInstancePrivate (context, self, &format_class, nullptr);
+	if (tmpl == nullptr)
+		return JS_FALSE;
+
+	// the buffer keeps its capacity between renders
+	vector<jschar>& out = tmpl->buffer;
+	out.clear();
+
+	for (const format_op& op : tmpl->ops)
+	{
+		JSString* str;
+		const jschar* chars;
+		size_t len;
+		jsval val;
+
+		if (op.field.empty())
+		{
+			out.insert (out.end(), op.text.begin(), op.text.end());
+			continue;
+		}
+
+		if (!JS_GetProperty (context, args, op.field.c_str(), &val))
+			return JS_FALSE;
+		if (JSVAL_IS_VOID(val) || JSVAL_IS_NULL(val))
+			continue;
+		if ((str = JS_ValueToString (context, val)) == nullptr
+			|| (chars = JS_GetStringCharsAndLength (context, str, &len)) == nullptr)
+			return JS_FALSE;
+
+		switch (op.modifier)
+		{
+			case 'n': // color from the nick hash
+				hjs_format_color (out, hjs_util_nickcolor (hjs_util_nickpalette (context), chars, len));
+				break;
+
+			case 'c': // fixed color
+				hjs_format_color (out, op.color);
+				break;
+
+			case 0:
+				break;
+
+			default: // toggled attribute
+				out.push_back (op.modifier);
+		}
+
+		out.insert (out.end(), chars, chars + len);
+
+		// a bare \003 could swallow following digits, so colors end with a reset
+		if (op.modifier == 'n' || op.modifier == 'c')
+			out.push_back ('\017');
+		else if (op.modifier)
+			out.push_back (op.modifier);
+	}
+
+	JS_SET_RVAL (context, vp, STRING_TO_JSVAL(JS_NewUCStringCopyN (context, out.data(), out.size())));
+
+	return JS_TRUE;
+}
+
+static JSBool
+hjs_compileformat (JSContext *context, unsigned argc, jsval *vp)
+{
+	JSString* pattern;
+	JSObject* obj;
+	const jschar* chars;
+	size_t len;
+	format_template* tmpl;
+	format_op literal;
+
+	if (!JS_ConvertArguments (context, argc, JS_ARGV(context, vp), "S", &pattern))
+		return JS_FALSE;
+
+	chars = JS_GetStringCharsAndLength (context, pattern, &len);
+	if (chars == nullptr)
+		return JS_FALSE;
+
+	tmpl = new format_template;
+	literal.modifier = 0;
+	literal.color = 0;
+
+	// "{name}" or "{name:modifier}", "{{" and "}}" are literal braces
+	for (size_t i = 0; i < len; i++)
+	{
+		if ((chars[i] == '{' || chars[i] == '}') && i + 1 < len && chars[i + 1] == chars[i])
+		{
+			literal.text.push_back (chars[i++]);
+			continue;
+		}
+
+		if (chars[i] != '{')
+		{
+			literal.text.push_back (chars[i]);
+			continue;
+		}
+
+		format_op op;
+		string modifier;
+		size_t end = i + 1;
+
+		while (end < len && chars[end] != '}')
+			end++;
+		if (end == len)
+		{
+			delete tmpl;
+			return JS_FALSE;
+		}
+
+		string spec (chars + i + 1, chars + end);
+		size_t colon = spec.find (':');
+		op.field = spec.substr (0, colon);
+		if (colon != string::npos)
+			modifier = spec.substr (colon + 1);
+
+		op.modifier = 0;
+		op.color = 0;
+		if (modifier == "color")
+			op.modifier = 'n';
+		else if (modifier == "bold")
+			op.modifier = '\002';
+		else if (modifier == "italic")
+			op.modifier = '\035';
+		else if (modifier == "underline")
+			op.modifier = '\037';
+		else if (modifier == "reverse")
+			op.modifier = '\026';
+		else if (!modifier.empty() && modifier.size() <= 2
+				&& modifier.find_first_not_of ("0123456789") == string::npos)
+		{
+			op.modifier = 'c';
+			op.color = atoi (modifier.c_str());
+		}
+		else if (!modifier.empty() || op.field.empty())
+		{
+			delete tmpl;
+			return JS_FALSE;
+		}
+
+		if (!literal.text.empty())
+		{
+			tmpl->ops.push_back (literal);
+			literal.text.clear();
+		}
+		tmpl->ops.push_back (op);
+		i = end;
+	}
+
+	if (!literal.text.empty())
+		tmpl->ops.push_back (literal);
+
+	obj = JS_NewObject (context, &format_class, nullptr, nullptr);
+	if (obj == nullptr || !JS_SetPrivate (context, obj, tmpl))
+	{
+		delete tmpl;
+		return JS_FALSE;
+	}
+
+	if (!JS_DefineFunction (context, obj, "render", hjs_formatrender, 1, JSPROP_READONLY|JSPROP_PERMANENT))
+		return JS_FALSE;
+
+	JS_SET_RVAL (context, vp, OBJECT_TO_JSVAL(obj));
+
+	return JS_TRUE;
+}
+
+static JSBool
+hjs_searchlogs (JSContext *context, unsigned argc, jsval *vp)
+{
+	JSString* query;
+	JSObject* options = nullptr;
+	JSObject* ret;
+	JSObject* results;
+	char* cquery;
+	string network, channel;
+	int32 after = INT32_MIN, before = INT32_MAX;
+	uint32 limit = 50, offset = 0;
+	vector<string> tokens;
+	vector<log_file> files;
+	vector<log_match> matches;
+	bool complete = true;
+	string logdir = string(hexchat_get_info (ph, "configdir")) + DIR_SEP + "logs";
+	string indexdir = string(hexchat_get_info (ph, "configdir")) + DIR_SEP + "javascript";
+	DIR* dir;
+	dirent* ent;
+
+	if (!JS_ConvertArguments (context, argc, JS_ARGV(context, vp), "S/o", &query, &options))
+		return JS_FALSE;
+
+	cquery = JSSTRING_TO_CHAR(query);
+	hjs_log_tokenize (cquery, tokens);
+	JS_free(context, cquery);
+
+	// options are {network, channel, after, before, limit, offset}
+	if (options != nullptr)
+	{
+		jsval val;
+		int32 num;
+
+		network = hjs_util_getstringprop (context, options, "network");
+		channel = hjs_util_getstringprop (context, options, "channel");
+		if (JS_GetProperty (context, options, "after", &val) && !JSVAL_IS_PRIMITIVE(val))
+			after = hjs_util_timefromdate (context, JSVAL_TO_OBJECT(val)) / 86400;
+		if (JS_GetProperty (context, options, "before", &val) && !JSVAL_IS_PRIMITIVE(val))
+			before = hjs_util_timefromdate (context, JSVAL_TO_OBJECT(val)) / 86400;
+		if (JS_GetProperty (context, options, "limit", &val) && JSVAL_IS_NUMBER(val)
+			&& JS_ValueToECMAInt32 (context, val, &num) && num > 0)
+			limit = num;
+		if (JS_GetProperty (context, options, "offset", &val) && JSVAL_IS_NUMBER(val)
+			&& JS_ValueToECMAInt32 (context, val, &num) && num > 0)
+			offset = num;
+	}
+
+	// logs live in logs/<network>/<channel>.log by default
+	hjs_util_mkdir (indexdir);
+	indexdir += string(1, DIR_SEP) + "logindex";
+	hjs_util_mkdir (indexdir);
+
+	dir = opendir (logdir.c_str());
+	while (dir != nullptr && !tokens.empty() && (ent = readdir (dir)))
+	{
+		string netname = ent->d_name;
+		string netdir = logdir + DIR_SEP + netname;
+		DIR* subdir;
+		dirent* subent;
+
+		if (netname[0] == '.' || (!network.empty() && hexchat_nickcmp (ph, netname.c_str(), network.c_str()) != 0))
+			continue;
+
+		subdir = opendir (netdir.c_str());
+		if (subdir == nullptr)
+			continue;
+
+		hjs_util_mkdir (indexdir + DIR_SEP + netname);
+		while ((subent = readdir (subdir)))
+		{
+			string file = subent->d_name;
+
+			if (file.size() <= 4 || file.compare (file.size() - 4, 4, ".log") != 0)
+				continue;
+			if (!channel.empty() && hexchat_nickcmp (ph, file.substr (0, file.size() - 4).c_str(), channel.c_str()) != 0)
+				continue;
+
+			files.push_back ({ netdir + DIR_SEP + file, netname, file.substr (0, file.size() - 4),
+								indexdir + DIR_SEP + netname + DIR_SEP + file });
+		}
+		closedir (subdir);
+	}
+	if (dir != nullptr)
+		closedir (dir);
+
+	// the worker only waits on this while it swaps in a new segment
+	lock_guard<mutex> lock (logindex_mutex);
+
+	for (uint32 i = 0; i < files.size(); i++)
+		if (!hjs_log_search (files[i], tokens, i, matches))
+			complete = false;
+
+	// newest first, undated lines count as oldest
+	matches.erase (remove_if (matches.begin(), matches.end(), [after, before](const log_match& match) {
+						return match.day >= 0 && (match.day < after || match.day > before);
+					}), matches.end());
+	sort (matches.begin(), matches.end(), [](const log_match& a, const log_match& b) {
+			if (a.day != b.day)
+				return a.day > b.day;
+			if (a.file != b.file)
+				return a.file < b.file;
+			if (a.indexed != b.indexed)
+				return !a.indexed; // the unindexed tail is newer
+			return a.pos > b.pos;
+		});
+
+	ret = JS_NewObject (context, nullptr, nullptr, nullptr);
+	results = JS_NewArrayObject (context, 0, nullptr);
+	if (ret == nullptr || results == nullptr)
+		return JS_FALSE;
+
+	// only the requested page is ever read from disk
+	for (uint32 i = offset, index = 0; i < matches.size() && index < limit; i++, index++)
+	{
+		const log_match& match = matches[i];
+		const log_file& file = files[match.file];
+		JSObject* result = JS_NewObject (context, nullptr, nullptr, nullptr);
+		uint64_t pos = match.pos;
+		string line;
+		jsval val;
+
+		if (result == nullptr)
+			return JS_FALSE;
+
+		if (match.indexed)
+		{
+			ifstream in(file.index_path + ".lines", ios::in | ios::binary);
+
+			in.seekg (match.pos * sizeof(uint64_t));
+			if (!hjs_log_read (in, pos))
+				continue;
+		}
+
+		ifstream log(file.path, ios::in | ios::binary);
+		log.seekg (pos);
+		getline (log, line);
+
+		val = STRING_TO_JSVAL(JS_NewStringCopyZ (context, line.c_str()));
+		if (!JS_DefineProperty (context, result, "line", val, nullptr, nullptr, JSPROP_READONLY|JSPROP_ENUMERATE)
+			|| !JS_DefineProperty (context, result, "network", STRING_TO_JSVAL(hjs_util_newstring (context, file.network.c_str())),
+									nullptr, nullptr, JSPROP_READONLY|JSPROP_ENUMERATE)
+			|| !JS_DefineProperty (context, result, "channel", STRING_TO_JSVAL(hjs_util_newstring (context, file.channel.c_str())),
+									nullptr, nullptr, JSPROP_READONLY|JSPROP_ENUMERATE))
+			return JS_FALSE;
+
+		if (match.day >= 0)
+		{
+			val = hjs_util_datefromtime (context, (time_t)match.day * 86400);
+			if (!JS_DefineProperty (context, result, "day", val, nullptr, nullptr, JSPROP_READONLY|JSPROP_ENUMERATE))
+				return JS_FALSE;
+		}
+
+		val = OBJECT_TO_JSVAL(result);
+		if (!JS_SetElement (context, results, index, &val))
+			return JS_FALSE;
+	}
+
+	if (!JS_DefineProperty (context, ret, "total", INT_TO_JSVAL(matches.size()), nullptr, nullptr,
+							JSPROP_READONLY|JSPROP_ENUMERATE)
+		|| !JS_DefineProperty (context, ret, "results", OBJECT_TO_JSVAL(results), nullptr, nullptr,
+								JSPROP_READONLY|JSPROP_ENUMERATE)
+		// false while a log is still being indexed, searching again later finds the rest
+		|| !JS_DefineProperty (context, ret, "complete", BOOLEAN_TO_JSVAL(complete), nullptr, nullptr,
+								JSPROP_READONLY|JSPROP_ENUMERATE))
+		return JS_FALSE;
+
+	JS_SET_RVAL (context, vp, OBJECT_TO_JSVAL(ret));
+
+	return JS_TRUE;
+}
+
+/* NickSet and NickMap */
+
+static const unsigned char*
+hjs_nick_foldtable (const string& casemapping)
+{
+	static unsigned char tables[3][128];
+	static bool built = false;
+
+	if (!built)
+	{
+		for (int t = 0; t < 3; t++)
+			for (int c = 0; c < 128; c++)
+				tables[t][c] = (c >= 'A' && c <= 'Z') ? c + ('a' - 'A') : c;
+
+		// rfc1459 also folds []\~ to {}|^, strict-rfc1459 leaves out ~
+		for (int t = 0; t < 2; t++)
+		{
+			tables[t]['['] = '{';
+			tables[t][']'] = '}';
+			tables[t]['\\'] = '|';
+		}
+		tables[0]['~'] = '^';
+		built = true;
+	}
+
+	if (casemapping == "ascii")
+		return tables[2];
+	else if (casemapping == "strict-rfc1459")
+		return tables[1];
+
+	return tables[0];
+}
+
+static bool
+hjs_nick_key (JSContext *context, nick_collection *nicks, jsval val, nick_key& key, nick_key& original)
+{
+	JSString* str = JS_ValueToString (context, val);
+	const jschar* chars;
+	size_t len;
+
+	if (str == nullptr || (chars = JS_GetStringCharsAndLength (context, str, &len)) == nullptr)
+		return false;
+
+	original.assign (chars, len);
+	key.resize (len);
+	for (size_t i = 0; i < len; i++)
+		key[i] = chars[i] < 128 ? nicks->fold[chars[i]] : chars[i];
+
+	return true;
+}
+
+static void
+hjs_nick_finalize (JSContext *context, JSObject *obj)
+{
+	delete (nick_collection*)JS_GetPrivate (context, obj);
+}
+
+static JSClass nickset_class = {"NickSet", JSCLASS_HAS_PRIVATE,
+    JS_PropertyStub, JS_PropertyStub, JS_PropertyStub, JS_StrictPropertyStub,
+    JS_EnumerateStub, JS_ResolveStub, JS_ConvertStub, hjs_nick_finalize,
+    JSCLASS_NO_OPTIONAL_MEMBERS};
+// the map keeps its values on a plain object in slot 0 so the GC can see them, without a prototype
+// and under prefixed names so a nick like __proto__ is never anything special
+static JSClass nickmap_class = {"NickMap", JSCLASS_HAS_PRIVATE|JSCLASS_HAS_RESERVED_SLOTS(1),
+    JS_PropertyStub, JS_PropertyStub, JS_PropertyStub, JS_StrictPropertyStub,
+    JS_EnumerateStub, JS_ResolveStub, JS_ConvertStub, hjs_nick_finalize,
+    JSCLASS_NO_OPTIONAL_MEMBERS};
+
+static nick_key
+hjs_nick_slot (const nick_key& key)
+{
+	return nick_key(1, ':') + key;
+}
+
+static JSObject*
+hjs_nick_newvalues (JSContext *context)
+{
+	return JS_NewObjectWithGivenProto (context, nullptr, nullptr, JS_GetGlobalForScopeChain (context));
+}
+
+static nick_collection*
+hjs_nick_get (JSContext *context, jsval *vp, JSObject** values)
+{
+	JSObject* self = JS_THIS_OBJECT(context, vp);
+	JSClass* clasp = values ? &nickmap_class : &nickset_class;
+	nick_collection* nicks = (nick_collection*)JS_GetInstancePrivate (context, self, clasp, nullptr);
+	jsval slot;
+
+	if (nicks != nullptr && values != nullptr)
+	{
+		if (!JS_GetReservedSlot (context, self, 0, &slot) || JSVAL_IS_PRIMITIVE(slot))
+			return nullptr;
+		*values = JSVAL_TO_OBJECT(slot);
+	}
+
+	return nicks;
+}
+
+static JSObject*
+hjs_nick_construct (JSContext *context, unsigned argc, jsval *vp)
+{
+	JSString* casemapping = nullptr;
+	JSObject* obj;
+	nick_collection* nicks;
+	string mapping = "rfc1459";
+
+	if (!JS_ConvertArguments (context, argc, JS_ARGV(context, vp), "/S", &casemapping))
+		return nullptr;
+
+	// default to whatever the current server announced
+	if (casemapping != nullptr)
+	{
+		char cmapping[32];
+		if (hjs_util_encodebuf (casemapping, cmapping, sizeof(cmapping)))
+			mapping = cmapping;
+	}
+	else
+	{
+		auto found = server_casemapping.find (hjs_util_serverid ());
+		if (found != server_casemapping.end())
+			mapping = found->second;
+	}
+
+	obj = JS_NewObjectForConstructor (context, vp);
+	if (obj == nullptr)
+		return nullptr;
+
+	nicks = new nick_collection;
+	nicks->fold = hjs_nick_foldtable (mapping);
+	if (!JS_SetPrivate (context, obj, nicks))
+	{
+		delete nicks;
+		return nullptr;
+	}
+
+	return obj;
+}
+
+static JSBool
+hjs_nickset_new (JSContext *context, unsigned argc, jsval *vp)
+{
+	JSObject* obj = hjs_nick_construct (context, argc, vp);
+
+	if (obj == nullptr)
+		return JS_FALSE;
+
+	JS_SET_RVAL (context, vp, OBJECT_TO_JSVAL(obj));
+
+	return JS_TRUE;
+}
+
+static JSBool
+hjs_nickmap_new (JSContext *context, unsigned argc, jsval *vp)
+{
+	JSObject* obj = hjs_nick_construct (context, argc, vp);
+	JSObject* values;
+
+	if (obj == nullptr || (values = hjs_nick_newvalues (context)) == nullptr
+		|| !JS_SetReservedSlot (context, obj, 0, OBJECT_TO_JSVAL(values)))
+		return JS_FALSE;
+
+	JS_SET_RVAL (context, vp, OBJECT_TO_JSVAL(obj));
+
+	return JS_TRUE;
+}
+
+static JSBool
+hjs_nick_has (JSContext *context, unsigned argc, jsval *vp, bool map)
+{
+	JSObject* values;
+	nick_collection* nicks = hjs_nick_get (context, vp, map ? &values : nullptr);
+	nick_key key, original;
+
+	if (nicks == nullptr || argc < 1 || !hjs_nick_key (context, nicks, JS_ARGV(context, vp)[0], key, original))
+		return JS_FALSE;
+
+	JS_SET_RVAL (context, vp, BOOLEAN_TO_JSVAL(nicks->nicks.count (key) != 0));
+
+	return JS_TRUE;
+}
+
+static JSBool
+hjs_nick_remove (JSContext *context, unsigned argc, jsval *vp, bool map)
+{
+	JSObject* values = nullptr;
+	nick_collection* nicks = hjs_nick_get (context, vp, map ? &values : nullptr);
+	nick_key key, original;
+	bool found;
+
+	if (nicks == nullptr || argc < 1 || !hjs_nick_key (context, nicks, JS_ARGV(context, vp)[0], key, original))
+		return JS_FALSE;
+
+	found = nicks->nicks.erase (key) != 0;
+	if (found && values != nullptr)
+	{
+		jsval rval;
+		nick_key slot = hjs_nick_slot (key);
+		if (!JS_DeleteUCProperty2 (context, values, slot.data(), slot.size(), &rval))
+			return JS_FALSE;
+	}
+
+	JS_SET_RVAL (context, vp, BOOLEAN_TO_JSVAL(found));
+
+	return JS_TRUE;
+}
+
+static JSBool
+hjs_nick_clear (JSContext *context, unsigned argc, jsval *vp, bool map)
+{
+	JSObject* values;
+	nick_collection* nicks = hjs_nick_get (context, vp, map ? &values : nullptr);
+
+	if (nicks == nullptr)
+		return JS_FALSE;
+
+	nicks->nicks.clear();
+
+	// dropping the values object is cheaper than deleting every key
+	if (map && ((values = hjs_nick_newvalues (context)) == nullptr
+				|| !JS_SetReservedSlot (context, JS_THIS_OBJECT(context, vp), 0, OBJECT_TO_JSVAL(values))))
+		return JS_FALSE;
+
+	JS_SET_RVAL (context, vp, JSVAL_VOID);
+
+	return JS_TRUE;
+}
+
+static JSBool
+hjs_nick_size (JSContext *context, unsigned argc, jsval *vp, bool map)
+{
+	JSObject* values;
+	nick_collection* nicks = hjs_nick_get (context, vp, map ? &values : nullptr);
+
+	if (nicks == nullptr)
+		return JS_FALSE;
+
+	JS_SET_RVAL (context, vp, INT_TO_JSVAL(nicks->nicks.size()));
+
+	return JS_TRUE;
+}
+
+static JSBool
+hjs_nick_keys (JSContext *context, unsigned argc, jsval *vp, bool map)
+{
+	JSObject* values;
+	JSObject* keys;
+	nick_collection* nicks = hjs_nick_get (context, vp, map ? &values : nullptr);
+	jsint index = 0;
+
+	if (nicks == nullptr || (keys = JS_NewArrayObject (context, 0, nullptr)) == nullptr)
+		return JS_FALSE;
+
+	// nicks keep the case they were first added with
+	for (auto& nick : nicks->nicks)
+	{
+		jsval val = STRING_TO_JSVAL(JS_NewUCStringCopyN (context, nick.second.data(), nick.second.size()));
+		if (!JS_SetElement (context, keys, index++, &val))
+			return JS_FALSE;
+	}
+
+	JS_SET_RVAL (context, vp, OBJECT_TO_JSVAL(keys));
+
+	return JS_TRUE;
+}
+
+static JSBool
+hjs_nick_foreach (JSContext *context, unsigned argc, jsval *vp, bool map)
+{
+	JSObject* values = nullptr;
+	JSObject* funcobj;
+	nick_collection* nicks = hjs_nick_get (context, vp, map ? &values : nullptr);
+	vector<pair<nick_key, nick_key>> entries;
+
+	if (!JS_ConvertArguments (context, argc, JS_ARGV(context, vp), "o", &funcobj))
+		return JS_FALSE;
+
+	if (nicks == nullptr || !JS_ObjectIsFunction (context, funcobj))
+		return JS_FALSE;
+
+	// copy first so the callback can modify the collection
+	entries.assign (nicks->nicks.begin(), nicks->nicks.end());
+
+	for (auto& entry : entries)
+	{
+		jsval argv[2];
+		jsval rval;
+
+		argv[0] = STRING_TO_JSVAL(JS_NewUCStringCopyN (context, entry.second.data(), entry.second.size()));
+		argv[1] = JSVAL_VOID;
+		if (values != nullptr)
+		{
+			// callbacks get (value, nick) for maps, like Array.forEach
+			nick_key slot = hjs_nick_slot (entry.first);
+			argv[1] = argv[0];
+			if (!JS_GetUCProperty (context, values, slot.data(), slot.size(), &argv[0]))
+				return JS_FALSE;
+		}
+
+		if (!JS_CallFunctionValue (context, JS_GetGlobalForScopeChain (context), OBJECT_TO_JSVAL(funcobj),
+									values ? 2 : 1, argv, &rval))
+			return JS_FALSE;
+	}
+
+	JS_SET_RVAL (context, vp, JSVAL_VOID);
+
+	return JS_TRUE;
+}
+
+static JSBool
+hjs_nickset_add (JSContext *context, unsigned argc, jsval *vp)
+{
+	nick_collection* nicks = hjs_nick_get (context, vp, nullptr);
+	nick_key key, original;
+
+	if (nicks == nullptr || argc < 1 || !hjs_nick_key (context, nicks, JS_ARGV(context, vp)[0], key, original))
+		return JS_FALSE;
+
+	JS_SET_RVAL (context, vp, BOOLEAN_TO_JSVAL(nicks->nicks.insert (make_pair (key, original)).second));
+
+	return JS_TRUE;
+}
+
+static JSBool
+hjs_nickmap_set (JSContext *context, unsigned argc, jsval *vp)
+{
+	JSObject* values;
+	nick_collection* nicks = hjs_nick_get (context, vp, &values);
+	nick_key key, original, slot;
+	jsval val;
+
+	if (nicks == nullptr || argc < 2 || !hjs_nick_key (context, nicks, JS_ARGV(context, vp)[0], key, original))
+		return JS_FALSE;
+
+	val = JS_ARGV(context, vp)[1];
+	slot = hjs_nick_slot (key);
+	if (!JS_SetUCProperty (context, values, slot.data(), slot.size(), &val))
+		return JS_FALSE;
+	nicks->nicks.insert (make_pair (key, original));
+
+	JS_SET_RVAL (context, vp, JSVAL_VOID);
+
+	return JS_TRUE;
+}
+
+static JSBool
+hjs_nickmap_get (JSContext *context, unsigned argc, jsval *vp)
+{
+	JSObject* values;
+	nick_collection* nicks = hjs_nick_get (context, vp, &values);
+	nick_key key, original, slot;
+	jsval val = JSVAL_VOID;
+
+	if (nicks == nullptr || argc < 1 || !hjs_nick_key (context, nicks, JS_ARGV(context, vp)[0], key, original))
+		return JS_FALSE;
+
+	slot = hjs_nick_slot (key);
+	if (nicks->nicks.count (key) && !JS_GetUCProperty (context, values, slot.data(), slot.size(), &val))
+		return JS_FALSE;
+
+	JS_SET_RVAL (context, vp, val);
+
+	return JS_TRUE;
+}
+
+#define NICK_METHOD(cls, name, map) \
+	static JSBool hjs_##cls##_##name (JSContext *context, unsigned argc, jsval *vp) \
+	{ return hjs_nick_##name (context, argc, vp, map); }
+NICK_METHOD(nickset, has, false) NICK_METHOD(nickset, remove, false) NICK_METHOD(nickset, clear, false)
+NICK_METHOD(nickset, size, false) NICK_METHOD(nickset, keys, false) NICK_METHOD(nickset, foreach, false)
+NICK_METHOD(nickmap, has, true) NICK_METHOD(nickmap, remove, true) NICK_METHOD(nickmap, clear, true)
+NICK_METHOD(nickmap, size, true) NICK_METHOD(nickmap, keys, true) NICK_METHOD(nickmap, foreach, true)
+
+static JSFunctionSpec nickset_methods[] = {
+	{"add", hjs_nickset_add, 1, JSPROP_READONLY|JSPROP_PERMANENT},
+	{"has", hjs_nickset_has, 1, JSPROP_READONLY|JSPROP_PERMANENT},
+	{"remove", hjs_nickset_remove, 1, JSPROP_READONLY|JSPROP_PERMANENT},
+	{"clear", hjs_nickset_clear, 0, JSPROP_READONLY|JSPROP_PERMANENT},
+	{"size", hjs_nickset_size, 0, JSPROP_READONLY|JSPROP_PERMANENT},
+	{"values", hjs_nickset_keys, 0, JSPROP_READONLY|JSPROP_PERMANENT},
+	{"forEach", hjs_nickset_foreach, 1, JSPROP_READONLY|JSPROP_PERMANENT},
+	{0, 0, 0, 0}
+};
+
+static JSFunctionSpec nickmap_methods[] = {
+	{"set", hjs_nickmap_set, 2, JSPROP_READONLY|JSPROP_PERMANENT},
+	{"get", hjs_nickmap_get, 1, JSPROP_READONLY|JSPROP_PERMANENT},
+	{"has", hjs_nickmap_has, 1, JSPROP_READONLY|JSPROP_PERMANENT},
+	{"remove", hjs_nickmap_remove, 1, JSPROP_READONLY|JSPROP_PERMANENT},
+	{"clear", hjs_nickmap_clear, 0, JSPROP_READONLY|JSPROP_PERMANENT},
+	{"size", hjs_nickmap_size, 0, JSPROP_READONLY|JSPROP_PERMANENT},
+	{"keys", hjs_nickmap_keys, 0, JSPROP_READONLY|JSPROP_PERMANENT},
+	{"forEach", hjs_nickmap_foreach, 1, JSPROP_READONLY|JSPROP_PERMANENT},
+	{0, 0, 0, 0}
+};
+
+/* Table */
+
+/* Table file layout, a record file keyed by encoded primary key:
+ *   "" -> uint32 column count, then per column: type char, uint32 name length, name
+ *   key -> per stored column: value
+ * values are a type char, then a double for 'n' and 'b' or a uint32 length and bytes for 's' */
+
+static void
+hjs_table_encodevalue (string& out, const table_value& value)
+{
+	out += value.type ? value.type : 'z';
+
+	if (value.type == 's')
+	{
+		uint32 len = value.str.length();
+		out.append ((const char*)&len, sizeof(uint32));
+		out += value.str;
+	}
+	else if (value.type != 0)
+		out.append ((const char*)&value.num, sizeof(double));
+}
+
+static bool
+hjs_table_decodevalue (const char*& pos, const char* end, table_value& value)
+{
+	uint32 len;
+
+	if (pos >= end)
+		return false;
+
+	value.type = *pos++;
+	value.num = 0;
+	value.str.clear();
+
+	if (value.type == 'z')
+	{
+		value.type = 0;
+		return true;
+	}
+
+	if (value.type == 's')
+	{
+		if (end - pos < (ptrdiff_t)sizeof(uint32))
+			return false;
+		memcpy (&len, pos, sizeof(uint32));
+		pos += sizeof(uint32);
+
+		if ((size_t)(end - pos) < len)
+			return false;
+		value.str.assign (pos, len);
+		pos += len;
+
+		return true;
+	}
+
+	if (end - pos < (ptrdiff_t)sizeof(double))
+		return false;
+	memcpy (&value.num, pos, sizeof(double));
+	pos += sizeof(double);
+
+	// NaN has no place in the ordering of rows and indexes
+	return !std::isnan (value.num);
+}
+
+static string
+hjs_table_encodeschema (table_data* table)
+{
+	string out;
+	uint32 len = table->columns.size();
+
+	out.append ((const char*)&len, sizeof(uint32));
+	for (const table_column& column : table->columns)
+	{
+		len = column.name.length();
+		out += column.type;
+		out.append ((const char*)&len, sizeof(uint32));
+		out += column.name;
+	}
+
+	return out;
+}
+
+static bool
+hjs_table_fromjsval (JSContext *context, jsval val, char type, table_value& value)
+{
+	JSString* str;
+	JSBool b;
+	int32 i;
+	char* cstr;
+
+	value.type = 0;
+	value.num = 0;
+	value.str.clear();
+
+	if (JSVAL_IS_NULL(val) || JSVAL_IS_VOID(val))
+		return true;
+
+	switch (type)
+	{
+	case 'i':
+		if (!JS_ValueToECMAInt32 (context, val, &i))
+			return false;
+		value.type = 'n';
+		value.num = i;
+		break;
+	case 'n':
+		// NaN compares false against everything, which would break the maps rows and indexes live in.
+		// Infinities order fine and are useful as open range bounds
+		if (!JS_ValueToNumber (context, val, &value.num) || std::isnan (value.num))
+			return false;
+		value.type = 'n';
+		break;
+	case 'b':
+		if (!JS_ValueToBoolean (context, val, &b))
+			return false;
+		value.type = 'b';
+		value.num = b;
+		break;
+	default:
+		if ((str = JS_ValueToString (context, val)) == nullptr)
+			return false;
+		cstr = JSSTRING_TO_CHAR(str);
+		value.type = 's';
+		value.str = cstr;
+		JS_free(context, cstr);
+	}
+
+	return true;
+}
+
+static jsval
+hjs_table_tojsval (JSContext *context, const table_value& value)
+{
+	jsval val = JSVAL_NULL;
+
+	switch (value.type)
+	{
+	case 's':
+		return STRING_TO_JSVAL(JS_NewStringCopyN (context, value.str.data(), value.str.length()));
+	case 'b':
+		return BOOLEAN_TO_JSVAL(value.num != 0);
+	case 'n':
+		if (value.num == (int32)value.num)
+			return INT_TO_JSVAL((int32)value.num);
+		if (!JS_NewNumberValue (context, value.num, &val))
+			return JSVAL_NULL;
+		return val;
+	default:
+		return JSVAL_NULL;
+	}
+}
+
+static JSObject*
+hjs_table_rowobject (JSContext *context, table_data* table, const vector<table_value>& row)
+{
+	JSObject* obj = JS_NewObject (context, nullptr, nullptr, nullptr);
+
+	if (obj == nullptr)
+		return nullptr;
+
+	for (size_t i = 0; i < table->columns.size(); i++)
+	{
+		if (!JS_DefineProperty (context, obj, table->columns[i].name.c_str(), hjs_table_tojsval (context, row[i]),
+								nullptr, nullptr, JSPROP_ENUMERATE))
+			return nullptr;
+	}
+
+	return obj;
+}
+
+static void
+hjs_table_unindex (table_data* table, const vector<table_value>& row)
+{
+	// keyed by value and primary key, so even a value shared by many rows is found directly
+	for (auto& index : table->indexes)
+		index.second.erase (make_pair (row[index.first], row[table->key]));
+}
+
+static void
+hjs_table_insert (table_data* table, vector<table_value>& row)
+{
+	auto found = table->rows.find (row[table->key]);
+
+	if (found != table->rows.end())
+	{
+		hjs_table_unindex (table, found->second);
+		found->second.swap (row);
+	}
+	else
+		found = table->rows.insert (make_pair (row[table->key], row)).first;
+
+	for (auto& index : table->indexes)
+		index.second.insert (make_pair (found->second[index.first], found->first));
+}
+
+static void
+hjs_table_load (table_data* table)
+{
+	const char* data;
+	size_t len;
+	vector<int> stored; // stored column to current column, -1 if gone
+	string schema = hjs_table_encodeschema (table);
+
+	table->records.load (table->path);
+
+	if (table->records.get ("", &data, &len))
+	{
+		const char* pos = data;
+		const char* end = data + len;
+		uint32 count, namelen;
+
+		if (len >= sizeof(uint32))
+		{
+			memcpy (&count, pos, sizeof(uint32));
+			pos += sizeof(uint32);
+
+			for (uint32 i = 0; i < count && end - pos > (ptrdiff_t)sizeof(uint32); i++)
+			{
+				char type = *pos++;
+				int current = -1;
+
+				memcpy (&namelen, pos, sizeof(uint32));
+				pos += sizeof(uint32);
+				if ((size_t)(end - pos) < namelen)
+					break;
+
+				// columns are matched by name and type, so a changed schema keeps what it can
+				for (size_t c = 0; c < table->columns.size(); c++)
+					if (table->columns[c].type == type && table->columns[c].name.compare (0, string::npos, pos, namelen) == 0)
+						current = c;
+
+				stored.push_back (current);
+				pos += namelen;
+			}
+		}
+	}
+
+	for (const auto& record : table->records.keys())
+	{
+		vector<table_value> row (table->columns.size());
+		bool ok = true;
+
+		if (record.first.empty() || !table->records.get (record.first, &data, &len))
+			continue;
+
+		const char* pos = data;
+		for (int current : stored)
+		{
+			table_value value;
+
+			if (!hjs_table_decodevalue (pos, data + len, value))
+			{
+				ok = false;
+				break;
+			}
+
+			if (current >= 0)
+				row[current] = value;
+		}
+
+		if (ok && row[table->key].type != 0)
+			hjs_table_insert (table, row);
+	}
+
+	if (!table->records.get ("", &data, &len) || schema.compare (0, string::npos, data, len) != 0)
+	{
+		set<string> current;
+		vector<string> stale;
+
+		// rows are rewritten in the new layout
+		table->records.put ("", schema.data(), schema.length());
+		for (const auto& row : table->rows)
+		{
+			string key, value;
+
+			hjs_table_encodevalue (key, row.first);
+			for (const table_value& field : row.second)
+				hjs_table_encodevalue (value, field);
+			table->records.put (key, value.data(), value.length());
+			current.insert (key);
+		}
+
+		// anything under another key is still in the old layout, e.g. when the key column changed
+		for (const auto& record : table->records.keys())
+			if (!record.first.empty() && !current.count (record.first))
+				stale.push_back (record.first);
+		for (const string& key : stale)
+			table->records.remove (key);
+
+		table->records.compact ();
+	}
+}
+
+static void
+hjs_table_finalize (JSContext *context, JSObject *obj)
+{
+	table_data* table = (table_data*)JS_GetPrivate (context, obj);
+
+	if (table == nullptr || --table->refs > 0)
+		return;
+
+	open_tables.erase (table->path);
+	table->records.sync ();
+	delete table;
+}
+
+static JSClass table_class = {"Table", JSCLASS_HAS_PRIVATE,
+    JS_PropertyStub, JS_PropertyStub, JS_PropertyStub, JS_StrictPropertyStub,
+    JS_EnumerateStub, JS_ResolveStub, JS_ConvertStub, hjs_table_finalize,
+    JSCLASS_NO_OPTIONAL_MEMBERS};
+
+static table_data*
+hjs_table_get (JSContext *context, jsval *vp)
+{
+	return (table_data*)JS_GetInstancePrivate (context, JS_THIS_OBJECT(context, vp), &table_class, nullptr);
+}
+
+static int
+hjs_table_column (table_data* table, const char* name)
+{
+	for (size_t i = 0; i < table->columns.size(); i++)
+		if (table->columns[i].name == name)
+			return i;
+
+	return -1;
+}
+
+static JSBool
+hjs_table_new (JSContext *context, unsigned argc, jsval *vp)
+{
+	js_script* script = hjs_script_find (context);
+	JSString* tablename;
+	JSObject* schema;
+	JSObject* columns;
+	JSObject* obj;
+	JSIdArray* ids;
+	table_data* table;
+	jsval val;
+	char* cstr;
+	string dir, path;
+
+	if (!JS_ConvertArguments (context, argc, JS_ARGV(context, vp), "So", &tablename, &schema))
+		return JS_FALSE;
+
+	if (schema == nullptr || !JS_GetProperty (context, schema, "columns", &val) || JSVAL_IS_PRIMITIVE(val))
+		return JS_FALSE;
+	columns = JSVAL_TO_OBJECT(val);
+
+	dir = string(hexchat_get_info (ph, "configdir")) + DIR_SEP + "javascript";
+	hjs_util_mkdir (dir);
+	dir = dir + DIR_SEP + "tables";
+	hjs_util_mkdir (dir);
+	dir = dir + DIR_SEP + hjs_prefs_canon (script != nullptr ? script->name : name);
+	hjs_util_mkdir (dir);
+
+	cstr = JSSTRING_TO_CHAR(tablename);
+	path = dir + DIR_SEP + hjs_prefs_canon (cstr) + ".tbl";
+	JS_free(context, cstr);
+
+	obj = JS_NewObjectForConstructor (context, vp);
+	if (obj == nullptr)
+		return JS_FALSE;
+
+	// a second Table for the same file shares the first one's rows and schema
+	auto found = open_tables.find (path);
+	if (found != open_tables.end())
 	{
-		JSObject* list_obj = JS_NewObject (context, &list_entry_class, nullptr, nullptr);
-		if (list_obj == nullptr)
-			goto listerr;
+		table = found->second;
+		table->refs++;
+		if (!JS_SetPrivate (context, obj, table))
+		{
+			table->refs--;
+			return JS_FALSE;
+		}
 
-		for (int i = 0; fields[i]; i++)
+		JS_SET_RVAL (context, vp, OBJECT_TO_JSVAL(obj));
+		return JS_TRUE;
+	}
+
+	table = new table_data;
+	table->refs = 1;
+	table->path = path;
+	table->key = 0;
+
+	if ((ids = JS_Enumerate (context, columns)) == nullptr)
+	{
+		delete table;
+		return JS_FALSE;
+	}
+
+	for (jsint i = 0; i < ids->length; i++)
+	{
+		table_column column;
+		jsval idval;
+		JSString* str;
+
+		if (!JS_IdToValue (context, ids->vector[i], &idval)
+			|| !JS_GetPropertyById (context, columns, ids->vector[i], &val)
+			|| (str = JS_ValueToString (context, idval)) == nullptr)
+			continue;
+
+		cstr = JSSTRING_TO_CHAR(str);
+		column.name = cstr;
+		JS_free(context, cstr);
+
+		// "int", "number", "string" or "bool", anything else is a string
+		column.type = 's';
+		if (JSVAL_IS_STRING(val))
 		{
-			field = fields[i]+1;
-			switch(fields[i][0])
+			cstr = JSSTRING_TO_CHAR(JSVAL_TO_STRING(val));
+			if (strcmp (cstr, "int") == 0 || strcmp (cstr, "number") == 0 || strcmp (cstr, "bool") == 0)
+				column.type = cstr[0];
+			JS_free(context, cstr);
+		}
+
+		table->columns.push_back (column);
+	}
+	JS_DestroyIdArray (context, ids);
+
+	if (table->columns.empty())
+	{
+		delete table;
+		return JS_FALSE;
+	}
+
+	// the primary key defaults to the first column
+	if (JS_GetProperty (context, schema, "key", &val) && JSVAL_IS_STRING(val))
+	{
+		cstr = JSSTRING_TO_CHAR(JSVAL_TO_STRING(val));
+		int key = hjs_table_column (table, cstr);
+		JS_free(context, cstr);
+
+		if (key < 0)
+		{
+			delete table;
+			return JS_FALSE;
+		}
+		table->key = key;
+	}
+
+	if (JS_GetProperty (context, schema, "indexes", &val) && !JSVAL_IS_PRIMITIVE(val))
+	{
+		JSObject* indexes = JSVAL_TO_OBJECT(val);
+		jsuint len;
+
+		if (JS_GetArrayLength (context, indexes, &len))
+		{
+			for (jsuint i = 0; i < len; i++)
 			{
-				case 's': // string
-					sattr = STRING_TO_JSVAL(JS_NewStringCopyZ (context, hexchat_list_str (ph, list, field)));
-					if (!JS_DefineProperty (context, list_obj, field, sattr,
-											nullptr, nullptr, JSPROP_READONLY|JSPROP_ENUMERATE))
-							goto listerr;
-					break;
+				JSString* str;
+				int column;
 
-				case 'i': // int
-					iattr = INT_TO_JSVAL(hexchat_list_int (ph, list, field));
-					if (!JS_DefineProperty (context, list_obj, field, iattr,
-										nullptr, nullptr, JSPROP_READONLY|JSPROP_ENUMERATE))
-							goto listerr;
-					break;
+				if (!JS_GetElement (context, indexes, i, &val) || (str = JS_ValueToString (context, val)) == nullptr)
+					continue;
 
-				case 't': // time
-					tattr = hjs_util_datefromtime (context, hexchat_list_time (ph, list, field));
-					if (!JS_DefineProperty (context, list_obj, field, tattr,
-										nullptr, nullptr, JSPROP_READONLY|JSPROP_ENUMERATE))
-							goto listerr;
-					break;
+				cstr = JSSTRING_TO_CHAR(str);
+				column = hjs_table_column (table, cstr);
+				JS_free(context, cstr);
 
-				case 'p': // pointer
-					if (!strcmp(field, "context"))
-					{
-						const char *ptr = hexchat_list_str (ph, list, field);
-						sattr = hjs_util_pointer_to_jsval (context, ptr);
-						if (!JS_DefineProperty (context, list_obj, field, sattr,
-										nullptr, nullptr, JSPROP_READONLY|JSPROP_ENUMERATE))
-							goto listerr;
-					}
-					// No other pointers exist atm and we couldn't handle them.
-					break;
+				if (column >= 0 && (size_t)column != table->key)
+					table->indexes[column];
 			}
 		}
-		JS_DefineElement (context, js_list, index, OBJECT_TO_JSVAL(list_obj), nullptr, nullptr,
-						JSPROP_READONLY|JSPROP_PERMANENT|JSPROP_ENUMERATE);
 	}
 
-	hexchat_list_free (ph, list);
+	hjs_table_load (table);
 
-	JS_SET_RVAL (context, vp, OBJECT_TO_JSVAL(js_list));
+	if (!JS_SetPrivate (context, obj, table))
+	{
+		delete table;
+		return JS_FALSE;
+	}
+	open_tables[path] = table;
+
+	JS_SET_RVAL (context, vp, OBJECT_TO_JSVAL(obj));
 
 	return JS_TRUE;
+}
 
-	listerr:
-		if (list)
-			hexchat_list_free (ph, list);
+static JSBool
+hjs_table_put (JSContext *context, unsigned argc, jsval *vp)
+{
+	table_data* table = hjs_table_get (context, vp);
+	JSObject* obj;
+	vector<table_value> row;
+	string key, value;
+	jsval val;
+
+	if (!JS_ConvertArguments (context, argc, JS_ARGV(context, vp), "o", &obj))
+		return JS_FALSE;
+
+	if (table == nullptr || obj == nullptr)
+		return JS_FALSE;
+
+	row.resize (table->columns.size());
+	for (size_t i = 0; i < table->columns.size(); i++)
+	{
+		if (!JS_GetProperty (context, obj, table->columns[i].name.c_str(), &val)
+			|| !hjs_table_fromjsval (context, val, table->columns[i].type, row[i]))
+			return JS_FALSE;
+	}
+
+	if (row[table->key].type == 0)
+	{
+		JS_SET_RVAL (context, vp, JSVAL_FALSE);
+		return JS_TRUE;
+	}
+
+	hjs_table_encodevalue (key, row[table->key]);
+	for (const table_value& field : row)
+		hjs_table_encodevalue (value, field);
+
+	if (!table->records.put (key, value.data(), value.length()))
+	{
+		JS_SET_RVAL (context, vp, JSVAL_FALSE);
+		return JS_TRUE;
+	}
+
+	hjs_table_insert (table, row);
+	hjs_store_schedule ();
+
+	JS_SET_RVAL (context, vp, JSVAL_TRUE);
+
+	return JS_TRUE;
+}
+
+static JSBool
+hjs_table_getrow (JSContext *context, unsigned argc, jsval *vp)
+{
+	table_data* table = hjs_table_get (context, vp);
+	table_value key;
+	JSObject* obj;
+
+	if (table == nullptr || argc < 1
+		|| !hjs_table_fromjsval (context, JS_ARGV(context, vp)[0], table->columns[table->key].type, key))
+		return JS_FALSE;
 
+	auto found = table->rows.find (key);
+	if (found == table->rows.end())
+	{
 		JS_SET_RVAL (context, vp, JSVAL_VOID);
+		return JS_TRUE;
+	}
+
+	if ((obj = hjs_table_rowobject (context, table, found->second)) == nullptr)
 		return JS_FALSE;
+
+	JS_SET_RVAL (context, vp, OBJECT_TO_JSVAL(obj));
+
+	return JS_TRUE;
 }
 
 static JSBool
-hjs_findcontext (JSContext *context, unsigned argc, jsval *vp)
+hjs_table_remove (JSContext *context, unsigned argc, jsval *vp)
 {
-	JSString* network = nullptr;
-	JSString* channel = nullptr;
-	char* cnetwork = nullptr;
-	char* cchannel = nullptr;
-	jsval ret;
-	hexchat_context* ctx;
+	table_data* table = hjs_table_get (context, vp);
+	table_value key;
+	string ckey;
 
-	if (!JS_ConvertArguments (context, argc, JS_ARGV(context, vp), "/SS", &network, &channel))
+	if (table == nullptr || argc < 1
+		|| !hjs_table_fromjsval (context, JS_ARGV(context, vp)[0], table->columns[table->key].type, key))
 		return JS_FALSE;
 
-	if (network && JS_GetStringLength(network))
-		cnetwork = JSSTRING_TO_CHAR(network);
-	if (channel && JS_GetStringLength(channel))
-		cchannel = JSSTRING_TO_CHAR(channel);
+	auto found = table->rows.find (key);
+	if (found == table->rows.end())
+	{
+		JS_SET_RVAL (context, vp, JSVAL_FALSE);
+		return JS_TRUE;
+	}
 
-	ctx = hexchat_find_context (ph, cnetwork, cchannel);
+	hjs_table_encodevalue (ckey, key);
+	table->records.remove (ckey);
+	hjs_table_unindex (table, found->second);
+	table->rows.erase (found);
+	hjs_store_schedule ();
 
-	if (cnetwork)
-		JS_free(context, cnetwork);
-	if (cchannel)
-		JS_free(context, cchannel);
+	JS_SET_RVAL (context, vp, JSVAL_TRUE);
 
-	if (!ctx)
-		JS_SET_RVAL (context, vp, JSVAL_NULL);
+	return JS_TRUE;
+}
+
+static JSBool
+hjs_table_size (JSContext *context, unsigned argc, jsval *vp)
+{
+	table_data* table = hjs_table_get (context, vp);
+	jsval val;
+
+	if (table == nullptr || !JS_NewNumberValue (context, table->rows.size(), &val))
+		return JS_FALSE;
+
+	JS_SET_RVAL (context, vp, val);
+
+	return JS_TRUE;
+}
+
+template <typename visitor>
+static void
+hjs_table_select (table_data* table, int column, const table_value& from, const table_value& to, visitor visit)
+{
+	// from and to are both inclusive, the key and indexed columns never look at rows outside them
+	if (column < 0)
+	{
+		for (const auto& row : table->rows)
+			if (!visit (row.second))
+				return;
+	}
+	else if ((size_t)column == table->key)
+	{
+		for (auto it = table->rows.lower_bound (from); it != table->rows.end() && !(to < it->first); ++it)
+			if (!visit (it->second))
+				return;
+	}
+	else if (table->indexes.count (column))
+	{
+		auto& index = table->indexes[column];
+		table_value lowest = { 0, 0, string() }; // null sorts before every key
+
+		for (auto it = index.lower_bound (make_pair (from, lowest)); it != index.end() && !(to < it->first); ++it)
+			if (!visit (table->rows.at (it->second)))
+				return;
+	}
 	else
 	{
-		ret = hjs_util_pointer_to_jsval (context, ctx);
-		JS_SET_RVAL (context, vp, ret);
+		for (const auto& row : table->rows)
+			if (!(row.second[column] < from) && !(to < row.second[column]) && !visit (row.second))
+				return;
 	}
+}
+
+static bool
+hjs_table_range (JSContext *context, table_data* table, unsigned argc, jsval *argv,
+				int* column, table_value& from, table_value& to)
+{
+	JSString* str;
+	char* cstr;
+
+	// (column, from[, to]), a missing end selects only from
+	*column = -1;
+	if (argc < 1 || JSVAL_IS_VOID(argv[0]) || JSVAL_IS_NULL(argv[0]))
+		return true;
+
+	if ((str = JS_ValueToString (context, argv[0])) == nullptr)
+		return false;
+
+	cstr = JSSTRING_TO_CHAR(str);
+	*column = hjs_table_column (table, cstr);
+	JS_free(context, cstr);
+
+	if (*column < 0 || argc < 2)
+		return false;
+
+	char type = table->columns[*column].type;
+	return hjs_table_fromjsval (context, argv[1], type, from)
+		&& hjs_table_fromjsval (context, argc > 2 ? argv[2] : argv[1], type, to);
+}
+
+static JSBool
+hjs_table_find (JSContext *context, unsigned argc, jsval *vp)
+{
+	table_data* table = hjs_table_get (context, vp);
+	jsval* argv = JS_ARGV(context, vp);
+	JSObject* rows;
+	table_value from, to;
+	int column;
+	int32 limit = -1;
+	jsint index = 0;
+	bool ok = true;
+
+	if (table == nullptr || !hjs_table_range (context, table, argc, argv, &column, from, to))
+		return JS_FALSE;
+
+	if (argc > 3 && !JS_ValueToECMAInt32 (context, argv[3], &limit))
+		return JS_FALSE;
+
+	if ((rows = JS_NewArrayObject (context, 0, nullptr)) == nullptr)
+		return JS_FALSE;
+
+	JS_SET_RVAL (context, vp, OBJECT_TO_JSVAL(rows));
+
+	hjs_table_select (table, column, from, to, [&](const vector<table_value>& row)
+	{
+		JSObject* obj = hjs_table_rowobject (context, table, row);
+		jsval val;
+
+		if (obj == nullptr)
+			return ok = false;
+
+		val = OBJECT_TO_JSVAL(obj);
+		if (!JS_SetElement (context, rows, index++, &val))
+			return ok = false;
+
+		return index != limit;
+	});
+
+	return ok;
+}
+
+static JSBool
+hjs_table_count (JSContext *context, unsigned argc, jsval *vp)
+{
+	table_data* table = hjs_table_get (context, vp);
+	table_value from, to;
+	int column;
+	double count = 0;
+	jsval val;
+
+	if (table == nullptr || !hjs_table_range (context, table, argc, JS_ARGV(context, vp), &column, from, to))
+		return JS_FALSE;
+
+	hjs_table_select (table, column, from, to, [&](const vector<table_value>&) { count++; return true; });
+
+	if (!JS_NewNumberValue (context, count, &val))
+		return JS_FALSE;
+
+	JS_SET_RVAL (context, vp, val);
 
 	return JS_TRUE;
 }
 
 static JSBool
-hjs_getcontext (JSContext *context, unsigned argc, jsval *vp)
+hjs_table_aggregate (JSContext *context, unsigned argc, jsval *vp)
 {
-	hexchat_context* ctx;
-	string ctxstr;
-	jsval ret;
+	table_data* table = hjs_table_get (context, vp);
+	JSObject* options;
+	JSObject* result;
+	vector<pair<int, double>> groups; // column and bucket size, 0 for none
+	map<vector<table_value>, pair<double, double>> totals; // count and accumulated value
+	table_value from, to;
+	string op = "count";
+	int column = -1;
+	int value = -1;
+	jsint index = 0;
+	jsval val;
+	char* cstr;
 
-	if (!JS_ConvertArguments (context, argc, JS_ARGV(context, vp), ""))
+	if (!JS_ConvertArguments (context, argc, JS_ARGV(context, vp), "o", &options))
 		return JS_FALSE;
 
-	ctx = hexchat_get_context (ph);
-	ret = hjs_util_pointer_to_jsval (context, ctx);
+	if (table == nullptr || options == nullptr)
+		return JS_FALSE;
 
-	JS_SET_RVAL(context, vp, ret);
+	// {where: [column, from, to], group: ["nick", {column: "time", bucket: 3600000}], op: "sum", value: "lines"}
+	if (JS_GetProperty (context, options, "where", &val) && !JSVAL_IS_PRIMITIVE(val))
+	{
+		JSObject* where = JSVAL_TO_OBJECT(val);
+		jsval range[3];
+		jsuint len;
+
+		if (!JS_GetArrayLength (context, where, &len) || len > 3)
+			return JS_FALSE;
+		for (jsuint i = 0; i < len; i++)
+			if (!JS_GetElement (context, where, i, &range[i]))
+				return JS_FALSE;
+
+		if (!hjs_table_range (context, table, len, range, &column, from, to))
+			return JS_FALSE;
+	}
+
+	if (JS_GetProperty (context, options, "group", &val) && !JSVAL_IS_PRIMITIVE(val))
+	{
+		JSObject* group = JSVAL_TO_OBJECT(val);
+		jsuint len;
+
+		if (!JS_GetArrayLength (context, group, &len))
+			return JS_FALSE;
+
+		for (jsuint i = 0; i < len; i++)
+		{
+			double bucket = 0;
+			JSString* str;
+			jsval entry;
+
+			if (!JS_GetElement (context, group, i, &entry))
+				return JS_FALSE;
+
+			if (!JSVAL_IS_PRIMITIVE(entry))
+			{
+				if (!JS_GetProperty (context, JSVAL_TO_OBJECT(entry), "bucket", &val)
+					|| (!JSVAL_IS_VOID(val) && !JS_ValueToNumber (context, val, &bucket))
+					|| !JS_GetProperty (context, JSVAL_TO_OBJECT(entry), "column", &entry))
+					return JS_FALSE;
+			}
+
+			if ((str = JS_ValueToString (context, entry)) == nullptr)
+				return JS_FALSE;
+
+			cstr = JSSTRING_TO_CHAR(str);
+			groups.push_back (make_pair (hjs_table_column (table, cstr), bucket > 0 ? bucket : 0));
+			JS_free(context, cstr);
+
+			if (groups.back().first < 0)
+				return JS_FALSE;
+		}
+	}
+
+	if (JS_GetProperty (context, options, "op", &val) && JSVAL_IS_STRING(val))
+	{
+		cstr = JSSTRING_TO_CHAR(JSVAL_TO_STRING(val));
+		op = cstr;
+		JS_free(context, cstr);
+
+		if (op != "count" && op != "sum" && op != "min" && op != "max" && op != "avg")
+			return JS_FALSE;
+	}
+
+	if (op != "count")
+	{
+		if (!JS_GetProperty (context, options, "value", &val) || !JSVAL_IS_STRING(val))
+			return JS_FALSE;
+
+		cstr = JSSTRING_TO_CHAR(JSVAL_TO_STRING(val));
+		value = hjs_table_column (table, cstr);
+		JS_free(context, cstr);
 
-	return JS_TRUE;
-}
+		if (value < 0)
+			return JS_FALSE;
+	}
 
-static JSBool
-hjs_setcontext (JSContext *context, unsigned argc, jsval *vp)
-{
-	unsigned long long ctxaddr;
-	JSString *ctxstr;
-	char *ctxcstr;
-	hexchat_context* ctx;
+	hjs_table_select (table, column, from, to, [&](const vector<table_value>& row)
+	{
+		vector<table_value> key;
 
-	if (!JS_ConvertArguments (context, argc, JS_ARGV(context, vp), "S", &ctxstr))
-		return JS_FALSE;
+		// nulls are left out of sum, min, max and avg like in SQL
+		if (value >= 0 && row[value].type != 'n' && row[value].type != 'b')
+			return true;
 
-	ctxcstr = JSSTRING_TO_CHAR(ctxstr);
-	ctxaddr = strtoull(ctxcstr, NULL, 10);
-	ctx = (hexchat_context*)ctxaddr;
-	JS_free (context, ctxcstr);
+		for (const auto& group : groups)
+		{
+			key.push_back (row[group.first]);
+			if (group.second > 0 && key.back().type == 'n')
+				key.back().num = floor (key.back().num / group.second) * group.second;
+		}
 
-	if (hexchat_set_context (ph, ctx))
-		JS_SET_RVAL (context, vp, JSVAL_TRUE);
-	else
-		JS_SET_RVAL (context, vp, JSVAL_FALSE);
+		auto total = totals.find (key);
+		double num = value >= 0 ? row[value].num : 0;
 
-	return JS_TRUE;
-}
+		if (total == totals.end())
+			totals.insert (make_pair (key, make_pair (1.0, num)));
+		else
+		{
+			total->second.first++;
+			if (op == "min")
+				total->second.second = min (total->second.second, num);
+			else if (op == "max")
+				total->second.second = max (total->second.second, num);
+			else
+				total->second.second += num;
+		}
 
-static JSBool
-hjs_hookcmd (JSContext *context, unsigned argc, jsval *vp)
-{
-	JSString* cmdstr;
-	JSString* helpstr = nullptr;
-	JSObject* funcobj;
-	JSObject* userdata = nullptr;
-	jsval ret;
-	char* chelpstr = nullptr;
-	char* ccmdstr;
-	int pri = HEXCHAT_PRI_NORM;
-	hexchat_hook* hexhook;
-	script_hook* hook;
-	js_script* script = hjs_script_find (context);
+		return true;
+	});
 
-	// these are slightly out of normal order, does jsapi have kwargs?
-	if (!JS_ConvertArguments (context, argc, JS_ARGV(context, vp), "So/Soi",
-							&cmdstr, &funcobj, &helpstr, &userdata, &pri))
+	if ((result = JS_NewArrayObject (context, 0, nullptr)) == nullptr)
 		return JS_FALSE;
 
-	if (!JS_ObjectIsFunction (context, funcobj))
-		return JS_FALSE;
+	JS_SET_RVAL (context, vp, OBJECT_TO_JSVAL(result));
 
-	ccmdstr = JSSTRING_TO_CHAR(cmdstr);
-	if (helpstr)
-		chelpstr = JSSTRING_TO_CHAR(helpstr);
+	for (const auto& total : totals)
+	{
+		JSObject* obj = JS_NewObject (context, nullptr, nullptr, nullptr);
+		double num = total.second.second;
 
-	hook = new script_hook;
-	hexhook = hexchat_hook_command (ph, ccmdstr, pri, hjs_callback, helpstr ? chelpstr : "", hook);
+		if (obj == nullptr)
+			return JS_FALSE;
 
-	JS_free(context, ccmdstr);
-	if (chelpstr)
-		JS_free(context, chelpstr);
+		for (size_t i = 0; i < groups.size(); i++)
+			if (!JS_DefineProperty (context, obj, table->columns[groups[i].first].name.c_str(),
+									hjs_table_tojsval (context, total.first[i]), nullptr, nullptr, JSPROP_ENUMERATE))
+				return JS_FALSE;
 
-	script->add_hook (hook, HOOK_CMD, context, funcobj, userdata, hexhook);
+		if (op == "count")
+			num = total.second.first;
+		else if (op == "avg")
+			num /= total.second.first;
 
-	if (!JS_NewNumberValue(context, (long)hexhook, &ret))
-		JS_SET_RVAL (context, vp, JSVAL_VOID);
-	else
-		JS_SET_RVAL (context, vp, ret);
+		if (!JS_NewNumberValue (context, num, &val)
+			|| !JS_DefineProperty (context, obj, op.c_str(), val, nullptr, nullptr, JSPROP_ENUMERATE))
+			return JS_FALSE;
+
+		val = OBJECT_TO_JSVAL(obj);
+		if (!JS_SetElement (context, result, index++, &val))
+			return JS_FALSE;
+	}
 
 	return JS_TRUE;
 }
 
-static JSBool
-hjs_hookprint (JSContext *context, unsigned argc, jsval *vp)
-{
-	JSString* event;
-	JSObject* funcobj;
-	JSObject* userdata = nullptr;
-	jsval ret;
-	char* cevent;
-	int pri = HEXCHAT_PRI_NORM;
-	hexchat_hook* hexhook;
-	script_hook* hook;
-	js_script* script = hjs_script_find (context);
+static JSFunctionSpec table_methods[] = {
+	{"put", hjs_table_put, 1, JSPROP_READONLY|JSPROP_PERMANENT},
+	{"get", hjs_table_getrow, 1, JSPROP_READONLY|JSPROP_PERMANENT},
+	{"remove", hjs_table_remove, 1, JSPROP_READONLY|JSPROP_PERMANENT},
+	{"size", hjs_table_size, 0, JSPROP_READONLY|JSPROP_PERMANENT},
+	{"find", hjs_table_find, 2, JSPROP_READONLY|JSPROP_PERMANENT},
+	{"count", hjs_table_count, 0, JSPROP_READONLY|JSPROP_PERMANENT},
+	{"aggregate", hjs_table_aggregate, 1, JSPROP_READONLY|JSPROP_PERMANENT},
+	{0, 0, 0, 0}
+};
 
-	if (!JS_ConvertArguments (context, argc, JS_ARGV(context, vp), "So/oi",
-							&event, &funcobj, &userdata, &pri))
-		return JS_FALSE;
+/* Cache */
 
-	if (!JS_ObjectIsFunction (context, funcobj))
-		return JS_FALSE;
+static void
+hjs_cache_erase (list<cache_entry>::iterator entry)
+{
+	entry->owner->entries.erase (entry->key);
+	entry->owner->bytes -= entry->size;
+	cache_used -= entry->size;
+	cache_lru.erase (entry);
+}
 
-	cevent = JSSTRING_TO_CHAR(event);
-	hook = new script_hook;
-	hexhook = hexchat_hook_print_attrs (ph, cevent, pri, hjs_callback, hook);
-	JS_free(context, cevent);
+static void
+hjs_cache_trim ()
+{
+	// the least recently used entry of any script goes first
+	while (cache_used > cache_budget && !cache_lru.empty())
+	{
+		cache_lru.back().owner->evictions++;
+		hjs_cache_erase (--cache_lru.end());
+	}
+}
 
-	script->add_hook (hook, HOOK_PRINT, context, funcobj, userdata, hexhook);
+static bool
+hjs_cache_fromjsval (JSContext *context, jsval val, cache_entry& entry)
+{
+	const jschar* chars;
+	uint64* data;
+	size_t len;
 
-	if (!JS_NewNumberValue(context, (long)hexhook, &ret))
-		JS_SET_RVAL (context, vp, JSVAL_VOID);
+	entry.num = 0;
+
+	if (JSVAL_IS_VOID(val))
+		entry.type = 'u';
+	else if (JSVAL_IS_NULL(val))
+		entry.type = 'z';
+	else if (JSVAL_IS_BOOLEAN(val))
+	{
+		entry.type = 'b';
+		entry.num = JSVAL_TO_BOOLEAN(val);
+	}
+	else if (JSVAL_IS_NUMBER(val))
+	{
+		entry.type = 'n';
+		if (!JS_ValueToNumber (context, val, &entry.num))
+			return false;
+	}
+	else if (JSVAL_IS_STRING(val))
+	{
+		entry.type = 's';
+		if ((chars = JS_GetStringCharsAndLength (context, JSVAL_TO_STRING(val), &len)) == nullptr)
+			return false;
+		entry.str.assign (chars, len);
+	}
 	else
-		JS_SET_RVAL (context, vp, ret);
+	{
+		// objects live outside the JS heap as structured clone data, each get makes a fresh copy
+		entry.type = 'c';
+		if (!JS_WriteStructuredClone (context, val, &data, &len, nullptr, nullptr))
+			return false;
+		entry.clone.assign (data, data + len / sizeof(uint64));
+		free (data);
+	}
 
-	return JS_TRUE;
+	entry.size = sizeof(cache_entry) + 2 * entry.key.length() + entry.str.length() * sizeof(jschar)
+				+ entry.clone.size() * sizeof(uint64);
+
+	return true;
 }
 
-static JSBool
-hjs_hookspecial (JSContext *context, unsigned argc, jsval *vp)
+static bool
+hjs_cache_tojsval (JSContext *context, const cache_entry& entry, jsval* val)
 {
-	JSString* event;
-	JSObject* funcobj;
-	JSObject* userdata = nullptr;
-	jsval ret;
-	char* cevent;
-	int pri = HEXCHAT_PRI_NORM;
-	hexchat_hook* hexhook;
-	script_hook* hook;
-	js_script* script = hjs_script_find (context);
+	switch (entry.type)
+	{
+	case 'u':
+		*val = JSVAL_VOID;
+		return true;
+	case 'z':
+		*val = JSVAL_NULL;
+		return true;
+	case 'b':
+		*val = BOOLEAN_TO_JSVAL(entry.num != 0);
+		return true;
+	case 'n':
+		return JS_NewNumberValue (context, entry.num, val);
+	case 's':
+		*val = STRING_TO_JSVAL(JS_NewUCStringCopyN (context, entry.str.data(), entry.str.length()));
+		return true;
+	default:
+		return JS_ReadStructuredClone (context, entry.clone.data(), entry.clone.size() * sizeof(uint64),
+										val, nullptr, nullptr);
+	}
+}
 
-	if (!JS_ConvertArguments (context, argc, JS_ARGV(context, vp), "So/oi",
-							&event, &funcobj, &userdata, &pri))
-		return JS_FALSE;
+static bool
+hjs_cache_set (JSContext *context, cache_data* cache, const string& key, jsval val, double ttl)
+{
+	cache_entry entry;
 
-	if (!JS_ObjectIsFunction (context, funcobj))
-		return JS_FALSE;
+	entry.owner = cache;
+	entry.key = key;
+	entry.expires = chrono::steady_clock::time_point::max();
+	// also rules out NaN and Infinity, which do not fit in a duration
+	if (ttl > 0 && ttl <= cache_max_ttl)
+		entry.expires = chrono::steady_clock::now() + chrono::milliseconds((long long)ttl);
 
-	/* This is technically the same as hook_print except that hook_print_attrs won't work with
-	 * the "special" hooks, so to avoid confusion or adding another hook_print for attrs
-	 * just create a new function hook_special */
-	hook = new script_hook;
-	cevent = JSSTRING_TO_CHAR(event);
-	hexhook = hexchat_hook_print (ph, cevent, pri, hjs_callback, hook);
-	JS_free(context, cevent);
+	if (!hjs_cache_fromjsval (context, val, entry))
+		return false;
 
-	script->add_hook (hook, HOOK_PRINT, context, funcobj, userdata, hexhook);
+	auto found = cache->entries.find (key);
+	if (found != cache->entries.end())
+		hjs_cache_erase (found->second);
 
-	if (!JS_NewNumberValue(context, (long)hexhook, &ret))
-		JS_SET_RVAL (context, vp, JSVAL_VOID);
-	else
-		JS_SET_RVAL (context, vp, ret);
+	cache_lru.push_front (entry);
+	cache->entries[key] = cache_lru.begin();
+	cache->bytes += entry.size;
+	cache_used += entry.size;
 
-	return JS_TRUE;
+	hjs_cache_trim ();
+
+	return true;
 }
 
-static JSBool
-hjs_hookserver (JSContext *context, unsigned argc, jsval *vp)
+static void
+hjs_cache_finalize (JSContext *context, JSObject *obj)
 {
-	JSString* serverstr;
-	JSObject* funcobj;
-	JSObject* userdata = nullptr;
-	jsval ret;
-	char* cserverstr;
-	int pri = HEXCHAT_PRI_NORM;
-	hexchat_hook* hexhook;
-	script_hook* hook;
-	js_script* script = hjs_script_find (context);
+	cache_data* cache = (cache_data*)JS_GetPrivate (context, obj);
 
-	if (!JS_ConvertArguments (context, argc, JS_ARGV(context, vp), "So/oi",
-							&serverstr, &funcobj, &userdata, &pri))
-		return JS_FALSE;
+	if (cache == nullptr)
+		return;
 
-	if (!JS_ObjectIsFunction (context, funcobj))
-		return JS_FALSE;
+	while (!cache->entries.empty())
+		hjs_cache_erase (cache->entries.begin()->second);
 
-	hook = new script_hook;
-	cserverstr = JSSTRING_TO_CHAR(serverstr);
-	hexhook = hexchat_hook_server_attrs (ph, cserverstr, pri, hjs_callback, hook);
-	JS_free(context, cserverstr);
+	delete cache;
+}
 
-	script->add_hook (hook, HOOK_SERVER, context, funcobj, userdata, hexhook);
+static JSClass cache_class = {"Cache", JSCLASS_HAS_PRIVATE,
+    JS_PropertyStub, JS_PropertyStub, JS_PropertyStub, JS_StrictPropertyStub,
+    JS_EnumerateStub, JS_ResolveStub, JS_ConvertStub, hjs_cache_finalize,
+    JSCLASS_NO_OPTIONAL_MEMBERS};
 
-	if (!JS_NewNumberValue(context, (long)hexhook, &ret))
-		JS_SET_RVAL (context, vp, JSVAL_VOID);
-	else
-		JS_SET_RVAL (context, vp, ret);
+static cache_data*
+hjs_cache_get (JSContext *context, unsigned argc, jsval *vp, string* key)
+{
+	cache_data* cache = (cache_data*)JS_GetInstancePrivate (context, JS_THIS_OBJECT(context, vp), &cache_class, nullptr);
+	JSString* str;
+	char* cstr;
 
-	return JS_TRUE;
+	if (cache == nullptr || key == nullptr)
+		return cache;
+
+	if (argc < 1 || (str = JS_ValueToString (context, JS_ARGV(context, vp)[0])) == nullptr)
+		return nullptr;
+
+	cstr = JSSTRING_TO_CHAR(str);
+	*key = cstr;
+	JS_free(context, cstr);
+
+	return cache;
 }
 
 static JSBool
-hjs_hooktimer (JSContext *context, unsigned argc, jsval *vp)
+hjs_cache_new (JSContext *context, unsigned argc, jsval *vp)
 {
-	JSObject* funcobj;
-	JSObject* userdata = nullptr;
-	jsval ret;
-	int timeout;
-	hexchat_hook* hexhook;
-	script_hook* hook;
-	js_script* script = hjs_script_find (context);
+	JSObject* options = nullptr;
+	JSObject* obj;
+	cache_data* cache;
+	jsval val;
 
-	if (!JS_ConvertArguments (context, argc, JS_ARGV(context, vp), "io/o",
-							&timeout, &funcobj, &userdata))
+	if (!JS_ConvertArguments (context, argc, JS_ARGV(context, vp), "/o", &options))
 		return JS_FALSE;
 
-	if (!JS_ObjectIsFunction (context, funcobj))
+	obj = JS_NewObjectForConstructor (context, vp);
+	if (obj == nullptr)
 		return JS_FALSE;
 
-	hook = new script_hook;
-	hexhook = hexchat_hook_timer (ph, timeout, hjs_callback, hook);
+	cache = new cache_data;
+	cache->ttl = 0;
+	cache->hits = cache->misses = cache->evictions = cache->expirations = 0;
+	cache->bytes = 0;
 
-	script->add_hook (hook, HOOK_TIMER, context, funcobj, userdata, hexhook);
+	// {ttl: ms} is the default lifetime of entries, they never expire without it
+	if (options != nullptr && JS_GetProperty (context, options, "ttl", &val) && !JSVAL_IS_VOID(val)
+		&& !JS_ValueToNumber (context, val, &cache->ttl))
+	{
+		delete cache;
+		return JS_FALSE;
+	}
 
-	if (!JS_NewNumberValue(context, (long)hexhook, &ret))
-		JS_SET_RVAL (context, vp, JSVAL_VOID);
-	else
-		JS_SET_RVAL (context, vp, ret);
+	if (!JS_SetPrivate (context, obj, cache))
+	{
+		delete cache;
+		return JS_FALSE;
+	}
+
+	JS_SET_RVAL (context, vp, OBJECT_TO_JSVAL(obj));
 
 	return JS_TRUE;
 }
 
 static JSBool
-hjs_hookunload (JSContext *context, unsigned argc, jsval *vp)
+hjs_cache_getvalue (JSContext *context, unsigned argc, jsval *vp)
 {
-	JSObject* funcobj;
-	JSObject* userdata = nullptr;
-	script_hook* hook;
-	js_script* script = hjs_script_find (context);
+	jsval* argv = JS_ARGV(context, vp);
+	string key;
+	cache_data* cache = hjs_cache_get (context, argc, vp, &key);
+	jsval val = JSVAL_VOID;
 
-	if (!JS_ConvertArguments (context, argc, JS_ARGV(context, vp), "o/o", &funcobj, &userdata))
+	if (cache == nullptr)
 		return JS_FALSE;
 
-	hook = new script_hook;
-	script->add_hook (hook, HOOK_UNLOAD, context, funcobj, userdata, nullptr);
-
-	JS_SET_RVAL (context, vp, JSVAL_VOID);
-
-	return JS_TRUE;
-}
+	auto found = cache->entries.find (key);
+	if (found != cache->entries.end() && found->second->expires <= chrono::steady_clock::now())
+	{
+		cache->expirations++;
+		hjs_cache_erase (found->second);
+		found = cache->entries.end();
+	}
 
-static JSBool
-hjs_unhook (JSContext *context, unsigned argc, jsval *vp)
-{
-	long hooknum;
-	js_script* script;
-	script_hook* hook;
-	hexchat_hook* hexhook;
+	if (found != cache->entries.end())
+	{
+		cache->hits++;
+		cache_lru.splice (cache_lru.begin(), cache_lru, found->second);
 
-	if (!JS_ConvertArguments (context, argc, JS_ARGV(context, vp), "u", &hooknum))
-		return JS_FALSE;
+		if (!hjs_cache_tojsval (context, *found->second, &val))
+			return JS_FALSE;
 
-	hexhook = (hexchat_hook*)hooknum;
-	// unhook returns your original userdata
-	hook =  (script_hook*)hexchat_unhook (ph, hexhook);
+		JS_SET_RVAL (context, vp, val);
+		return JS_TRUE;
+	}
 
-	script = hjs_script_find (context);
-	script->remove_hook (hook);
+	cache->misses++;
 
+	// get(key, compute) memoizes whatever compute(key) returns
+	if (argc > 1 && !JSVAL_IS_PRIMITIVE(argv[1]) && JS_ObjectIsFunction (context, JSVAL_TO_OBJECT(argv[1])))
+	{
+		if (!JS_CallFunctionValue (context, JS_GetGlobalForScopeChain (context), argv[1], 1, argv, &val)
+			|| !hjs_cache_set (context, cache, key, val, cache->ttl))
+			return JS_FALSE;
+	}
 
-	JS_SET_RVAL (context, vp, JSVAL_VOID);
+	JS_SET_RVAL (context, vp, val);
 
 	return JS_TRUE;
 }
 
 static JSBool
-hjs_setpluginpref (JSContext *context, unsigned argc, jsval *vp)
+hjs_cache_setvalue (JSContext *context, unsigned argc, jsval *vp)
 {
-	hexchat_plugin* prefph = hjs_script_gethandle (context); // fake handle to save to own conf file
-	JSString* var;
-	JSString* val;
-	char* cvar;
-	char* cval;
-	int ret;
+	jsval* argv = JS_ARGV(context, vp);
+	string key;
+	cache_data* cache = hjs_cache_get (context, argc, vp, &key);
+	double ttl;
 
-	if (!JS_ConvertArguments (context, argc, JS_ARGV(context, vp), "SS", &var, &val))
+	if (cache == nullptr || argc < 2)
 		return JS_FALSE;
 
-	cvar = JSSTRING_TO_CHAR(var);
-	cval = JSSTRING_TO_CHAR(val);
-
-	// it is always stored as a string anyway.
-	ret = hexchat_pluginpref_set_str (prefph, cvar, cval);
+	ttl = cache->ttl;
+	if (argc > 2 && !JSVAL_IS_VOID(argv[2]) && !JS_ValueToNumber (context, argv[2], &ttl))
+		return JS_FALSE;
 
-	JS_free(context, cvar);
-	JS_free(context, cval);
+	if (!hjs_cache_set (context, cache, key, argv[1], ttl))
+		return JS_FALSE;
 
-	JS_SET_RVAL (context, vp, BOOLEAN_TO_JSVAL(ret));
+	JS_SET_RVAL (context, vp, JSVAL_VOID);
 
 	return JS_TRUE;
 }
 
 static JSBool
-hjs_delpluginpref (JSContext *context, unsigned argc, jsval *vp)
+hjs_cache_has (JSContext *context, unsigned argc, jsval *vp)
 {
-	hexchat_plugin* prefph = hjs_script_gethandle (context);
-	JSString* var;
-	char* cvar;
-	int ret;
+	string key;
+	cache_data* cache = hjs_cache_get (context, argc, vp, &key);
 
-	if (!JS_ConvertArguments (context, argc, JS_ARGV(context, vp), "S", &var))
+	if (cache == nullptr)
 		return JS_FALSE;
 
-	cvar = JSSTRING_TO_CHAR(var);
-	ret = hexchat_pluginpref_delete (prefph, cvar);
-	JS_free(context, cvar);
+	auto found = cache->entries.find (key);
 
-	JS_SET_RVAL (context, vp, BOOLEAN_TO_JSVAL(ret));
+	// no hit or miss counted, and the entry doesn't become more recent
+	JS_SET_RVAL (context, vp, BOOLEAN_TO_JSVAL(found != cache->entries.end()
+												&& found->second->expires > chrono::steady_clock::now()));
 
 	return JS_TRUE;
 }
 
 static JSBool
-hjs_listpluginpref (JSContext *context, unsigned argc, jsval *vp)
+hjs_cache_remove (JSContext *context, unsigned argc, jsval *vp)
 {
-	hexchat_plugin* prefph = hjs_script_gethandle (context);
-	JSObject* js_list;
-	JSString* list_item;
-	jsuint list_len;
-	char list[4096];
-	char* token;
-	int result;
-	int index = 0;
+	string key;
+	cache_data* cache = hjs_cache_get (context, argc, vp, &key);
 
-	if (!JS_ConvertArguments (context, argc, JS_ARGV(context, vp), ""))
+	if (cache == nullptr)
 		return JS_FALSE;
 
-	js_list = JS_NewArrayObject (context, 0, nullptr);
-	if (js_list == nullptr)
-	{
-		JS_SET_RVAL (context, vp, JSVAL_VOID);
-		return JS_FALSE;
-	}
+	auto found = cache->entries.find (key);
+	if (found != cache->entries.end())
+		hjs_cache_erase (found->second);
 
-	result = hexchat_pluginpref_list (prefph, list);
-	if (result)
-	{
-		token = strtok (list, ",");
-		while (token != nullptr)
-		{
-			list_item = JS_NewStringCopyZ (context, token);
-			JS_DefineElement (context, js_list, index, STRING_TO_JSVAL(list_item), nullptr, nullptr,
-							JSPROP_READONLY|JSPROP_PERMANENT|JSPROP_ENUMERATE);
+	JS_SET_RVAL (context, vp, BOOLEAN_TO_JSVAL(found != cache->entries.end()));
 
-			token = strtok (nullptr, ",");
-			index++;
-		}
-	}
+	return JS_TRUE;
+}
 
-	JS_GetArrayLength (context, js_list, &list_len);
-	if (list_len)
-		JS_SET_RVAL (context, vp, OBJECT_TO_JSVAL(js_list));
-	else
-		JS_SET_RVAL (context, vp, JSVAL_NULL);
+static JSBool
+hjs_cache_clear (JSContext *context, unsigned argc, jsval *vp)
+{
+	cache_data* cache = hjs_cache_get (context, argc, vp, nullptr);
+
+	if (cache == nullptr)
+		return JS_FALSE;
+
+	while (!cache->entries.empty())
+		hjs_cache_erase (cache->entries.begin()->second);
+
+	JS_SET_RVAL (context, vp, JSVAL_VOID);
 
 	return JS_TRUE;
 }
 
 static JSBool
-hjs_getpluginpref (JSContext *context, unsigned argc, jsval *vp)
+hjs_cache_size (JSContext *context, unsigned argc, jsval *vp)
 {
-	hexchat_plugin* prefph = hjs_script_gethandle (context);
-	JSString* var;
-	JSString* retstr;
-	char* cvar;
-	char cretstr[512];
-	int cret, cretint;
+	cache_data* cache = hjs_cache_get (context, argc, vp, nullptr);
 
-	if (!JS_ConvertArguments (context, argc, JS_ARGV(context, vp), "S", &var))
+	if (cache == nullptr)
 		return JS_FALSE;
 
-	cvar = JSSTRING_TO_CHAR(var);
-	cret = hexchat_pluginpref_get_str (prefph, JSSTRING_TO_CHAR(var), cretstr);
-	JS_free(context, cvar);
+	JS_SET_RVAL (context, vp, INT_TO_JSVAL(cache->entries.size()));
 
-	if (cret)
-	{
-		if (strlen (cretstr) <= 12)
-		{
-			cvar = JSSTRING_TO_CHAR(var);
-			cretint = hexchat_pluginpref_get_int (prefph, cvar);
-			JS_free(context, cvar);
+	return JS_TRUE;
+}
 
-			if ((cretint == -1) && (strcmp(cretstr, "-1") != 0))
-			{
-				// Failed to make int and string is not "0", its a string.
-				retstr = JS_NewStringCopyZ (context, cretstr);
-				JS_SET_RVAL (context, vp, STRING_TO_JSVAL(retstr));
-			}
-			else
-			{
-				// Must be an int
-				JS_SET_RVAL (context, vp, INT_TO_JSVAL(cretint));
-			}
-		}
-		else
-		{
-			// It won't store ints this large
-			retstr = JS_NewStringCopyZ (context, cretstr);
-			JS_SET_RVAL (context, vp, STRING_TO_JSVAL(retstr));
-		}
-	}
-	else
-	{
-		// Failed
-		JS_SET_RVAL (context, vp, JSVAL_VOID);
-	}
+static JSBool
+hjs_cache_stats (JSContext *context, unsigned argc, jsval *vp)
+{
+	cache_data* cache = hjs_cache_get (context, argc, vp, nullptr);
+	JSObject* ret;
+	jsval val;
 
+	if (cache == nullptr || (ret = JS_NewObject (context, nullptr, nullptr, nullptr)) == nullptr)
+		return JS_FALSE;
+
+	JS_SET_RVAL (context, vp, OBJECT_TO_JSVAL(ret));
+
+	// budget and used are shared by every cache of every script
+	if (!JS_NewNumberValue (context, cache->hits, &val)
+		|| !JS_DefineProperty (context, ret, "hits", val, nullptr, nullptr, JSPROP_READONLY|JSPROP_ENUMERATE)
+		|| !JS_NewNumberValue (context, cache->misses, &val)
+		|| !JS_DefineProperty (context, ret, "misses", val, nullptr, nullptr, JSPROP_READONLY|JSPROP_ENUMERATE)
+		|| !JS_NewNumberValue (context, cache->evictions, &val)
+		|| !JS_DefineProperty (context, ret, "evictions", val, nullptr, nullptr, JSPROP_READONLY|JSPROP_ENUMERATE)
+		|| !JS_NewNumberValue (context, cache->expirations, &val)
+		|| !JS_DefineProperty (context, ret, "expirations", val, nullptr, nullptr, JSPROP_READONLY|JSPROP_ENUMERATE)
+		|| !JS_DefineProperty (context, ret, "entries", INT_TO_JSVAL(cache->entries.size()), nullptr, nullptr,
+								JSPROP_READONLY|JSPROP_ENUMERATE)
+		|| !JS_NewNumberValue (context, cache->bytes, &val)
+		|| !JS_DefineProperty (context, ret, "bytes", val, nullptr, nullptr, JSPROP_READONLY|JSPROP_ENUMERATE)
+		|| !JS_NewNumberValue (context, cache_used, &val)
+		|| !JS_DefineProperty (context, ret, "used", val, nullptr, nullptr, JSPROP_READONLY|JSPROP_ENUMERATE)
+		|| !JS_NewNumberValue (context, cache_budget, &val)
+		|| !JS_DefineProperty (context, ret, "budget", val, nullptr, nullptr, JSPROP_READONLY|JSPROP_ENUMERATE))
+		return JS_FALSE;
 
 	return JS_TRUE;
 }
 
-/* Convenience functions */
-
 static JSBool
-hjs_getnickcolor (JSContext *context, unsigned argc, jsval *vp)
+hjs_setcachebudget (JSContext *context, unsigned argc, jsval *vp)
 {
-	int colors[] = {19, 20, 22, 24, 25, 26, 27, 28, 29};
-	JSString* nick;
-	char* cnick;
-	int i = 0, sum = 0, color;
+	double budget;
 
-	if (!JS_ConvertArguments (context, argc, JS_ARGV(context, vp), "S", &nick))
+	if (!JS_ConvertArguments (context, argc, JS_ARGV(context, vp), "d", &budget))
 		return JS_FALSE;
 
-	cnick = JSSTRING_TO_CHAR(nick);
-
-	while (cnick[i])
-		sum += cnick[i++];
-	sum %= sizeof(colors) / sizeof(int);
-	color = colors[sum];
+	if (budget < 0)
+		return JS_FALSE;
 
-	JS_free (context, cnick);
+	cache_budget = (size_t)budget;
+	hjs_cache_trim ();
 
-	JS_SET_RVAL(context, vp, INT_TO_JSVAL(color));
+	JS_SET_RVAL (context, vp, JSVAL_VOID);
 
 	return JS_TRUE;
 }
 
+static JSFunctionSpec cache_methods[] = {
+	{"get", hjs_cache_getvalue, 2, JSPROP_READONLY|JSPROP_PERMANENT},
+	{"set", hjs_cache_setvalue, 3, JSPROP_READONLY|JSPROP_PERMANENT},
+	{"has", hjs_cache_has, 1, JSPROP_READONLY|JSPROP_PERMANENT},
+	{"remove", hjs_cache_remove, 1, JSPROP_READONLY|JSPROP_PERMANENT},
+	{"clear", hjs_cache_clear, 0, JSPROP_READONLY|JSPROP_PERMANENT},
+	{"size", hjs_cache_size, 0, JSPROP_READONLY|JSPROP_PERMANENT},
+	{"stats", hjs_cache_stats, 0, JSPROP_READONLY|JSPROP_PERMANENT},
+	{0, 0, 0, 0}
+};
+
 static JSFunctionSpec hexchat_functions[] = {
 	{"print", hjs_print, 1, JSPROP_READONLY|JSPROP_PERMANENT},
+	{"print_lines", hjs_printlines, 1, JSPROP_READONLY|JSPROP_PERMANENT},
+	{"print_stream", hjs_printstream, 1, JSPROP_READONLY|JSPROP_PERMANENT},
+	{"stream_pending", hjs_streampending, 0, JSPROP_READONLY|JSPROP_PERMANENT},
+	{"buffer_prints", hjs_bufferprints, 1, JSPROP_READONLY|JSPROP_PERMANENT},
+	{"flush_prints", hjs_flushprints, 0, JSPROP_READONLY|JSPROP_PERMANENT},
 	{"emit_print", hjs_emitprint, 6, JSPROP_READONLY|JSPROP_PERMANENT},
 	{"emit_print_at", hjs_emitprintat, 7, JSPROP_READONLY|JSPROP_PERMANENT},
+	{"emit_print_batch", hjs_emitprintbatch, 2, JSPROP_READONLY|JSPROP_PERMANENT},
 	{"command", hjs_command, 1, JSPROP_READONLY|JSPROP_PERMANENT},
+	{"queue_command", hjs_queuecommand, 2, JSPROP_READONLY|JSPROP_PERMANENT},
+	{"queue_stats", hjs_queuestats, 0, JSPROP_READONLY|JSPROP_PERMANENT},
+	{"set_queue_rate", hjs_setqueuerate, 3, JSPROP_READONLY|JSPROP_PERMANENT},
+	{"clear_queue", hjs_clearqueue, 0, JSPROP_READONLY|JSPROP_PERMANENT},
 	{"nickcmp", hjs_nickcmp, 2, JSPROP_READONLY|JSPROP_PERMANENT},
 	{"strip", hjs_strip, 2, JSPROP_READONLY|JSPROP_PERMANENT},
 	{"get_info", hjs_getinfo, 1, JSPROP_READONLY|JSPROP_PERMANENT},
@@ -1377,17 +7869,49 @@ static JSFunctionSpec hexchat_functions[] = {
 	{"hook_print", hjs_hookprint, 5, JSPROP_READONLY|JSPROP_PERMANENT},
 	{"hook_special", hjs_hookspecial, 5, JSPROP_READONLY|JSPROP_PERMANENT},
 	{"hook_unload", hjs_hookunload, 2, JSPROP_READONLY|JSPROP_PERMANENT},
+	{"hook_shared", hjs_hookshared, 3, JSPROP_READONLY|JSPROP_PERMANENT},
+	{"get_reload_state", hjs_getreloadstate, 0, JSPROP_READONLY|JSPROP_PERMANENT},
 	{"unhook", hjs_unhook, 1, JSPROP_READONLY|JSPROP_PERMANENT},
 	{"get_list", hjs_getlist, 1, JSPROP_READONLY|JSPROP_PERMANENT},
+	{"get_list_delta", hjs_getlistdelta, 2, JSPROP_READONLY|JSPROP_PERMANENT},
+	{"count_list", hjs_countlist, 2, JSPROP_READONLY|JSPROP_PERMANENT},
+	{"get_list_serialized", hjs_getlistserialized, 3, JSPROP_READONLY|JSPROP_PERMANENT},
+	{"count_users", hjs_countusers, 0, JSPROP_READONLY|JSPROP_PERMANENT},
 	{"find_context", hjs_findcontext, 2, JSPROP_READONLY|JSPROP_PERMANENT},
 	{"get_context", hjs_getcontext, 0, JSPROP_READONLY|JSPROP_PERMANENT},
 	{"set_context", hjs_setcontext, 1, JSPROP_READONLY|JSPROP_PERMANENT},
+	{"with_context", hjs_withcontext, 3, JSPROP_READONLY|JSPROP_PERMANENT},
+	{"for_each_context", hjs_foreachcontext, 3, JSPROP_READONLY|JSPROP_PERMANENT},
 	{"set_pluginpref", hjs_setpluginpref, 2, JSPROP_READONLY|JSPROP_PERMANENT},
 	{"get_pluginpref", hjs_getpluginpref, 2, JSPROP_READONLY|JSPROP_PERMANENT},
 	{"list_pluginpref", hjs_listpluginpref, 0, JSPROP_READONLY|JSPROP_PERMANENT},
 	{"del_pluginpref", hjs_delpluginpref, 1, JSPROP_READONLY|JSPROP_PERMANENT},
+	{"set_pluginprefs", hjs_setpluginprefs, 1, JSPROP_READONLY|JSPROP_PERMANENT},
+	{"get_pluginprefs", hjs_getpluginprefs, 0, JSPROP_READONLY|JSPROP_PERMANENT},
+	{"pluginpref_transaction", hjs_pluginpreftransaction, 1, JSPROP_READONLY|JSPROP_PERMANENT},
+	{"set_pluginpref_buffer", hjs_setpluginprefbuffer, 2, JSPROP_READONLY|JSPROP_PERMANENT},
+	{"get_pluginpref_buffer", hjs_getpluginprefbuffer, 1, JSPROP_READONLY|JSPROP_PERMANENT},
+	{"set_kv", hjs_setkv, 2, JSPROP_READONLY|JSPROP_PERMANENT},
+	{"get_kv", hjs_getkv, 1, JSPROP_READONLY|JSPROP_PERMANENT},
+	{"del_kv", hjs_delkv, 1, JSPROP_READONLY|JSPROP_PERMANENT},
+	{"list_kv", hjs_listkv, 0, JSPROP_READONLY|JSPROP_PERMANENT},
+	{"range_kv", hjs_rangekv, 1, JSPROP_READONLY|JSPROP_PERMANENT},
+	{"set_kv_buffer", hjs_setkvbuffer, 2, JSPROP_READONLY|JSPROP_PERMANENT},
+	{"get_kv_buffer", hjs_getkvbuffer, 1, JSPROP_READONLY|JSPROP_PERMANENT},
+	{"read_buffer", hjs_readbuffer, 1, JSPROP_READONLY|JSPROP_PERMANENT},
+	{"write_buffer", hjs_writebuffer, 3, JSPROP_READONLY|JSPROP_PERMANENT},
+	{"shared_set", hjs_sharedset, 2, JSPROP_READONLY|JSPROP_PERMANENT},
+	{"shared_get", hjs_sharedget, 1, JSPROP_READONLY|JSPROP_PERMANENT},
+	{"shared_keys", hjs_sharedkeys, 0, JSPROP_READONLY|JSPROP_PERMANENT},
+	{"journal_append", hjs_journalappend, 2, JSPROP_READONLY|JSPROP_PERMANENT},
+	{"journal_config", hjs_journalconfig, 2, JSPROP_READONLY|JSPROP_PERMANENT},
+	{"journal_stats", hjs_journalstats, 0, JSPROP_READONLY|JSPROP_PERMANENT},
+	{"set_cache_budget", hjs_setcachebudget, 1, JSPROP_READONLY|JSPROP_PERMANENT},
 	/* convenience functions not part of api */
 	{"get_nickcolor", hjs_getnickcolor, 1, JSPROP_READONLY|JSPROP_PERMANENT},
+	{"set_nickcolor_palette", hjs_setnickcolorpalette, 1, JSPROP_READONLY|JSPROP_PERMANENT},
+	{"compile_format", hjs_compileformat, 1, JSPROP_READONLY|JSPROP_PERMANENT},
+	{"search_logs", hjs_searchlogs, 2, JSPROP_READONLY|JSPROP_PERMANENT},
 	{0, 0, 0, 0}
 };
 
@@ -1422,6 +7946,16 @@ js_init (JSContext **cx, JSRuntime **rt, JSObject **globals, bool fake)
 		if (!JS_DefineFunctions (*cx, *globals, hexchat_functions))
 			return 0;
 
+		if (!JS_InitClass (*cx, *globals, nullptr, &nickset_class, hjs_nickset_new, 1,
+							nullptr, nickset_methods, nullptr, nullptr)
+			|| !JS_InitClass (*cx, *globals, nullptr, &nickmap_class, hjs_nickmap_new, 1,
+							nullptr, nickmap_methods, nullptr, nullptr)
+			|| !JS_InitClass (*cx, *globals, nullptr, &table_class, hjs_table_new, 2,
+							nullptr, table_methods, nullptr, nullptr)
+			|| !JS_InitClass (*cx, *globals, nullptr, &cache_class, hjs_cache_new, 1,
+							nullptr, cache_methods, nullptr, nullptr))
+			return 0;
+
 		if (!(DEFINE_GLOBAL_PROP("VERSION", DOUBLE_TO_JSVAL(HJS_VERSION_FLOAT))
 			&& DEFINE_GLOBAL_PROP("EAT_NONE", INT_TO_JSVAL(HEXCHAT_EAT_NONE))
 			&& DEFINE_GLOBAL_PROP("EAT_HEXCHAT", INT_TO_JSVAL(HEXCHAT_EAT_HEXCHAT))
@@ -1430,6 +7964,7 @@ js_init (JSContext **cx, JSRuntime **rt, JSObject **globals, bool fake)
 			&& DEFINE_GLOBAL_PROP("STRIP_COLOR", INT_TO_JSVAL(1))
 			&& DEFINE_GLOBAL_PROP("STRIP_ATTR", INT_TO_JSVAL(2))
 			&& DEFINE_GLOBAL_PROP("STRIP_ALL", INT_TO_JSVAL(3))
+			&& DEFINE_GLOBAL_PROP("STRIP_HIDDEN", INT_TO_JSVAL(4))
 			&& DEFINE_GLOBAL_PROP("PRI_HIGHEST", INT_TO_JSVAL(HEXCHAT_PRI_HIGHEST))
 			&& DEFINE_GLOBAL_PROP("PRI_HIGH", INT_TO_JSVAL(HEXCHAT_PRI_HIGH))
 			&& DEFINE_GLOBAL_PROP("PRI_NORM", INT_TO_JSVAL(HEXCHAT_PRI_NORM))
@@ -1450,7 +7985,400 @@ js_deinit (JSContext *cx, JSRuntime *rt)
 		JS_DestroyRuntime(rt);
 }
 
-js_script::js_script (string file, string src)
+char*
+scratch_encoder::encode (JSString* str)
+{
+	size_t room = sizeof(scratch) - used;
+	size_t len = room ? JS_EncodeStringToBuffer (str, scratch + used, room - 1) : (size_t)-1;
+	char* ret;
+
+	// small strings are the common case, only allocate when out of room
+	if (len < room)
+	{
+		ret = scratch + used;
+		ret[len] = '\0';
+		used += len + 1;
+		return ret;
+	}
+
+	ret = JSSTRING_TO_CHAR(str);
+	allocated.push_back (ret);
+	return ret;
+}
+
+scratch_encoder::~scratch_encoder ()
+{
+	for (char* str : allocated)
+		JS_free(context, str);
+}
+
+JSString*
+string_cache::get (JSContext* context, const char* str)
+{
+	JSString* ret;
+
+	// long strings are messages, they won't repeat
+	if (str == nullptr || strlen (str) > 64)
+		return JS_NewStringCopyZ (context, str);
+
+	auto found = index.find (str);
+	if (found != index.end())
+	{
+		strings.splice (strings.begin(), strings, found->second);
+		return found->second->second;
+	}
+
+	ret = JS_NewStringCopyZ (context, str);
+	if (ret == nullptr)
+		return nullptr;
+
+	if (strings.size() >= capacity)
+	{
+		JS_RemoveStringRoot (context, &strings.back().second);
+		index.erase (strings.back().first);
+		strings.pop_back();
+	}
+
+	strings.push_front (make_pair (string(str), ret));
+	JS_AddNamedStringRoot (context, &strings.front().second, "string_cache");
+	index[str] = strings.begin();
+
+	return ret;
+}
+
+void
+string_cache::clear (JSContext* context)
+{
+	for (auto& entry : strings)
+		JS_RemoveStringRoot (context, &entry.second);
+
+	strings.clear();
+	index.clear();
+}
+
+bool
+value_cache::lookup (JSContext* context, unsigned int gen, const string& key, jsval* val)
+{
+	if (gen != generation)
+	{
+		clear (context);
+		generation = gen;
+		return false;
+	}
+
+	auto it = values.find (key);
+	if (it == values.end())
+		return false;
+
+	*val = it->second;
+	return true;
+}
+
+void
+value_cache::store (JSContext* context, const string& key, jsval val)
+{
+	auto it = values.find (key);
+
+	if (it == values.end())
+	{
+		it = values.insert (make_pair (key, val)).first;
+		JS_AddNamedValueRoot (context, &it->second, "value_cache");
+	}
+	else
+		it->second = val;
+}
+
+void
+value_cache::clear (JSContext* context)
+{
+	for (auto& entry : values)
+		JS_RemoveValueRoot (context, &entry.second);
+
+	values.clear();
+}
+
+/* Record file layout, integers in host byte order:
+ *   "HJR1"
+ *   records: uint32 key length, uint32 value length or RECORD_DELETED, key, value
+ * later records for a key replace earlier ones, compaction drops the stale ones */
+
+#define RECORD_MAGIC "HJR1"
+#define RECORD_DELETED 0xffffffffu
+
+void
+record_file::unmap ()
+{
+	if (data != nullptr)
+	{
+#ifdef _WIN32
+		UnmapViewOfFile (data);
+#else
+		munmap ((void*)data, mapped);
+#endif
+	}
+
+	data = nullptr;
+	mapped = 0;
+}
+
+bool
+record_file::remap ()
+{
+	unmap ();
+
+#ifdef _WIN32
+	HANDLE file = CreateFileA (path.c_str(), GENERIC_READ, FILE_SHARE_READ|FILE_SHARE_WRITE|FILE_SHARE_DELETE,
+								nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+	LARGE_INTEGER filesize;
+	HANDLE mapping;
+
+	if (file == INVALID_HANDLE_VALUE)
+		return false;
+
+	if (GetFileSizeEx (file, &filesize) && filesize.QuadPart > 0
+		&& (mapping = CreateFileMappingA (file, nullptr, PAGE_READONLY, 0, 0, nullptr)) != nullptr)
+	{
+		// the view keeps the file open on its own
+		data = (const char*)MapViewOfFile (mapping, FILE_MAP_READ, 0, 0, 0);
+		if (data != nullptr)
+			mapped = (size_t)filesize.QuadPart;
+		CloseHandle (mapping);
+	}
+	CloseHandle (file);
+#else
+	int fd = ::open (path.c_str(), O_RDONLY);
+	struct stat st;
+
+	if (fd == -1)
+		return false;
+
+	if (fstat (fd, &st) == 0 && st.st_size > 0)
+	{
+		void* view = mmap (nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+		if (view != MAP_FAILED)
+		{
+			data = (const char*)view;
+			mapped = st.st_size;
+		}
+	}
+	::close (fd);
+#endif
+
+	return data != nullptr;
+}
+
+bool
+record_file::load (const string& file)
+{
+	uint64_t pos = 0;
+
+	close ();
+	path = file;
+	size = 0;
+	garbage = 0;
+	index.clear();
+
+	// a missing file is just an empty one
+	if (!remap ())
+		return true;
+
+	if (mapped >= 4 && memcmp (data, RECORD_MAGIC, 4) == 0)
+	{
+		for (pos = 4; pos + 8 <= mapped;)
+		{
+			uint32 keylen, valuelen;
+
+			memcpy (&keylen, data + pos, sizeof(uint32));
+			memcpy (&valuelen, data + pos + 4, sizeof(uint32));
+
+			uint64_t end = pos + 8 + keylen + (valuelen == RECORD_DELETED ? 0 : valuelen);
+			if (end > mapped)
+				break;
+
+			string key (data + pos + 8, keylen);
+			auto found = index.find (key);
+
+			if (found != index.end())
+			{
+				garbage += 8 + keylen + found->second.second;
+				index.erase (found);
+			}
+
+			if (valuelen == RECORD_DELETED)
+				garbage += 8 + keylen;
+			else
+				index[key] = make_pair (pos + 8 + keylen, valuelen);
+
+			pos = end;
+		}
+	}
+	size = pos;
+
+	// torn by a crash while appending, rewrite what could be read
+	if (size != mapped)
+		return compact ();
+
+	return true;
+}
+
+bool
+record_file::append (const string& key, const char* value, uint32 valuelen)
+{
+	uint32 keylen = key.length();
+
+	if (out == nullptr)
+	{
+		out = fopen (path.c_str(), "ab");
+		if (out == nullptr)
+			return false;
+
+		if (size == 0)
+		{
+			fwrite (RECORD_MAGIC, 1, 4, out);
+			size = 4;
+		}
+	}
+
+	fwrite (&keylen, sizeof(uint32), 1, out);
+	fwrite (&valuelen, sizeof(uint32), 1, out);
+	fwrite (key.data(), 1, keylen, out);
+	if (valuelen != RECORD_DELETED)
+		fwrite (value, 1, valuelen, out);
+
+	if (ferror (out))
+		return false;
+
+	size += 8 + keylen + (valuelen == RECORD_DELETED ? 0 : valuelen);
+
+	return true;
+}
+
+bool
+record_file::get (const string& key, const char** value, size_t* len)
+{
+	auto found = index.find (key);
+
+	if (found == index.end())
+		return false;
+
+	// appended since the file was last mapped
+	if (found->second.first + found->second.second > mapped)
+	{
+		if (!sync () || !remap () || found->second.first + found->second.second > mapped)
+			return false;
+	}
+
+	*value = data + found->second.first;
+	*len = found->second.second;
+
+	return true;
+}
+
+bool
+record_file::put (const string& key, const char* value, size_t len)
+{
+	auto found = index.find (key);
+
+	if (len >= RECORD_DELETED || !append (key, value, (uint32)len))
+		return false;
+
+	if (found != index.end())
+		garbage += 8 + key.length() + found->second.second;
+
+	// the value is the last thing that was written
+	index[key] = make_pair (size - len, (uint32)len);
+
+	return true;
+}
+
+bool
+record_file::remove (const string& key)
+{
+	auto found = index.find (key);
+
+	if (found == index.end() || !append (key, nullptr, RECORD_DELETED))
+		return false;
+
+	garbage += 2 * (8 + key.length()) + found->second.second;
+	index.erase (found);
+
+	return true;
+}
+
+bool
+record_file::sync ()
+{
+	return out == nullptr || hjs_util_syncfile (out);
+}
+
+bool
+record_file::compact ()
+{
+	string tmppath = path + ".tmp";
+	map<string, pair<uint64_t, uint32>> compacted;
+	uint64_t pos = 4;
+	FILE* tmp;
+
+	if (!sync () || (size > mapped && !remap ()))
+		return false;
+
+	tmp = fopen (tmppath.c_str(), "wb");
+	if (tmp == nullptr)
+		return false;
+
+	fwrite (RECORD_MAGIC, 1, 4, tmp);
+	for (const auto& record : index)
+	{
+		uint32 keylen = record.first.length();
+		uint32 valuelen = record.second.second;
+
+		fwrite (&keylen, sizeof(uint32), 1, tmp);
+		fwrite (&valuelen, sizeof(uint32), 1, tmp);
+		fwrite (record.first.data(), 1, keylen, tmp);
+		fwrite (data + record.second.first, 1, valuelen, tmp);
+
+		compacted[record.first] = make_pair (pos + 8 + keylen, valuelen);
+		pos += 8 + keylen + valuelen;
+	}
+
+	bool failed = ferror (tmp) != 0 || !hjs_util_syncfile (tmp);
+	if (fclose (tmp) != 0 || failed)
+	{
+		::remove (tmppath.c_str());
+		return false;
+	}
+
+	// windows can't replace a file that is still open or mapped
+	if (out != nullptr)
+		fclose (out);
+	out = nullptr;
+	unmap ();
+
+	if (!hjs_util_replacefile (tmppath, path))
+	{
+		::remove (tmppath.c_str());
+		remap ();
+		return false;
+	}
+
+	index.swap (compacted);
+	size = pos;
+	garbage = 0;
+	remap ();
+
+	return true;
+}
+
+void
+record_file::close ()
+{
+	if (out != nullptr)
+		fclose (out);
+	out = nullptr;
+	unmap ();
+}
+
+js_script::js_script (string file, string src) : strings(1024)
 {
 	JSObject* fake_globals = nullptr;
 	JSContext* fake_context = nullptr;
@@ -1459,6 +8387,10 @@ js_script::js_script (string file, string src)
 	js_script_list.push_back(this);
 
 	filename = file;
+	buffer_prints = false;
+	reloading = false;
+	prefs = nullptr;
+	kv = nullptr;
 
 	// create a fake runtime to get the scripts name without actually running it, is there an easier way?
 	if (js_init (&fake_context, &fake_runtime, &fake_globals, true))
@@ -1473,7 +8405,13 @@ js_script::js_script (string file, string src)
 
 	// now the real thing..
 	if (js_init (&context, &runtime, &globals, false))
-		JS_EvaluateScript (context, globals, src.c_str(), src.length(), file.c_str(), 0, nullptr);
+	{
+		// an error at the top level unloads the script, so 'this' may be gone afterwards
+		JSContext* ctx = context;
+
+		JS_EvaluateScript (ctx, globals, src.c_str(), src.length(), file.c_str(), 0, nullptr);
+		hjs_script_flushprints (ctx);
+	}
 	else
 		hexchat_printf (ph, "\00320JavaScript Error:\017: Failed to initialize %s", name.c_str());
 }
@@ -1500,6 +8438,9 @@ js_script::remove_hook (script_hook* hook)
 
 js_script::~js_script ()
 {
+	// a state left over from an earlier reload is stale now
+	reload_states.erase (filename);
+
 	for (script_hook* hook : hooks)
 	{
 		if (hook->type == HOOK_UNLOAD)
@@ -1508,7 +8449,13 @@ js_script::~js_script ()
 			jsval argv[] = { OBJECT_TO_JSVAL(hook->userdata) };
 			jsval rval;
 
-			JS_CallFunction (hook->context, JS_GetGlobalForScopeChain (hook->context), fun, 1, argv, &rval);
+			if (JS_CallFunction (hook->context, JS_GetGlobalForScopeChain (hook->context), fun, 1, argv, &rval)
+				&& reloading && !JSVAL_IS_VOID(rval))
+				hjs_script_savestate (this, rval);
+		}
+		else if (hook->type == HOOK_SHARED)
+		{
+			hjs_shared_unwatch (hook);
 		}
 		else
 		{
@@ -1518,6 +8465,19 @@ js_script::~js_script ()
 		delete hook;
 	}
 
+	buffer_prints = false;
+	hjs_script_flushprints (this);
+	hjs_prefs_release (prefs);
+	hjs_kv_release (kv);
+
+	// nothing left to run the queued commands on behalf of
+	for (auto& entry : command_queues)
+		entry.second.commands.remove_if ([this](const queued_command& command) { return command.owner == this; });
+
+	info_cache.clear (context);
+	prefs_cache.clear (context);
+	strings.clear (context);
+
 	js_deinit (context, runtime);
 
 	if (gui != nullptr)
@@ -1541,6 +8501,17 @@ extern "C"
 		hexchat_hook_command (ph, "UNLOAD", HEXCHAT_PRI_NORM, hjs_unload_cb, nullptr, nullptr);
 		hexchat_hook_command (ph, "RELOAD", HEXCHAT_PRI_NORM, hjs_reload_cb, nullptr, nullptr);
 		hexchat_hook_command (ph, "JS", HEXCHAT_PRI_NORM, hjs_cmd_cb, help, nullptr);
+
+		// anything that can change a cached get_info or get_prefs value
+		for (const char* event : { "Your Nick Changing", "Change Nick", "You Join", "You Part",
+									"You Part with Reason", "You Kicked", "Topic", "Topic Change",
+									"Connected", "Disconnected", "Server Connected" })
+			hexchat_hook_print (ph, event, HEXCHAT_PRI_HIGHEST, hjs_invalidate_cb, &info_generation);
+		hexchat_hook_print (ph, "Close Context", HEXCHAT_PRI_HIGHEST, hjs_closecontext_cb, nullptr);
+		for (const char* numeric : { "001", "005", "305", "306" })
+			hexchat_hook_server (ph, numeric, HEXCHAT_PRI_HIGHEST, hjs_invalidate_cb, &info_generation);
+		hexchat_hook_command (ph, "SET", HEXCHAT_PRI_HIGHEST, hjs_invalidate_cb, nullptr, &prefs_generation);
+		hexchat_hook_server (ph, "005", HEXCHAT_PRI_HIGHEST, hjs_isupport_cb, nullptr);
 		hexchat_printf (ph, "%s version %s loaded.\n", name, version);
 
 		// allow avoiding autoload by passing anything
@@ -1558,6 +8529,12 @@ extern "C"
 	{
 		js_deinit (interp_cx, interp_rt);
 		hjs_script_cleanup ();
+		hjs_prefs_release (interp_prefs);
+		interp_prefs = nullptr;
+		hjs_kv_release (interp_kv);
+		interp_kv = nullptr;
+		hjs_journal_shutdown ();
+		hjs_log_shutdown ();
 		JS_ShutDown();
 		hexchat_printf (ph, "%s version %s unloaded.\n", name, version);
 